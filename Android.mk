@@ -31,13 +31,19 @@ LOCAL_SRC_FILES := \
 
 LOCAL_SRC_FILES += \
     data.cpp \
-    makelist.cpp \
     partition.cpp \
     partitionmanager.cpp \
     mtdutils/mtdutils.c \
+    digest/md5.c \
     twinstall.cpp \
     twrp-functions.cpp \
-    openrecoveryscript.cpp
+    openrecoveryscript.cpp \
+    twrpTar.cpp \
+    twrpDD.cpp \
+    twrpChunkStore.cpp \
+    twrpDU.cpp \
+    twrpProcCache.cpp \
+    twrpWipe.cpp
 
 ifneq ($(TARGET_RECOVERY_REBOOT_SRC),)
   LOCAL_SRC_FILES += $(TARGET_RECOVERY_REBOOT_SRC)
@@ -64,7 +70,7 @@ LOCAL_STATIC_LIBRARIES :=
 LOCAL_SHARED_LIBRARIES :=
 
 LOCAL_STATIC_LIBRARIES += libmtdutils
-LOCAL_STATIC_LIBRARIES += libminadbd libminzip libunz
+LOCAL_STATIC_LIBRARIES += libminadbd libminzip libunz libtwpigz libtwrawcopy
 LOCAL_STATIC_LIBRARIES += libminuitwrp libpixelflinger_static libpng libjpegtwrp libgui
 LOCAL_SHARED_LIBRARIES += libz libc libstlport libcutils libstdc++ libmincrypt libext4_utils
 
@@ -229,6 +235,7 @@ LOCAL_MODULE_TAGS := tests
 LOCAL_SRC_FILES := \
     verifier_test.cpp \
     verifier.cpp \
+    digest/md5.c \
     ui.cpp
 LOCAL_STATIC_LIBRARIES := \
     libmincrypt \
@@ -260,6 +267,7 @@ include $(commands_recovery_local_path)/libjpegtwrp/Android.mk \
     $(commands_recovery_local_path)/prebuilt/Android.mk \
     $(commands_recovery_local_path)/mtdutils/Android.mk \
     $(commands_recovery_local_path)/pigz/Android.mk \
+    $(commands_recovery_local_path)/rawcopy/Android.mk \
     $(commands_recovery_local_path)/crypto/cryptsettings/Android.mk \
     $(commands_recovery_local_path)/libcrecovery/Android.mk \
     $(commands_recovery_local_path)/twmincrypt/Android.mk
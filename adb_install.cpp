@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <stdio.h>
 
 #include "ui.h"
 #include "cutils/properties.h"
@@ -35,6 +36,7 @@ extern "C" {
 #include "twinstall.h"
 #include "data.h"
 int TWinstall_zip(const char* path, int* wipe_cache);
+void TWinstall_set_zip_sha1(const char* path, const unsigned char* sha1, size_t signed_len);
 }
 
 static RecoveryUI* ui = NULL;
@@ -134,5 +136,28 @@ int apply_from_adb(RecoveryUI* ui_, int* wipe_cache, const char* install_file)
         }
         return INSTALL_ERROR;
     }
+
+	// minadbd hashed the package as it arrived
+	FILE* fp = fopen(ADB_SIDELOAD_DIGEST_FILENAME, "r");
+	if (fp != NULL) {
+		char hex[41];
+		unsigned long long signed_len, size;
+		unsigned char sha1[20];
+		int i;
+
+		if (fscanf(fp, "%40s %llu %llu", hex, &signed_len, &size) == 3 && strlen(hex) == 40 && size == (unsigned long long)st.st_size) {
+			for (i = 0; i < 20; i++) {
+				unsigned int byte;
+
+				if (sscanf(hex + (i * 2), "%2x", &byte) != 1)
+					break;
+				sha1[i] = byte;
+			}
+			if (i == 20)
+				TWinstall_set_zip_sha1(install_file, sha1, signed_len);
+		}
+		fclose(fp);
+		unlink(ADB_SIDELOAD_DIGEST_FILENAME);
+	}
 	return TWinstall_zip(install_file, wipe_cache);
 }
@@ -59,6 +59,32 @@ map<string, string>                     DataManager::mConstValues;
 string                                  DataManager::mBackingFile;
 int                                     DataManager::mInitialized = 0;
 
+// Values are set and read by the backup threads as well as by the GUI. The
+// lock is recursive since the functions below call each other.
+static pthread_mutex_t values_lock;
+static pthread_once_t values_lock_once = PTHREAD_ONCE_INIT;
+
+static void Init_Values_Lock(void) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&values_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+// Holds values_lock until it goes out of scope
+class Values_Lock {
+public:
+	Values_Lock() {
+		pthread_once(&values_lock_once, Init_Values_Lock);
+		pthread_mutex_lock(&values_lock);
+	}
+	~Values_Lock() {
+		pthread_mutex_unlock(&values_lock);
+	}
+};
+
 // Device ID functions
 void DataManager::sanitize_device_id(char* device_id) {
 	const char* whitelist ="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890-._";
@@ -177,6 +203,8 @@ void DataManager::get_device_id(void) {
 
 int DataManager::ResetDefaults()
 {
+    Values_Lock lock;
+
     mValues.clear();
     mConstValues.clear();
     SetDefaultValues();
@@ -185,6 +213,7 @@ int DataManager::ResetDefaults()
 
 int DataManager::LoadValues(const string filename)
 {
+    Values_Lock lock;
     string str, dev_id;
 
 	if (!mInitialized)
@@ -256,11 +285,16 @@ int DataManager::Flush()
 
 int DataManager::SaveValues()
 {
-    if (mBackingFile.empty())       return -1;
+    {
+        Values_Lock lock;
+        if (mBackingFile.empty())       return -1;
+    }
 
+	// Mounting can take a while, so the values are not locked for it
 	string mount_path = GetSettingsStoragePath();
 	PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
 
+    Values_Lock lock;
 	FILE* out = fopen(mBackingFile.c_str(), "wb");
     if (!out)                       return -1;
 
@@ -287,6 +321,7 @@ int DataManager::SaveValues()
 
 int DataManager::GetValue(const string varName, string& value)
 {
+    Values_Lock lock;
     string localStr = varName;
 
     if (!mInitialized)
@@ -333,6 +368,8 @@ int DataManager::GetValue(const string varName, int& value)
 // This is a dangerous function. It will create the value if it doesn't exist so it has a valid c_str
 string& DataManager::GetValueRef(const string varName)
 {
+    Values_Lock lock;
+
     if (!mInitialized)
         SetDefaultValues();
 
@@ -369,26 +406,34 @@ int DataManager::GetIntValue(const string varName)
 
 int DataManager::SetValue(const string varName, string value, int persist /* = 0 */)
 {
-    if (!mInitialized)
-        SetDefaultValues();
+    int persisted;
 
     // Don't allow empty values or numerical starting values
     if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
         return -1;
 
-    map<string, string>::iterator constChk;
-    constChk = mConstValues.find(varName);
-    if (constChk != mConstValues.end())
-        return -1;
+    {
+        Values_Lock lock;
 
-    map<string, TStrIntPair>::iterator pos;
-    pos = mValues.find(varName);
-    if (pos == mValues.end())
-        pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
-    else
-        pos->second.first = value;
+        if (!mInitialized)
+            SetDefaultValues();
+
+        map<string, string>::iterator constChk;
+        constChk = mConstValues.find(varName);
+        if (constChk != mConstValues.end())
+            return -1;
+
+        map<string, TStrIntPair>::iterator pos;
+        pos = mValues.find(varName);
+        if (pos == mValues.end())
+            pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
+        else
+            pos->second.first = value;
+        persisted = pos->second.second;
+    }
 
-    if (pos->second.second != 0)
+    // Saving and the GUI update happen without the lock, the GUI reads values back
+    if (persisted != 0)
         SaveValues();
 
     gui_notifyVarChange(varName.c_str(), value.c_str());
@@ -433,6 +478,7 @@ int DataManager::SetValue(const string varName, float value, int persist /* = 0
 
 void DataManager::DumpValues()
 {
+    Values_Lock lock;
     map<string, TStrIntPair>::iterator iter;
     ui_print("Data Manager dump - Values with leading X are persisted.\n");
     for (iter = mValues.begin(); iter != mValues.end(); ++iter)
@@ -460,6 +506,7 @@ void DataManager::SetBackupFolder()
 
 void DataManager::SetDefaultValues()
 {
+    Values_Lock lock;
     string str, path;
 
     get_device_id();
@@ -732,7 +779,14 @@ void DataManager::SetDefaultValues()
     mValues.insert(make_pair(TW_FORCE_MD5_CHECK_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_COLOR_THEME_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_USE_COMPRESSION_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_COMPRESSION_THREADS_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_SPARSE_IMAGE_BACKUP_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_INCREMENTAL_BACKUP_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_DEDUP_BACKUP_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_BACKUP_THREADS_VAR, make_pair("1", 1)));
+    mValues.insert(make_pair(TW_DELTA_FLASH_VAR, make_pair("1", 1)));
 	mValues.insert(make_pair(TW_IGNORE_IMAGE_SIZE, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_SECURE_DISCARD_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_SHOW_SPAM_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_TIME_ZONE_VAR, make_pair("CST6CDT", 1)));
     mValues.insert(make_pair(TW_SORT_FILES_BY_DATE_VAR, make_pair("0", 1)));
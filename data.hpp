@@ -35,6 +35,7 @@ public:
     static int GetValue(const string varName, int& value);
 
     // This is a dangerous function. It will create the value if it doesn't exist so it has a valid c_str
+    // Reading the string it returns is not covered by the lock the other functions take
     static string& GetValueRef(const string varName);
 
     // Helper functions
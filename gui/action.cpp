@@ -21,6 +21,7 @@
 #include "../partitions.hpp"
 #include "../twrp-functions.hpp"
 #include "../openrecoveryscript.hpp"
+#include "../twrpDU.hpp"
 
 #include "../ui.h"
 #include "../adb_install.h"
@@ -651,6 +652,9 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
 		        DataManager::SetValue("tw_filename", zip_queue[i]);
 		        DataManager::SetValue(TW_ZIP_INDEX, (i + 1));
 
+				// The next zip is verified while this one installs
+				if (i + 1 < zip_queue_index)
+					TWinstall_set_next_zip(zip_queue[i + 1].c_str());
 				ret_val = flash_zip(zip_queue[i], arg, simulate, &wipe_cache);
 				if (ret_val != 0) {
 					ui_print("Error flashing zip '%s'\n", zip_queue[i].c_str());
@@ -658,6 +662,7 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
 					ret_val = 1;
 				}
 			}
+			TWinstall_set_next_zip(NULL);
 			zip_queue_index = 0;
 			DataManager::SetValue(TW_ZIP_QUEUE_COUNT, zip_queue_index);
 
@@ -777,6 +782,10 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
 					string Restore_Name;
 					DataManager::GetValue("tw_restore", Restore_Name);
 					ret = PartitionManager.Run_Restore(Restore_Name);
+				} else if (arg == "verify") {
+					string Restore_Name;
+					DataManager::GetValue("tw_restore", Restore_Name);
+					ret = PartitionManager.Verify_Backup(Restore_Name);
 				} else {
 					operation_end(1, simulate);
 					return -1;
@@ -882,6 +891,7 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
 				op_status = system(arg.c_str());
 				if (op_status != 0)
 					op_status = 1;
+				twrpDU::Drop_Cache();
 			}
 
 			operation_end(op_status, simulate);
@@ -1153,6 +1163,7 @@ void* GUIAction::command_thread(void *cookie)
 		}
 		fclose(fp);
 	}
+	twrpDU::Drop_Cache();
 	DataManager::SetValue("tw_operation_status", 0);
 	DataManager::SetValue("tw_operation_state", 1);
 	DataManager::SetValue("tw_terminal_state", 0);
@@ -14,6 +14,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
 
@@ -28,25 +29,14 @@ extern "C" {
 
 
 static std::vector<std::string> gConsole;
+// Backups can print from more than one thread
+static pthread_mutex_t gConsoleLock = PTHREAD_MUTEX_INITIALIZER;
 
-extern "C" void gui_print(const char *fmt, ...)
+// Adds each line of buf to the console, must be called with gConsoleLock held
+static void gui_console_append(char *buf)
 {
-    char buf[512];          // We're going to limit a single request to 512 bytes
-
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(buf, 512, fmt, ap);
-    va_end(ap);
-
-	fputs(buf, stdout);
-
     char *start, *next;
 
-	if (buf[0] == '\n' && strlen(buf) < 2) {
-		// This prevents the double lines bug seen in the console during zip installs
-		return;
-	}
-
     for (start = next = buf; *next != '\0'; next++)
     {
         if (*next == '\n')
@@ -65,7 +55,27 @@ extern "C" void gui_print(const char *fmt, ...)
     }
     std::string line = start;
     gConsole.push_back(line);
-    return;
+}
+
+extern "C" void gui_print(const char *fmt, ...)
+{
+    char buf[512];          // We're going to limit a single request to 512 bytes
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 512, fmt, ap);
+    va_end(ap);
+
+	fputs(buf, stdout);
+
+	if (buf[0] == '\n' && strlen(buf) < 2) {
+		// This prevents the double lines bug seen in the console during zip installs
+		return;
+	}
+
+	pthread_mutex_lock(&gConsoleLock);
+	gui_console_append(buf);
+	pthread_mutex_unlock(&gConsoleLock);
 }
 
 extern "C" void gui_print_overwrite(const char *fmt, ...)
@@ -79,29 +89,12 @@ extern "C" void gui_print_overwrite(const char *fmt, ...)
 
 	fputs(buf, stdout);
 
+	pthread_mutex_lock(&gConsoleLock);
     // Pop the last line, and we can continue
     if (!gConsole.empty())   gConsole.pop_back();
 
-    char *start, *next;
-    for (start = next = buf; *next != '\0'; next++)
-    {
-        if (*next == '\n')
-        {
-            *next = '\0';
-            next++;
-            
-            std::string line = start;
-            gConsole.push_back(line);
-            start = next;
-
-            // Handle the normal \n\0 case
-            if (*next == '\0')
-				return;
-        }
-    }
-    std::string line = start;
-    gConsole.push_back(line);
-    return;
+	gui_console_append(buf);
+	pthread_mutex_unlock(&gConsoleLock);
 }
 
 GUIConsole::GUIConsole(xml_node<>* node)
@@ -22,7 +22,12 @@
 #include "transport.h"  /* readx(), writex() */
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+/* Packets from the host may carry up to MAX_PAYLOAD bytes, which is
+** advertised in our CNXN message.  Hosts that predate larger payloads
+** only accept MAX_PAYLOAD_V1, so that is all we ever send.
+*/
+#define MAX_PAYLOAD_V1 4096
+#define MAX_PAYLOAD (256 * 1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -416,4 +421,11 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
 //#define ADB_SIDELOAD_FILENAME "/tmp/update.zip"
 extern char ADB_SIDELOAD_FILENAME[255];
 
+/* After a successful sideload this holds the SHA-1 of the part of the
+** package that its signature covers, the length of that part and the
+** package size, as "<40 hex digits> <signed length> <size>", hashed
+** while the package was received.
+*/
+#define ADB_SIDELOAD_DIGEST_FILENAME "/tmp/sideload.sha1"
+
 #endif
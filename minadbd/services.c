@@ -19,9 +19,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "sysdeps.h"
 #include "fdevent.h"
+#include "mincrypt/sha.h"
 
 #define  TRACE_TAG  TRACE_SERVICES
 #include "adb.h"
@@ -43,33 +45,100 @@ void *service_bootstrap_func(void *x)
     return 0;
 }
 
+/* The package goes to storage in large writes.  Its signature covers
+** everything but the zip comment, which is at most 64K plus its 2 byte
+** length, so everything before the last SIDELOAD_TAIL bytes is hashed
+** as it arrives and the rest once the comment length is known.  The
+** installer then only has to check the signature against the digest.
+*/
+#define SIDELOAD_BUFFER_SIZE (1024 * 1024)
+#define SIDELOAD_TAIL (65535 + 2)
+
+static void write_sideload_digest(const uint8_t *sha1, unsigned signed_len, unsigned size)
+{
+    char line[80];
+    int i, fd, len;
+
+    for(i = 0; i < SHA_DIGEST_SIZE; i++) {
+        sprintf(line + i * 2, "%02x", sha1[i]);
+    }
+    len = 40 + sprintf(line + 40, " %u %u\n", signed_len, size);
+
+    fd = adb_creat(ADB_SIDELOAD_DIGEST_FILENAME, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_DIGEST_FILENAME);
+        return;
+    }
+    writex(fd, line, len);
+    adb_close(fd);
+}
+
 static void sideload_service(int s, void *cookie)
 {
-    unsigned char buf[4096];
+    unsigned char *buf;
+    unsigned char footer[2];
     unsigned count = (unsigned) cookie;
+    unsigned size = count;
+    unsigned hashed = 0;
+    unsigned hash_limit = (size > SIDELOAD_TAIL) ? size - SIDELOAD_TAIL : 0;
+    SHA_CTX ctx;
     int fd;
 
     fprintf(stderr, "sideload_service invoked\n");
 
-    fd = adb_creat(ADB_SIDELOAD_FILENAME, 0644);
+    adb_unlink(ADB_SIDELOAD_DIGEST_FILENAME);
+    buf = malloc(SIDELOAD_BUFFER_SIZE);
+    if(buf == NULL) {
+        fprintf(stderr, "failed to allocate the sideload buffer\n");
+        adb_close(s);
+        return;
+    }
+    /* Opened for reading too, the tail is hashed from the file.
+    */
+    fd = adb_open_mode(ADB_SIDELOAD_FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if(fd < 0) {
         fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_FILENAME);
+        free(buf);
         adb_close(s);
         return;
     }
 
+    SHA_init(&ctx);
     while(count > 0) {
-        unsigned xfer = (count > 4096) ? 4096 : count;
+        unsigned xfer = (count > SIDELOAD_BUFFER_SIZE) ? SIDELOAD_BUFFER_SIZE : count;
         if(readx(s, buf, xfer)) break;
         if(writex(fd, buf, xfer)) break;
+        if(hashed < hash_limit) {
+            unsigned n = (hash_limit - hashed < xfer) ? hash_limit - hashed : xfer;
+            SHA_update(&ctx, buf, n);
+            hashed += n;
+        }
         count -= xfer;
     }
 
+    /* Finish the hash from the tail, which is still in the page cache.
+    */
+    if(count == 0 && size >= 2 &&
+            pread(fd, footer, 2, size - 2) == 2) {
+        unsigned signed_len = size - (footer[0] + (footer[1] << 8)) - 2;
+        while(hashed < signed_len && signed_len <= size) {
+            unsigned n = signed_len - hashed;
+            if(n > SIDELOAD_BUFFER_SIZE) n = SIDELOAD_BUFFER_SIZE;
+            if(pread(fd, buf, n, hashed) != (ssize_t)n) break;
+            SHA_update(&ctx, buf, n);
+            hashed += n;
+        }
+        if(hashed == signed_len) {
+            write_sideload_digest(SHA_final(&ctx), signed_len, size);
+        }
+    }
+
     if(count == 0) {
         writex(s, "OKAY", 4);
     } else {
         writex(s, "FAIL", 4);
     }
+    free(buf);
     adb_close(fd);
     adb_close(s);
 
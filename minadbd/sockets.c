@@ -313,7 +313,7 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
     if(ev & FDE_READ){
         apacket *p = get_apacket();
         unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        size_t avail = MAX_PAYLOAD_V1;
         int r;
         int is_eof = 0;
 
@@ -336,10 +336,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == MAX_PAYLOAD_V1) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = MAX_PAYLOAD_V1 - avail;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -503,7 +503,7 @@ void connect_to_remote(asocket *s, const char *destination)
     apacket *p = get_apacket();
     int len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (MAX_PAYLOAD_V1-1)) {
         fatal("destination oversized");
     }
 
@@ -79,16 +79,27 @@ static void *usb_open_thread(void *x)
     return 0;
 }
 
+/* The f_adb gadget driver rejects transfers larger than its 4K bulk
+** buffer, so payloads bigger than MAX_PAYLOAD_V1 are moved in pieces.
+*/
+#define USB_CHUNK_SIZE MAX_PAYLOAD_V1
+
 int usb_write(usb_handle *h, const void *data, int len)
 {
+    const char *p = data;
     int n;
 
     D("about to write (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_write(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while(len > 0) {
+        int xfer = (len > USB_CHUNK_SIZE) ? USB_CHUNK_SIZE : len;
+        n = adb_write(h->fd, p, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        p += xfer;
+        len -= xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -96,14 +107,20 @@ int usb_write(usb_handle *h, const void *data, int len)
 
 int usb_read(usb_handle *h, void *data, int len)
 {
+    char *p = data;
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while(len > 0) {
+        int xfer = (len > USB_CHUNK_SIZE) ? USB_CHUNK_SIZE : len;
+        n = adb_read(h->fd, p, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        p += xfer;
+        len -= xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -192,6 +192,49 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Read part of a file into a new anonymous memory segment.  Unlike
+ * sysMapFileSegmentInShmem() the offset is 64 bits wide, so this works
+ * past 4GB where mmap() with a 32-bit off_t can't reach.
+ *
+ * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
+ * value and does not disturb "pMap".
+ */
+int sysLoadFileSegmentInShmem(int fd, off64_t start, size_t length,
+    MemMapping* pMap)
+{
+    size_t actual = 0;
+    void* memPtr;
+
+    assert(pMap != NULL);
+
+    if (length == 0)
+        return -1;
+
+    memPtr = sysCreateAnonShmem(length);
+    if (memPtr == NULL)
+        return -1;
+
+    while (actual < length) {
+        ssize_t n = pread64(fd, (char*)memPtr + actual, length - actual,
+                start + actual);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGE("only read %d of %d bytes at %lld\n", (int) actual,
+                (int) length, (long long) start);
+            munmap(memPtr, length);
+            return -1;
+        }
+        actual += n;
+    }
+
+    pMap->baseAddr = pMap->addr = memPtr;
+    pMap->baseLength = pMap->length = length;
+
+    return 0;
+}
+
 /*
  * Release a memory mapping.
  */
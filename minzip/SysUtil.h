@@ -51,6 +51,15 @@ int sysMapFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
 
+/*
+ * Read part of a file, which may be past 4GB, into a new anonymous
+ * memory segment.
+ *
+ * On success, "pMap" is filled in, and zero is returned.
+ */
+int sysLoadFileSegmentInShmem(int fd, off64_t start, size_t length,
+    MemMapping* pMap);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
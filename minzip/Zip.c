@@ -3,13 +3,13 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <stdint.h>     // for uintptr_t
+#include <pthread.h>
+#include <stdint.h>     // for SIZE_MAX
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
@@ -25,6 +25,23 @@
 
 #define SORT_ENTRIES 1
 
+/*
+ * Most threads mzExtractRecursive() inflates files with, and how many
+ * created files may wait for one.
+ */
+#define EXTRACT_THREADS 4
+#define EXTRACT_QUEUE_SIZE 32
+
+/*
+ * Sizes and offsets in the central directory that are this value are
+ * in the Zip64 extra field instead.
+ */
+#define ZIP64_MAGICVAL 0xffffffffLL
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -57,6 +74,21 @@ enum {
     ENDOFF = 16,
     ENDCOM = 20,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,       // extra field holding the 64-bit values
+
     EXTSIG = 0x08074b50,     // PK78
     EXTHDR = 16,
 
@@ -91,72 +123,11 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n", pEntry->offset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
- */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
-{
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
-}
-
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
- */
-static int hashcmpZipName(const void* ventry, const void* vname)
-{
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
-}
-
-/*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
- */
-static unsigned int computeHash(const char* name, int nameLen)
-{
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
-
-    return hash;
-}
-
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
-{
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
-    }
-}
-
 static int validFilename(const char *fileName, unsigned int fileNameLen)
 {
     // Forbid super long filenames.
@@ -177,18 +148,85 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Read exactly "len" bytes from "offset" in the file.
+ */
+static bool readFully(int fd, void* buf, size_t len, off64_t offset)
+{
+    size_t actual = 0;
+
+    while (actual < len) {
+        ssize_t n = pread64(fd, (char*)buf + actual, len - actual,
+                offset + actual);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        actual += n;
+    }
+    return true;
+}
+
+/*
+ * Replace the sizes and offset of a central directory entry that are
+ * ZIP64_MAGICVAL with the 64-bit ones from its Zip64 extra field, which
+ * only holds the ones that didn't fit, in this order.
+ *
+ * Returns "true" if none of them is left as ZIP64_MAGICVAL.
+ */
+static bool readZip64Extra(const unsigned char* extra, unsigned int extraLen,
+        long long* pUncompLen, long long* pCompLen, long long* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+
+        if (size > extraLen - 4)
+            break;
+        if (id == ZIP64_EXTID) {
+            long long* values[3] = { pUncompLen, pCompLen, pLocalHdrOffset };
+            const unsigned char* p = extra + 4;
+            int i;
+
+            for (i = 0; i < 3; i++) {
+                if (*values[i] != ZIP64_MAGICVAL)
+                    continue;
+                if (size < 8)
+                    return false;
+                *values[i] = get8LE(p);
+                p += 8;
+                size -= 8;
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return *pUncompLen != ZIP64_MAGICVAL && *pCompLen != ZIP64_MAGICVAL &&
+            *pLocalHdrOffset != ZIP64_MAGICVAL;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * is in fact a Zip, we load the central directory and scan out its
+ * contents into a table sorted by name.
+ *
+ * Only the central directory is kept in memory.  The rest of the file
+ * is read with pread64() as entries are needed, so an archive bigger
+ * than the address space can still be opened.
  *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive, off64_t fileLength)
 {
     bool result = false;
+    unsigned char* tail = NULL;
+    unsigned char header[ZIP64_ENDHDR];
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* cdEnd;
+    size_t tailLen;
+    long long numEntries, cdSize, cdOffset;
+    unsigned int i;
     unsigned int val;
 
     /*
@@ -196,7 +234,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (!readFully(pArchive->fd, header, 4, 0)) {
+        LOGV("Unable to read Zip header\n");
+        goto bail;
+    }
+    val = get4LE(header);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,52 +249,96 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment.  The comment can't be longer than 64K, so only that much
+     * of the end of the file is read, along with room for a Zip64 locator
+     * in front of the EOCD.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    tailLen = 0xffff + ENDHDR + ZIP64_LOCHDR;
+    if ((off64_t)tailLen > fileLength)
+        tailLen = fileLength;
+    tail = (unsigned char*) malloc(tailLen);
+    if (tail == NULL ||
+            !readFully(pArchive->fd, tail, tailLen, fileLength - tailLen)) {
+        LOGW("Unable to read the end of the Zip\n");
+        goto bail;
+    }
+    ptr = tail + tailLen - ENDHDR;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    while (ptr >= tail) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < tail) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
 
     /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the size and file offset of the central
+     * directory.
      */
     numEntries = get2LE(ptr + ENDSUB);
+    cdSize = get4LE(ptr + ENDSIZ);
     cdOffset = get4LE(ptr + ENDOFF);
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    /*
+     * Archives past 4GB or with more than 64K entries have a Zip64 EOCD
+     * record with the full values, which the locator points to.
+     */
+    if (ptr - tail >= ZIP64_LOCHDR &&
+            get4LE(ptr - ZIP64_LOCHDR) == ZIP64_LOCSIG) {
+        unsigned long long end64Offset =
+                get8LE(ptr - ZIP64_LOCHDR + ZIP64_LOCOFF);
+
+        if (fileLength < ZIP64_ENDHDR ||
+                end64Offset > (unsigned long long)(fileLength - ZIP64_ENDHDR) ||
+                !readFully(pArchive->fd, header, ZIP64_ENDHDR, end64Offset) ||
+                get4LE(header) != ZIP64_ENDSIG) {
+            LOGW("Bad Zip64 end-of-central-directory at %llu\n", end64Offset);
+            goto bail;
+        }
+        numEntries = get8LE(header + ZIP64_ENDSUB);
+        cdSize = get8LE(header + ZIP64_ENDSIZ);
+        cdOffset = get8LE(header + ZIP64_ENDOFF);
+    }
+
+    LOGVV("numEntries=%lld cdOffset=%lld\n", numEntries, cdOffset);
+    if (numEntries <= 0 || (unsigned long long)numEntries > UINT_MAX / sizeof(ZipEntry) ||
+            cdOffset < 0 || cdOffset >= fileLength ||
+            cdSize < numEntries * CENHDR || cdSize > fileLength - cdOffset ||
+            (unsigned long long)cdSize > SIZE_MAX) {
+        LOGW("Invalid entries=%lld offset=%lld size=%lld (len=%lld)\n",
+            numEntries, cdOffset, cdSize, (long long) fileLength);
         goto bail;
     }
 
     /*
-     * Create data structures to hold entries.
+     * Load the central directory and create data structures to hold
+     * entries.  The entries point into the loaded directory for their
+     * names, and being sorted, they don't need a hash table for lookups.
      */
+    if (sysLoadFileSegmentInShmem(pArchive->fd, cdOffset, cdSize,
+            &pArchive->map) != 0) {
+        LOGW("Unable to load the central directory\n");
+        goto bail;
+    }
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
-    for (i = 0; i < numEntries; i++) {
+    ptr = pArchive->map.addr;
+    cdEnd = ptr + pArchive->map.length;
+    for (i = 0; i < pArchive->numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        long long localHdrOffset, compLen, uncompLen;
+        unsigned char localHdr[LOCHDR];
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (cdEnd - ptr < CENHDR) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -261,12 +347,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-        localHdrOffset = get4LE(ptr + CENOFF);
         fileNameLen = get2LE(ptr + CENNAM);
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if (cdEnd - ptr - CENHDR < fileNameLen + extraLen + commentLen) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -305,6 +390,8 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
                 } else if (diff > 0) {
                     high = mid - 1;
                 } else {
+                    LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                        fileNameLen, fileName);
                     high = mid;
                     break;
                 }
@@ -334,8 +421,6 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,74 +437,55 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
+        localHdrOffset = get4LE(ptr + CENOFF);
+        if ((compLen == ZIP64_MAGICVAL || uncompLen == ZIP64_MAGICVAL ||
+                localHdrOffset == ZIP64_MAGICVAL) &&
+                !readZip64Extra(ptr + CENHDR + fileNameLen, extraLen,
+                        &uncompLen, &compLen, &localHdrOffset)) {
+            LOGW("Missing Zip64 extra field (at %d)\n", i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+
+        // The values are untrusted, and the Zip64 ones may be negative.
+        if (compLen < 0 || uncompLen < 0 || localHdrOffset < 0 ||
+                localHdrOffset > fileLength - LOCHDR) {
+            LOGW("Bad offset to local header: %lld (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
+        if (!readFully(pArchive->fd, localHdr, LOCHDR, localHdrOffset) ||
+                get4LE(localHdr) != LOCSIG) {
             LOGW("Missed a local header sig (at %d)\n", i);
             goto bail;
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
+        if (compLen > fileLength - pEntry->offset) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
-     */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
-
     result = true;
 
 bail:
-    if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
-    }
+    free(tail);
     return result;
 }
 
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * The EOCD is found by reading the end of the file, and only the central
+ * directory it points to is loaded.  Entry data is read with pread64()
+ * later, so this works for archives of any size, Zip64 included.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -429,48 +495,39 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
+    off64_t fileLength;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
+    pArchive->fd = open(fileName, O_RDONLY | O_LARGEFILE, 0);
     if (pArchive->fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
-        goto bail;
-    }
-
-    if (map.length < ENDHDR) {
+    fileLength = lseek64(pArchive->fd, 0, SEEK_END);
+    if (fileLength < ENDHDR) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) fileLength);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive, fileLength)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -490,13 +547,44 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
-
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
+    pArchive->map.addr = NULL;
     pArchive->pEntries = NULL;
 }
 
+/*
+ * Find the first entry whose name is not sorted before prefix.  Since the
+ * entries are sorted, every entry that starts with prefix follows it.
+ */
+static unsigned int findFirstEntryWithPrefix(const ZipArchive *pArchive,
+        const char *prefix, unsigned int prefixLen)
+{
+#if SORT_ENTRIES
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + ((high - low) / 2);
+        const ZipEntry *pEntry = pArchive->pEntries + mid;
+        unsigned int cmpLen = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        int diff = memcmp(pEntry->fileName, prefix, cmpLen);
+
+        if (diff == 0) {
+            diff = (pEntry->fileNameLen < prefixLen) ? -1 : 0;
+        }
+        if (diff < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+#else
+    return 0;
+#endif
+}
+
 /*
  * Find a matching entry.
  *
@@ -505,10 +593,25 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int i;
+
+    for (i = findFirstEntryWithPrefix(pArchive, entryName, nameLen);
+            i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = pArchive->pEntries + i;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+        if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0) {
+            return pEntry;
+        }
+#if SORT_ENTRIES
+        /* A name sorts before everything it's a prefix of, so if it's
+         * there it's the first entry.
+         */
+        break;
+#endif
+    }
+    return NULL;
 }
 
 /*
@@ -523,27 +626,32 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
 }
 
 /* Call processFunction on the uncompressed data of a STORED entry.
+ * The data is read with pread64() so that several entries can be read
+ * at the same time without sharing the file offset.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
+    long long bytesLeft = pEntry->compLen;
+    off64_t offset = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
         size_t count;
         bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
+        if (bytesLeft > (long long)sizeof(buf)) {
             count = sizeof(buf);
+        } else {
+            count = bytesLeft;
         }
-        n = read(pArchive->fd, buf, count);
+        n = pread64(pArchive->fd, buf, count, offset);
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
         }
+        offset += n;
         ret = processFunction(buf, n, cookie);
         if (!ret) {
             return false;
@@ -557,12 +665,13 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
+    long long result = -1;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
+    long long compRemaining;
+    off64_t offset = pEntry->offset;
 
     compRemaining = pEntry->compLen;
 
@@ -600,18 +709,19 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     do {
         /* read as much as we can */
         if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
+            long getSize = (compRemaining > (long long)sizeof(readBuf)) ?
+                        (long)sizeof(readBuf) : (long)compRemaining;
+            LOGVV("+++ reading %ld bytes (%lld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = pread64(pArchive->fd, readBuf, getSize, offset);
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
             }
 
             compRemaining -= getSize;
+            offset += getSize;
 
             zstream.next_in = readBuf;
             zstream.avail_in = getSize;
@@ -652,7 +762,7 @@ z_bail:
 bail:
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
                 result, pEntry->uncompLen);
         return false;
     }
@@ -668,19 +778,15 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The archive's file offset is not used, so different entries of the same
+ * archive may be processed from several threads at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +801,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -812,7 +916,7 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    long long len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -907,6 +1011,179 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/* One regular file that has been created and is waiting to be inflated.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int fd;
+} MzExtractJob;
+
+/* The files of one mzExtractRecursive() call are created in the calling
+ * thread, which keeps the SELinux file creation context in one thread,
+ * and are inflated and written by the worker threads.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;
+    pthread_cond_t jobTaken;
+    MzExtractJob jobs[EXTRACT_QUEUE_SIZE];
+    unsigned int firstJob;
+    unsigned int numJobs;
+    bool done;                  // no more jobs will be queued
+    bool failed;                // a job failed, the rest are skipped
+
+    pthread_t threads[EXTRACT_THREADS];
+    int numThreads;
+} MzExtractPool;
+
+/* Call the callback for an extracted file, one thread at a time.
+ */
+static void reportExtracted(MzExtractPool *pool, const char *targetFile)
+{
+    if (pool->callback == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->callback(targetFile, pool->cookie);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Inflate the entry into the file that was created for it and close it.
+ */
+static bool runExtractJob(MzExtractPool *pool, MzExtractJob *job)
+{
+    bool ok = mzExtractZipEntryToFile(pool->pArchive, job->pEntry, job->fd);
+    close(job->fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    if (pool->timestamp != NULL && utime(job->targetFile, pool->timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", job->targetFile);
+    reportExtracted(pool, job->targetFile);
+    return true;
+}
+
+static void *extractThread(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->numJobs == 0 && !pool->done) {
+            pthread_cond_wait(&pool->jobReady, &pool->lock);
+        }
+        if (pool->numJobs == 0) {
+            break;
+        }
+        MzExtractJob job = pool->jobs[pool->firstJob];
+        pool->firstJob = (pool->firstJob + 1) % EXTRACT_QUEUE_SIZE;
+        pool->numJobs--;
+        pthread_cond_signal(&pool->jobTaken);
+        bool skip = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = true;
+        if (skip) {
+            close(job.fd);
+        } else {
+            ok = runExtractJob(pool, &job);
+        }
+        free(job.targetFile);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->failed = true;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void startExtractPool(MzExtractPool *pool, const ZipArchive *pArchive,
+        const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted, i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->pArchive = pArchive;
+    pool->timestamp = timestamp;
+    pool->callback = callback;
+    pool->cookie = cookie;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+    pthread_cond_init(&pool->jobTaken, NULL);
+
+    /* With a single core the calling thread inflates the files itself.
+     */
+    wanted = cpus > EXTRACT_THREADS ? EXTRACT_THREADS : (int)cpus;
+    for (i = 0; wanted > 1 && i < wanted; i++) {
+        if (pthread_create(&pool->threads[i], NULL, extractThread, pool) != 0) {
+            break;
+        }
+        pool->numThreads++;
+    }
+}
+
+/* Hand a created file to the workers, or inflate it right away if there
+ * are none.  Returns false once any file has failed.
+ */
+static bool queueExtractJob(MzExtractPool *pool, MzExtractJob *job)
+{
+    if (pool->numThreads == 0) {
+        bool ok = runExtractJob(pool, job);
+        free(job->targetFile);
+        if (!ok) {
+            pool->failed = true;
+        }
+        return ok;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->numJobs == EXTRACT_QUEUE_SIZE) {
+        pthread_cond_wait(&pool->jobTaken, &pool->lock);
+    }
+    pool->jobs[(pool->firstJob + pool->numJobs) % EXTRACT_QUEUE_SIZE] = *job;
+    pool->numJobs++;
+    pthread_cond_signal(&pool->jobReady);
+    bool ok = !pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Wait for the queued files and stop the workers.  Returns false if any
+ * file failed.
+ */
+static bool finishExtractPool(MzExtractPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = true;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->numThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->jobTaken);
+    pthread_cond_destroy(&pool->jobReady);
+    pthread_mutex_destroy(&pool->lock);
+    return !pool->failed;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -925,6 +1202,9 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *     /tmp/two
  *     /tmp/d/three
  *
+ * Regular files are inflated by up to EXTRACT_THREADS threads, so the
+ * callback may be called from any of them, but never concurrently.
+ *
  * Returns true on success, false on failure.
  */
 bool mzExtractRecursive(const ZipArchive *pArchive,
@@ -977,15 +1257,17 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    MzExtractPool pool;
+    startExtractPool(&pool, pArchive, timestamp, callback, cookie);
+
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath, starting from the first one that can match.
      */
     unsigned int i;
     bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+    for (i = findFirstEntryWithPrefix(pArchive, zpath, zipDirLen);
+            i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
@@ -1035,10 +1317,23 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         /* With DRY_RUN set, invoke the callback but don't do anything else.
          */
         if (flags & MZ_EXTRACT_DRY_RUN) {
-            if (callback != NULL) callback(targetFile, cookie);
+            reportExtracted(&pool, targetFile);
             continue;
         }
 
+#if SORT_ENTRIES
+        /* Two entries with the same name would be written to the same file
+         * at once.  They sort next to each other and the last one wins, as
+         * it did when they were extracted in order.
+         */
+        if (i + 1 < pArchive->numEntries &&
+                pEntry[1].fileNameLen == pEntry->fileNameLen &&
+                memcmp(pEntry[1].fileName, pEntry->fileName,
+                        pEntry->fileNameLen) == 0) {
+            continue;
+        }
+#endif
+
         /* Create the file or directory.
          */
 #define UNZIP_DIRMODE 0755
@@ -1055,6 +1350,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 }
                 LOGD("Extracted dir \"%s\"\n", targetFile);
             }
+            reportExtracted(&pool, targetFile);
         } else {
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
@@ -1110,6 +1406,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
+                reportExtracted(&pool, targetFile);
             } else {
                 /* The entry is a regular file.
                  * Open the target for writing.
@@ -1140,27 +1437,28 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
+                /* The helper's buffer is reused for the next entry.
+                 */
+                MzExtractJob job;
+                job.pEntry = pEntry;
+                job.fd = fd;
+                job.targetFile = strdup(targetFile);
+                if (job.targetFile == NULL) {
+                    close(fd);
                     ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                if (!queueExtractJob(&pool, &job)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
-
-        if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (!finishExtractPool(&pool)) {
+        ok = false;
+    }
     free(helper.buf);
     free(zpath);
 
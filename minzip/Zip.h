@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 #ifdef __cplusplus
@@ -28,17 +28,15 @@ struct selabel_handle;
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
  *
- * TODO: we're now keeping the pages mapped so we don't have to copy the
- * filename.  We can change the accessors to retrieve the various pieces
- * directly from the source file instead of copying them out, for a very
- * slight speed hit and a modest reduction in memory usage.
+ * The filename points into the loaded central directory, so it isn't
+ * copied.  Offsets and lengths are 64 bits wide for Zip64 archives.
  */
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    long long    offset;
+    long long    compLen;
+    long long    uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -48,13 +46,15 @@ typedef struct ZipEntry {
 
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * Only the central directory is held in memory, entry data is read from
+ * "fd" with pread64() when it's needed.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    ZipEntry*   pEntries;       // sorted by name for mzFindZipEntry()
+    MemMapping  map;            // the central directory
 } ZipArchive;
 
 /*
@@ -125,10 +125,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -4,7 +4,9 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	mmcutils.c
+	mmcutils.c \
+	../rawcopy/rawcopy.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../rawcopy
 
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
@@ -18,7 +20,9 @@ LOCAL_CFLAGS += -DBOARD_HAS_LARGE_FILESYSTEM
 endif
 
 LOCAL_SRC_FILES := \
-mmcutils.c
+mmcutils.c \
+../rawcopy/rawcopy.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../rawcopy
 
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
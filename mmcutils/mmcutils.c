@@ -40,6 +40,7 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "rawcopy.h"
 
 unsigned ext3_count = 0;
 char *ext3_partitions[] = {"system", "userdata", "cache", "NONE"};
@@ -419,108 +420,20 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
 }
 
 int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+mmc_raw_dump_internal (const char* in_file, const char *out_file) {
+    // Large aligned buffers with the read and write overlapped, synced once at the end
+    if (raw_copy_file(in_file, out_file, RAW_COPY_DIRECT | RAW_COPY_SYNC, NULL) < 0) {
+        printf("Failed to copy %s to %s\n", in_file, out_file);
+        return -1;
     }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return 0;
 }
 
-
 int
-mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_raw_dump_internal(in_file, partition->device_index);
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition *partition, char *out_file) {
     return mmc_raw_dump_internal(partition->device_index, out_file);
@@ -44,6 +44,10 @@ struct MtdWriteContext {
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    int delta;       // only erase and write blocks that changed
+    char *compare;   // what a block held before, for delta writes
+    int skipped;     // blocks left alone because they already matched
 };
 
 typedef struct {
@@ -367,6 +371,9 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->bad_block_offsets = NULL;
     ctx->bad_block_alloc = 0;
     ctx->bad_block_count = 0;
+    ctx->delta = 0;
+    ctx->compare = NULL;
+    ctx->skipped = 0;
 
     ctx->buffer = malloc(partition->erase_size);
     if (ctx->buffer == NULL) {
@@ -397,6 +404,41 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+// Delta writes leave the device alone when a block already holds this
+// data, which saves an erase cycle and the write for each unchanged block.
+void mtd_write_set_delta(MtdWriteContext *ctx, int delta)
+{
+    if (delta && ctx->compare == NULL) {
+        ctx->compare = malloc(ctx->partition->erase_size);
+        if (ctx->compare == NULL) return;
+    }
+    ctx->delta = delta;
+}
+
+int mtd_write_skipped(const MtdWriteContext *ctx)
+{
+    return ctx->skipped;
+}
+
+// Returns 1 if the block at pos already holds data (or is erased, when data
+// is NULL), leaving the file offset just past it.
+static int block_matches(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    ssize_t size = ctx->partition->erase_size;
+    if (lseek(ctx->fd, pos, SEEK_SET) != pos ||
+        read(ctx->fd, ctx->compare, size) != size) {
+        lseek(ctx->fd, pos, SEEK_SET);
+        return 0;
+    }
+    if (data != NULL) return memcmp(data, ctx->compare, size) == 0;
+
+    ssize_t i;
+    for (i = 0; i < size; ++i) {
+        if (ctx->compare[i] != (char) 0xff) return 0;
+    }
+    return 1;
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -418,6 +460,11 @@ static int write_block(MtdWriteContext *ctx, const char *data)
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (ctx->delta && block_matches(ctx, pos, data)) {
+            ctx->skipped++;
+            return 0;
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
@@ -524,6 +571,12 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (ctx->delta && block_matches(ctx, pos, NULL)) {
+            ctx->skipped++;
+            pos += ctx->partition->erase_size;
+            continue;  // Already erased.
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = ctx->partition->erase_size;
@@ -543,6 +596,7 @@ int mtd_write_close(MtdWriteContext *ctx)
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
+    free(ctx->compare);
     free(ctx->buffer);
     free(ctx);
     return r;
@@ -603,6 +657,7 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         printf("error writing %s", partition_name);
         return -1;
     }
+    mtd_write_set_delta(ctx, 1);
 
     int success = 1;
     char* buffer = malloc(BUFSIZ);
@@ -622,6 +677,7 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "error erasing blocks of %s\n", partition_name);
     }
+    printf("skipped %d unchanged blocks of %s\n", mtd_write_skipped(ctx), partition_name);
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "error closing write of %s\n", partition_name);
     }
@@ -53,6 +53,12 @@ off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* compare each block with what the partition already holds and only erase
+ * and write the ones that differ, mtd_write_skipped() counts the rest.
+ */
+void mtd_write_set_delta(MtdWriteContext *, int delta);
+int mtd_write_skipped(const MtdWriteContext *);
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
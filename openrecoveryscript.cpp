@@ -33,6 +33,7 @@
 
 #include "twrp-functions.hpp"
 #include "partitions.hpp"
+#include "twrpDU.hpp"
 #include "common.h"
 #include "openrecoveryscript.hpp"
 #include "variables.h"
@@ -111,6 +112,7 @@ int OpenRecoveryScript::run_script_file(void) {
 			}
 			if (strcmp(command, "install") == 0) {
 				// Install Zip
+				Prefetch_Next_Install(fp);
 				ret_val = Install_Command(value);
 				install_cmd = -1;
 			} else if (strcmp(command, "wipe") == 0) {
@@ -330,6 +332,7 @@ int OpenRecoveryScript::run_script_file(void) {
 			} else if (strcmp(command, "cmd") == 0) {
 				if (cindex != 0) {
 					system(value);
+					twrpDU::Drop_Cache();
 				} else {
 					LOGE("No value given for cmd\n");
 				}
@@ -340,6 +343,7 @@ int OpenRecoveryScript::run_script_file(void) {
 				ret_val = 1;
 			}
 		}
+		TWinstall_set_next_zip(NULL);
 		fclose(fp);
 		ui_print("Done processing script file\n");
 	} else {
@@ -420,6 +424,28 @@ int OpenRecoveryScript::Install_Command(string Zip) {
 	return ret_val;
 }
 
+void OpenRecoveryScript::Prefetch_Next_Install(FILE* fp) {
+	char script_line[SCRIPT_COMMAND_SIZE];
+	long pos = ftell(fp);
+	string Zip;
+
+	// Only the line right after this one is considered, anything in
+	// between could change storage.  Relative paths are left to
+	// Install_Command since finding them can switch storage.
+	while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL) {
+		if (strlen(script_line) < 2)
+			continue;
+		if (strncmp(script_line, "install /", 9) == 0) {
+			Zip = script_line + 8;
+			while (!Zip.empty() && (Zip[Zip.size() - 1] == '\n' || Zip[Zip.size() - 1] == '\r'))
+				Zip.resize(Zip.size() - 1);
+			TWinstall_set_next_zip(Zip.c_str());
+		}
+		break;
+	}
+	fseek(fp, pos, SEEK_SET);
+}
+
 string OpenRecoveryScript::Locate_Zip_File(string Zip, string Storage_Root) {
 	string Path = TWFunc::Get_Path(Zip);
 	string File = TWFunc::Get_Filename(Zip);
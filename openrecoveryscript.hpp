@@ -23,6 +23,7 @@
 #ifndef _OPENRECOVERYSCRIPT_HPP
 #define _OPENRECOVERYSCRIPT_HPP
 
+#include <stdio.h>
 #include <string>
 
 using namespace std;
@@ -34,6 +35,7 @@ public:
 	static int check_for_script_file();                                            // Checks to see if the ORS file is present in /cache
 	static int run_script_file();                                                  // Executes the commands in the ORS file
 	static int Install_Command(string Zip);                                        // Installs a zip
+	static void Prefetch_Next_Install(FILE* fp);                                   // Lets the next install line's zip be verified while the current one installs
 	static string Locate_Zip_File(string Path, string File);                       // Attempts to locate the zip file in storage
 	static int Backup_Command(string Options);                                     // Runs a backup
 
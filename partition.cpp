@@ -26,8 +26,14 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
+#include <algorithm>
 
 #ifdef TW_INCLUDE_CRYPTO
 	#include "cutils/properties.h"
@@ -38,12 +44,43 @@
 #include "partitions.hpp"
 #include "data.hpp"
 #include "twrp-functions.hpp"
-#include "makelist.hpp"
+#include "twrpTar.hpp"
+#include "twrpDD.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpDU.hpp"
+#include "twrpProcCache.hpp"
+#include "twrpWipe.hpp"
+#include "rawcopy/rawcopy.h"
 extern "C" {
 	#include "mtdutils/mtdutils.h"
 	#include "mtdutils/mounts.h"
 }
 
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12,125)
+#endif
+
+// Backup folders are passed with and without a trailing slash
+static string Strip_Trailing_Slashes(string Path) {
+	while (Path.size() > 1 && Path[Path.size() - 1] == '/')
+		Path.resize(Path.size() - 1);
+	return Path;
+}
+
+// The chunk store is shared by the backups of every device in TWRP/BACKUPS
+static string Chunk_Store_Folder(void) {
+	string Backups_Folder;
+
+	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, Backups_Folder);
+	return TWFunc::Get_Path(Strip_Trailing_Slashes(Backups_Folder)) + CHUNK_STORE_FOLDER;
+}
+
 TWPartition::TWPartition(void) {
 	Can_Be_Mounted = false;
 	Can_Be_Wiped = false;
@@ -55,6 +92,7 @@ TWPartition::TWPartition(void) {
 	Symlink_Path = "";
 	Symlink_Mount_Point = "";
 	Mount_Point = "";
+	Real_Mount_Point = "";
 	Backup_Path = "";
 	Actual_Block_Device = "";
 	Primary_Block_Device = "";
@@ -82,6 +120,7 @@ TWPartition::TWPartition(void) {
 	Current_File_System = "";
 	Fstab_File_System = "";
 	Format_Block_Size = 0;
+	Backup_Bytes_Processed = 0;
 }
 
 TWPartition::~TWPartition(void) {
@@ -396,12 +435,18 @@ bool TWPartition::Make_Dir(string Path, bool Display_Error) {
 
 void TWPartition::Setup_File_System(bool Display_Error) {
 	struct statfs st;
+	char real_path[PATH_MAX];
 
 	Can_Be_Mounted = true;
 	Can_Be_Wiped = true;
 
 	// Make the mount point folder if it doesn't exist
 	Make_Dir(Mount_Point, Display_Error);
+	// The mount table lists canonical paths, resolved here once instead of on every Is_Mounted
+	if (realpath(Mount_Point.c_str(), real_path) != NULL)
+		Real_Mount_Point = real_path;
+	else
+		Real_Mount_Point = Mount_Point;
 	Display_Name = Mount_Point.substr(1, Mount_Point.size() - 1);
 	Backup_Name = Display_Name;
 	Backup_Method = FILES;
@@ -473,44 +518,15 @@ void TWPartition::Mount_Storage_Retry(void) {
 }
 
 bool TWPartition::Find_MTD_Block_Device(string MTD_Name) {
-	FILE *fp = NULL;
-	char line[255];
+	string device = twrpProcCache::Get_MTD_Block_Device(MTD_Name);
 
-	fp = fopen("/proc/mtd", "rt");
-	if (fp == NULL) {
-		LOGE("Device does not support /proc/mtd\n");
+	if (device.empty()) {
+		if (access("/proc/mtd", F_OK) != 0)
+			LOGE("Device does not support /proc/mtd\n");
 		return false;
 	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		char device[32], label[32];
-		unsigned long size = 0;
-		char* fstype = NULL;
-		int deviceId;
-
-		sscanf(line, "%s %lx %*s %*c%s", device, &size, label);
-
-		// Skip header and blank lines
-		if ((strcmp(device, "dev:") == 0) || (strlen(line) < 8))
-			continue;
-
-		// Strip off the trailing " from the label
-		label[strlen(label)-1] = '\0';
-
-		if (strcmp(label, MTD_Name.c_str()) == 0) {
-			// We found our device
-			// Strip off the trailing : from the device
-			device[strlen(device)-1] = '\0';
-			if (sscanf(device,"mtd%d", &deviceId) == 1) {
-				sprintf(device, "/dev/block/mtdblock%d", deviceId);
-				Primary_Block_Device = device;
-			}
-		}
-	}
-	fclose(fp);
-
-	return false;
+	Primary_Block_Device = device;
+	return true;
 }
 
 bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
@@ -536,86 +552,15 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 	return true;
 }
 
-bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
-
-	if (!Mount(Display_Error))
-		return false;
-
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	system(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGI("Unable to open /tmp/dfoutput.txt.\n");
-		return false;
-	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
-
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
-		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
-		}
-
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
-	}
-	fclose(fp);
-	return true;
-}
-
 bool TWPartition::Find_Partition_Size(void) {
-	FILE* fp;
-	char line[512];
-	string tmpdevice;
+	unsigned long long blocks_size;
 
 	// In this case, we'll first get the partitions we care about (with labels)
-	fp = fopen("/proc/partitions", "rt");
-	if (fp == NULL)
-		return false;
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long major, minor, blocks;
-		char device[512];
-		char tmpString[64];
-
-		if (strlen(line) < 7 || line[0] == 'm')	 continue;
-		sscanf(line + 1, "%lu %lu %lu %s", &major, &minor, &blocks, device);
-
-		tmpdevice = "/dev/block/";
-		tmpdevice += device;
-		if (tmpdevice == Primary_Block_Device || tmpdevice == Alternate_Block_Device) {
-			// Adjust block size to byte size
-			Size = blocks * 1024ULL;
-			fclose(fp);
-			return true;
-		}
+	if (twrpProcCache::Get_Block_Size(Primary_Block_Device, &blocks_size) ||
+		(!Alternate_Block_Device.empty() && twrpProcCache::Get_Block_Size(Alternate_Block_Device, &blocks_size))) {
+		Size = blocks_size;
+		return true;
 	}
-	fclose(fp);
 	return false;
 }
 
@@ -625,6 +570,12 @@ bool TWPartition::Is_Mounted(void) {
 
 	struct stat st1, st2;
 	string test_path;
+	int mounted;
+
+	// The mount table is only read again when the kernel says it changed
+	mounted = twrpProcCache::Is_Mounted(Real_Mount_Point);
+	if (mounted >= 0)
+		return mounted == 1;
 
 	// Check to see if the mount point directory exists
 	test_path = Mount_Point + "/.";
@@ -722,6 +673,9 @@ bool TWPartition::Wipe() {
 	if (Has_Data_Media)
 		return Wipe_Data_Without_Wiping_Media();
 
+	if (Backup_Method == DD)
+		return Wipe_DD();
+
 	int check;
 	DataManager::GetValue(TW_RM_RF_VAR, check);
 	if (check)
@@ -747,17 +701,13 @@ bool TWPartition::Wipe_AndSec(void) {
 	if (!Has_Android_Secure)
 		return false;
 
-	char cmd[512];
+	twrpWipe wipe;
 
 	if (!Mount(true))
 		return false;
 
-	ui_print("Using rm -rf on .android_secure\n");
-	sprintf(cmd, "rm -rf %s/.android_secure/* && rm -rf %s/.android_secure/.*", Mount_Point.c_str(), Mount_Point.c_str());
-
-	LOGI("rm -rf command is: '%s'\n", cmd);
-	system(cmd);
-    return true;
+	ui_print("Removing all files under .android_secure\n");
+	return wipe.Remove_Contents(Mount_Point + "/.android_secure");
 }
 
 bool TWPartition::Backup(string backup_folder) {
@@ -772,32 +722,60 @@ bool TWPartition::Backup(string backup_folder) {
 }
 
 bool TWPartition::Check_MD5(string restore_folder) {
+	vector<string> Files;
+	vector<string>::iterator file;
+
+	if (!Get_Archive_Files(restore_folder, Files))
+		return false;
+	for (file = Files.begin(); file != Files.end(); file++) {
+		if (!Check_Archive_File(*file))
+			return false;
+	}
+	return true;
+}
+
+bool TWPartition::Get_Archive_Files(string restore_folder, vector<string>& Files) {
+	vector<string> Chain;
+	vector<string>::iterator folder;
 	string Full_Filename;
 	char split_filename[512];
-	int index = 0;
+	int index;
 
-	Full_Filename = restore_folder + "/" + Backup_FileName;
-	if (!TWFunc::Path_Exists(Full_Filename)) {
+	// An incremental backup is only good if everything it builds on is too
+	if (!Get_Backup_Chain(restore_folder, Chain))
+		return false;
+	for (folder = Chain.begin(); folder != Chain.end(); folder++) {
+		Full_Filename = *folder + "/" + Backup_FileName;
+		if (TWFunc::Path_Exists(Full_Filename) || twrpChunkStore::Has_Index(Full_Filename)) {
+			Files.push_back(Full_Filename);
+			continue;
+		}
 		// This is a split archive, we presume
+		index = 0;
 		sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
-		while (index < 1000 && TWFunc::Path_Exists(split_filename)) {
-			if (TWFunc::Check_MD5(split_filename) == 0) {
-				LOGE("MD5 failed to match on '%s'.\n", split_filename);
-				return false;
-			}
+		while (index < TAR_MAX_SEGMENTS && TWFunc::Path_Exists(split_filename)) {
+			Files.push_back(split_filename);
 			index++;
 			sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
 		}
-		return true;
-	} else {
-		// Single file archive
-		if (TWFunc::Check_MD5(Full_Filename) == 0) {
-			LOGE("MD5 failed to match on '%s'.\n", split_filename);
+	}
+	return true;
+}
+
+bool TWPartition::Check_Archive_File(string File) {
+	if (!TWFunc::Path_Exists(File) && twrpChunkStore::Has_Index(File)) {
+		// Every chunk is checked against the SHA-1 it is stored under
+		if (!twrpChunkStore::Verify_Index(File)) {
+			LOGE("Chunk store check failed on '%s'.\n", File.c_str());
 			return false;
-		} else
-			return true;
+		}
+		return true;
 	}
-	return false;
+	if (TWFunc::Check_MD5(File) == 0) {
+		LOGE("MD5 failed to match on '%s'.\n", File.c_str());
+		return false;
+	}
+	return true;
 }
 
 bool TWPartition::Restore(string restore_folder) {
@@ -872,6 +850,17 @@ void TWPartition::Check_FS_Type() {
 	if (!Is_Present)
 		return;
 
+	// Check_FS_Type runs before every mount, so the superblock is read
+	// directly and blkid is only run for file systems we don't recognize
+	string Probed_FS = TWFunc::Probe_FS_Type(Actual_Block_Device);
+	if (!Probed_FS.empty()) {
+		if (Current_File_System != Probed_FS) {
+			LOGI("'%s' was '%s' now set to '%s'\n", Mount_Point.c_str(), Current_File_System.c_str(), Probed_FS.c_str());
+			Current_File_System = Probed_FS;
+		}
+		return;
+	}
+
 	if (TWFunc::Path_Exists("/tmp/blkidoutput.txt"))
 		system("rm /tmp/blkidoutput.txt");
 
@@ -941,7 +930,12 @@ bool TWPartition::Wipe_EXT23() {
 
 		ui_print("Formatting %s using mke2fs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		sprintf(command, "mke2fs -t %s -m 0 %s", Current_File_System.c_str(), Actual_Block_Device.c_str());
+		Discard_Block_Device(false);
+		// Leave the inode tables to the kernel's lazy init instead of zeroing every block group now
+		if (Current_File_System == "ext4")
+			sprintf(command, "mke2fs -t ext4 -m 0 -E lazy_itable_init=1 %s", Actual_Block_Device.c_str());
+		else
+			sprintf(command, "mke2fs -t %s -m 0 %s", Current_File_System.c_str(), Actual_Block_Device.c_str());
 		LOGI("mke2fs command: %s\n", command);
 		if (system(command) == 0) {
 			Recreate_AndSec_Folder();
@@ -966,6 +960,7 @@ bool TWPartition::Wipe_EXT4() {
 
 		ui_print("Formatting %s using make_ext4fs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
+		Discard_Block_Device(false);
 		Command = "make_ext4fs";
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
@@ -999,6 +994,7 @@ bool TWPartition::Wipe_FAT() {
 
 		ui_print("Formatting %s using mkdosfs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
+		Discard_Block_Device(false);
 		sprintf(command,"mkdosfs %s", Actual_Block_Device.c_str()); // use mkdosfs to format it
 		if (system(command) == 0) {
 			Recreate_AndSec_Folder();
@@ -1048,23 +1044,108 @@ bool TWPartition::Wipe_MTD() {
     return true;
 }
 
+bool TWPartition::Discard_Block_Device(bool Zero_Fill) {
+	unsigned long long range[2], size = 0;
+	unsigned int zeroes = 0;
+	int fd, secure;
+
+	DataManager::GetValue(TW_SECURE_DISCARD_VAR, secure);
+	fd = open(Actual_Block_Device.c_str(), O_RDWR);
+	if (fd < 0) {
+		LOGI("Unable to open '%s' to discard (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+		LOGI("Unable to get the size of '%s' (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	// Keep the space that make_ext4fs leaves out, like a crypto footer
+	range[0] = 0;
+	range[1] = size;
+	if (!Is_Decrypted && Length > 0 && (unsigned long long)Length < size)
+		range[1] = Length;
+	else if (!Is_Decrypted && Length < 0 && (unsigned long long)(-Length) < size)
+		range[1] = size + Length;
+
+	if (ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, &range) == 0) {
+		LOGI("%s %llu bytes of '%s'\n", secure ? "Securely discarded" : "Discarded", range[1], Actual_Block_Device.c_str());
+		// A secure discard is only good enough for a wipe if it reads back as zeros
+		if (!Zero_Fill || (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes)) {
+			close(fd);
+			return true;
+		}
+	} else {
+		LOGI("Unable to discard '%s' (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+		// The formatter overwrites what matters, only a secure wipe needs the old data gone
+		if (!Zero_Fill && !secure) {
+			close(fd);
+			return false;
+		}
+	}
+
+	const size_t buffer_size = 1024 * 1024;
+	unsigned long long pos = 0;
+	char* buffer;
+
+	buffer = (char*)calloc(1, buffer_size);
+	if (buffer == NULL) {
+		LOGE("Unable to allocate memory to zero '%s'\n", Actual_Block_Device.c_str());
+		close(fd);
+		return false;
+	}
+	ui_print("Writing zeros to %s...\n", Display_Name.c_str());
+	while (pos < range[1]) {
+		size_t len = buffer_size;
+		ssize_t written;
+
+		if (range[1] - pos < len)
+			len = range[1] - pos;
+		written = pwrite64(fd, buffer, len, pos);
+		if (written <= 0) {
+			if (written < 0 && errno == EINTR)
+				continue;
+			LOGE("Unable to zero '%s' at %llu (%s)\n", Actual_Block_Device.c_str(), pos, strerror(errno));
+			free(buffer);
+			close(fd);
+			return false;
+		}
+		pos += written;
+	}
+	free(buffer);
+	fsync(fd);
+	close(fd);
+	return true;
+}
+
+bool TWPartition::Wipe_DD() {
+	ui_print("Wiping %s...\n", Display_Name.c_str());
+	Find_Actual_Block_Device();
+	if (!Discard_Block_Device(true)) {
+		LOGE("Unable to wipe '%s'.\n", Mount_Point.c_str());
+		return false;
+	}
+	ui_print("Done.\n");
+	return true;
+}
+
 bool TWPartition::Wipe_RMRF() {
-	char cmd[512];
+	twrpWipe wipe;
+	bool ret;
 
 	if (!Mount(true))
 		return false;
 
-	ui_print("Using rm -rf on '%s'\n", Mount_Point.c_str());
-	sprintf(cmd, "rm -rf %s/* && rm -rf %s/.*", Mount_Point.c_str(), Mount_Point.c_str());
-
-	LOGI("rm -rf command is: '%s'\n", cmd);
-	system(cmd);
+	ui_print("Removing all files under '%s'\n", Mount_Point.c_str());
+	wipe.Set_Progress(true);
+	ret = wipe.Remove_Contents(Mount_Point);
 	Recreate_AndSec_Folder();
-    return true;
+	return ret;
 }
 
 bool TWPartition::Wipe_Data_Without_Wiping_Media() {
-	char cmd[256];
+	twrpWipe wipe;
 
 	// This handles wiping data on devices with "sdcard" in /data/media
 	if (!Mount(true))
@@ -1072,34 +1153,25 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 
 	ui_print("Wiping data without wiping /data/media ...\n");
 
-	DIR* d;
-	d = opendir("/data");
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)   continue;
-			// The media folder is the "internal sdcard"
-			// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
-			//    the media folder for multi-user.
-			if (strcmp(de->d_name, "media") == 0 || strcmp(de->d_name, ".layout_version") == 0)   continue;
-
-			sprintf(cmd, "rm -fr /data/%s", de->d_name);
-			system(cmd);
-		}
-		closedir(d);
+	// The media folder is the "internal sdcard"
+	// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
+	//    the media folder for multi-user.
+	wipe.Add_Exclusion("media");
+	wipe.Add_Exclusion(".layout_version");
+	wipe.Set_Progress(true);
+	if (wipe.Remove_Contents("/data")) {
 		ui_print("Done.\n");
 		return true;
 	}
-	ui_print("Dirent failed to open /data, error!\n");
+	ui_print("Unable to wipe everything in /data, error!\n");
 	return false;
 }
 
 bool TWPartition::Backup_Tar(string backup_folder) {
-	char back_name[255], split_index[5];
-	string Full_FileName, Split_FileName, Tar_Args, Command;
-	int use_compression, index, backup_count;
-	struct stat st;
-	unsigned long long total_bsize = 0, file_size;
+	char back_name[255];
+	string Full_FileName;
+	int use_compression, compression_threads, skip_md5, incremental, dedup;
+	twrpTar tar;
 
 	if (!Mount(true))
 		return false;
@@ -1113,73 +1185,162 @@ bool TWPartition::Backup_Tar(string backup_folder) {
 	}
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
-	if (use_compression)
-		Tar_Args = "-cz";
-	else
-		Tar_Args = "-c";
+	DataManager::GetValue(TW_COMPRESSION_THREADS_VAR, compression_threads);
+	DataManager::GetValue(TW_SKIP_MD5_GENERATE_VAR, skip_md5);
+	DataManager::GetValue(TW_INCREMENTAL_BACKUP_VAR, incremental);
+	DataManager::GetValue(TW_DEDUP_BACKUP_VAR, dedup);
 
 	sprintf(back_name, "%s.%s.win", Backup_Name.c_str(), Current_File_System.c_str());
 	Backup_FileName = back_name;
+	Backup_Bytes_Processed = 0;
 
-	if (Backup_Size > MAX_ARCHIVE_SIZE) {
-		// This backup needs to be split into multiple archives
-		ui_print("Breaking backup file into multiple archives...\nGenerating file lists\n");
-		sprintf(back_name, "%s", Backup_Path.c_str());
-		backup_count = MakeList::Make_File_List(back_name);
-		if (backup_count < 1) {
-			LOGE("Error generating file list!\n");
-			return false;
+	Full_FileName = backup_folder + "/" + Backup_FileName;
+	tar.Set_Dir(Backup_Path);
+	tar.Set_Filename(Full_FileName);
+	tar.Set_Compression(use_compression != 0);
+	tar.Set_Compression_Threads(compression_threads);
+	tar.Set_MD5(skip_md5 == 0);
+	if (Has_Data_Media)
+		tar.Set_Exclude("/data/media");
+	if (incremental) {
+		// Every backup gets a manifest so that the next one can build on it
+		string Previous = Find_Previous_Backup(backup_folder);
+
+		tar.Set_Manifest(Full_FileName + ".manifest");
+		if (!Previous.empty()) {
+			string Previous_Folder = TWFunc::Get_Path(Strip_Trailing_Slashes(backup_folder)) + Previous;
+
+			if (tar.Set_Previous_Manifest(Previous_Folder + "/" + Backup_FileName + ".manifest", Previous))
+				ui_print(" * Incremental backup on top of '%s'\n", Previous.c_str());
 		}
-		for (index=0; index<backup_count; index++) {
-			sprintf(split_index, "%03i", index);
-			Full_FileName = backup_folder + "/" + Backup_FileName + split_index;
-			Command = "tar " + Tar_Args + " -f '" + Full_FileName + "' -T /tmp/list/filelist" + split_index;
-			LOGI("Backup command: '%s'\n", Command.c_str());
-			ui_print("Backup archive %i of %i...\n", (index + 1), backup_count);
-			system(Command.c_str()); // sending backup command formed earlier above
-
-			file_size = TWFunc::Get_File_Size(Full_FileName);
-			if (file_size == 0) {
-				LOGE("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str()); // oh noes! file size is 0, abort! abort!
-				return false;
-			}
-			total_bsize += file_size;
+	}
+	if (dedup) {
+		// Only chunks that are not in the store yet are written, the backup keeps an index
+		tar.Set_Chunk_Store(Chunk_Store_Folder());
+	} else if (Backup_Size > MAX_ARCHIVE_SIZE) {
+		// The archive is split into .win000, .win001... files while it is written
+		ui_print("Breaking backup file into multiple archives...\n");
+		tar.Set_Split_Size(MAX_ARCHIVE_SIZE);
+	}
+	if (tar.Create_Tar() != 0) {
+		LOGE("Error creating backup archive '%s'\n", Full_FileName.c_str());
+		return false;
+	}
+	Backup_Bytes_Processed = tar.Get_Bytes_Processed();
+	if (tar.Get_Archive_Size() == 0) {
+		LOGE("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
+		return false;
+	}
+	if (!dedup && Backup_Size > MAX_ARCHIVE_SIZE)
+		ui_print(" * %i archives, total size: %llu bytes.\n", tar.Get_Segment_Count(), tar.Get_Archive_Size());
+	if (incremental && tar.Get_Unchanged_Count() > 0)
+		ui_print(" * %i unchanged files left out.\n", tar.Get_Unchanged_Count());
+	return true;
+}
+
+string TWPartition::Find_Previous_Backup(string backup_folder) {
+	string Folder = Strip_Trailing_Slashes(backup_folder);
+	string Parent_Folder = TWFunc::Get_Path(Folder), Current = TWFunc::Get_Filename(Folder), Previous;
+	time_t newest = 0;
+	DIR* d;
+	struct dirent* de;
+
+	d = opendir(Parent_Folder.c_str());
+	if (d == NULL)
+		return "";
+	while ((de = readdir(d)) != NULL) {
+		string Manifest;
+		struct stat st;
+
+		if (de->d_name[0] == '.' || Current == de->d_name)
+			continue;
+		Manifest = Parent_Folder + de->d_name + "/" + Backup_FileName + ".manifest";
+		if (stat(Manifest.c_str(), &st) == 0 && st.st_mtime >= newest) {
+			newest = st.st_mtime;
+			Previous = de->d_name;
 		}
-		ui_print(" * Total size: %llu bytes.\n", total_bsize);
-		system("cd /tmp && rm -rf list");
-	} else {
-		Full_FileName = backup_folder + "/" + Backup_FileName;
-		if (Has_Data_Media)
-			Command = "cd " + Backup_Path + " && tar " + Tar_Args + " ./ --exclude='media*' -f '" + Full_FileName + "'";
-		else
-			Command = "cd " + Backup_Path + " && tar " + Tar_Args + " -f '" + Full_FileName + "' ./*";
-		LOGI("Backup command: '%s'\n", Command.c_str());
-		system(Command.c_str());
-		if (TWFunc::Get_File_Size(Full_FileName) == 0) {
-			LOGE("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
+	}
+	closedir(d);
+	return Previous;
+}
+
+bool TWPartition::Get_Backup_Chain(string restore_folder, vector<string>& Chain) {
+	string Folder = Strip_Trailing_Slashes(restore_folder), Parent;
+
+	Chain.clear();
+	Chain.push_back(Folder);
+	while (!(Parent = twrpTar::Get_Manifest_Parent(Folder + "/" + Backup_FileName + ".manifest")).empty()) {
+		Folder = TWFunc::Get_Path(Folder) + Parent;
+		if (Chain.size() >= TAR_MAX_SEGMENTS || find(Chain.begin(), Chain.end(), Folder) != Chain.end()) {
+			LOGE("Incremental backup chain for '%s' loops.\n", restore_folder.c_str());
+			return false;
+		}
+		if (!TWFunc::Path_Exists(Folder + "/" + Backup_FileName) && !TWFunc::Path_Exists(Folder + "/" + Backup_FileName + "000") && !twrpChunkStore::Has_Index(Folder + "/" + Backup_FileName)) {
+			LOGE("Backup '%s' needed to restore '%s' is missing.\n", Folder.c_str(), restore_folder.c_str());
 			return false;
 		}
+		Chain.insert(Chain.begin(), Folder);
 	}
 	return true;
 }
 
 bool TWPartition::Backup_DD(string backup_folder) {
 	char back_name[255];
-	string Full_FileName, Command;
-	int use_compression;
+	string Full_FileName;
+	int use_compression = 0, use_sparse = 0, skip_md5 = 0, dedup = 0;
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, "Backing Up");
 	ui_print("Backing up %s...\n", Display_Name.c_str());
 
-	sprintf(back_name, "%s.%s.win", Backup_Name.c_str(), Current_File_System.c_str());
+	DataManager::GetValue(TW_SPARSE_IMAGE_BACKUP_VAR, use_sparse);
+	use_sparse = use_sparse && twrpDD::Is_Ext4(Actual_Block_Device);
+	// Older builds only list files ending in .win for restore, so they can't
+	// mistake a sparse image for a raw one and dd it onto the partition
+	sprintf(back_name, "%s.%s.%s", Backup_Name.c_str(), Current_File_System.c_str(), use_sparse ? "sparse.win" : "win");
 	Backup_FileName = back_name;
 
 	Full_FileName = backup_folder + "/" + Backup_FileName;
 
-	Command = "dd if=" + Actual_Block_Device + " of='" + Full_FileName + "'";
-	LOGI("Backup command: '%s'\n", Command.c_str());
-	system(Command.c_str());
-	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
+	DataManager::GetValue(TW_DEDUP_BACKUP_VAR, dedup);
+	if (dedup) {
+		twrpChunkStore Store;
+		bool ret;
+
+		DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
+		if (!Store.Create_Index(Chunk_Store_Folder(), Full_FileName, use_compression != 0))
+			return false;
+		if (use_sparse)
+			ret = twrpDD::Backup_Sparse(Actual_Block_Device, Full_FileName, false, &Backup_Bytes_Processed, &Store);
+		else
+			ret = twrpDD::Backup_Raw(Actual_Block_Device, &Store, &Backup_Bytes_Processed);
+		if (!ret || !Store.Close_Index()) {
+			LOGE("Unable to back up '%s' to the chunk store.\n", Actual_Block_Device.c_str());
+			return false;
+		}
+		return true;
+	}
+	if (use_sparse) {
+		// Only the allocated blocks of the file system are stored
+		DataManager::GetValue(TW_SKIP_MD5_GENERATE_VAR, skip_md5);
+		LOGI("Backing up '%s' as a sparse image.\n", Actual_Block_Device.c_str());
+		if (twrpDD::Backup_Sparse(Actual_Block_Device, Full_FileName, skip_md5 == 0, &Backup_Bytes_Processed, NULL))
+			return true;
+		LOGI("Sparse backup of '%s' failed, making a full image instead.\n", Actual_Block_Device.c_str());
+		unlink(Full_FileName.c_str());
+		unlink((Full_FileName + ".md5").c_str());
+		sprintf(back_name, "%s.%s.win", Backup_Name.c_str(), Current_File_System.c_str());
+		Backup_FileName = back_name;
+		Full_FileName = backup_folder + "/" + Backup_FileName;
+	}
+
+	LOGI("Copying '%s' to '%s'\n", Actual_Block_Device.c_str(), Full_FileName.c_str());
+	long long copied = raw_copy_file(Actual_Block_Device.c_str(), Full_FileName.c_str(), RAW_COPY_DIRECT | RAW_COPY_SYNC, NULL);
+	if (copied < 0) {
+		LOGE("Unable to back up '%s'.\n", Actual_Block_Device.c_str());
+		return false;
+	}
+	Backup_Bytes_Processed = copied;
+	if (Backup_Bytes_Processed == 0) {
 		LOGE("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
 		return false;
 	}
@@ -1202,7 +1363,8 @@ bool TWPartition::Backup_Dump_Image(string backup_folder) {
 	Command = "dump_image " + MTD_Name + " '" + Full_FileName + "'";
 	LOGI("Backup command: '%s'\n", Command.c_str());
 	system(Command.c_str());
-	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
+	Backup_Bytes_Processed = TWFunc::Get_File_Size(Full_FileName);
+	if (Backup_Bytes_Processed == 0) {
 		// Actual size may not match backup size due to bad blocks on MTD devices so just check for 0 bytes
 		LOGE("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
 		return false;
@@ -1212,9 +1374,10 @@ bool TWPartition::Backup_Dump_Image(string backup_folder) {
 
 bool TWPartition::Restore_Tar(string restore_folder) {
 	size_t first_period, second_period;
-	string Restore_File_System, Full_FileName, Command;
-	int index = 0;
-	char split_index[5];
+	string Restore_File_System, Full_FileName;
+	vector<string> Chain;
+	vector<string>::iterator folder;
+	int check_md5;
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	LOGI("Restore filename is: %s\n", Backup_FileName.c_str());
@@ -1247,51 +1410,100 @@ bool TWPartition::Restore_Tar(string restore_folder) {
 		return false;
 
 	ui_print("Restoring %s...\n", Display_Name.c_str());
-	Full_FileName = restore_folder + "/" + Backup_FileName;
-	if (!TWFunc::Path_Exists(Full_FileName)) {
-		// Backup is multiple archives
-		LOGI("Backup is multiple archives.\n");
-		sprintf(split_index, "%03i", index);
-		Full_FileName = restore_folder + "/" + Backup_FileName + split_index;
-		while (TWFunc::Path_Exists(Full_FileName)) {
-			ui_print("Restoring archive %i...\n", index + 1);
-			Command = "tar -xf '" + Full_FileName + "'";
-			LOGI("Restore command: '%s'\n", Command.c_str());
-			system(Command.c_str());
-			index++;
-			sprintf(split_index, "%03i", index);
-			Full_FileName = restore_folder + "/" + Backup_FileName + split_index;
-		}
-		if (index == 0) {
-			LOGE("Error locating restore file: '%s'\n", Full_FileName.c_str());
+	// An incremental backup is replayed on top of every backup it builds on, oldest first
+	if (!Get_Backup_Chain(restore_folder, Chain))
+		return false;
+	DataManager::GetValue(TW_SKIP_MD5_CHECK_VAR, check_md5);
+	for (folder = Chain.begin(); folder != Chain.end(); folder++) {
+		twrpTar tar;
+
+		Full_FileName = *folder + "/" + Backup_FileName;
+		if (Chain.size() > 1)
+			ui_print(" * Applying '%s'...\n", TWFunc::Get_Filename(*folder).c_str());
+		if (folder != Chain.begin() && !twrpTar::Apply_Deletions(Full_FileName + ".manifest"))
+			return false;
+		// Split backups (.win000, .win001...) are extracted one archive at a time
+		tar.Set_Dir(Backup_Path);
+		tar.Set_Filename(Full_FileName);
+		// The MD5 is checked as the archive is read instead of in a separate pass
+		tar.Set_Verify(check_md5 > 0);
+		if (tar.Extract_Tar() != 0) {
+			LOGE("Error extracting '%s'\n", Full_FileName.c_str());
+			if (tar.Get_Verify_Failed()) {
+				// Don't leave files from a damaged backup behind
+				ui_print("Wiping %s after failed MD5 check...\n", Display_Name.c_str());
+				if (Has_Android_Secure)
+					Wipe_AndSec();
+				else
+					Wipe();
+			}
 			return false;
 		}
-	} else {
-		Command = "cd " + Backup_Path + " && tar -xf '" + Full_FileName + "'";
-		LOGI("Restore command: '%s'\n", Command.c_str());
-		system(Command.c_str());
 	}
 	return true;
 }
 
 bool TWPartition::Restore_DD(string restore_folder) {
-	string Full_FileName, Command;
+	string Full_FileName;
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	ui_print("Restoring %s...\n", Display_Name.c_str());
 	Full_FileName = restore_folder + "/" + Backup_FileName;
-	Command = "dd bs=4096 if='" + Full_FileName + "' of=" + Actual_Block_Device;
-	LOGI("Restore command: '%s'\n", Command.c_str());
-	system(Command.c_str());
+	if (!TWFunc::Path_Exists(Full_FileName) && twrpChunkStore::Has_Index(Full_FileName)) {
+		unsigned long long skipped = 0;
+
+		// The image is streamed straight from the chunk store to the device
+		if (!twrpDD::Restore_Chunks(Full_FileName, Actual_Block_Device, &skipped))
+			return false;
+		if (skipped > 0)
+			LOGI("Skipped %llu MB of unused blocks.\n", skipped / 1048576);
+		return true;
+	}
+	if (twrpDD::Is_Sparse_Image(Full_FileName)) {
+		unsigned long long skipped = 0;
+
+		if (!twrpDD::Restore_Sparse(Full_FileName, Actual_Block_Device, &skipped))
+			return false;
+		LOGI("Skipped %llu MB of unused blocks.\n", skipped / 1048576);
+		return true;
+	}
+	if (Backup_FileName.find(".sparse.win") != string::npos) {
+		LOGE("'%s' is not a valid sparse image.\n", Full_FileName.c_str());
+		return false;
+	}
+	LOGI("Copying '%s' to '%s'\n", Full_FileName.c_str(), Actual_Block_Device.c_str());
+	int flags = RAW_COPY_DIRECT | RAW_COPY_SYNC, delta_flash;
+	unsigned long long skipped = 0;
+	long long copied;
+
+	// Only the blocks that differ from what the device already holds are written
+	DataManager::GetValue(TW_DELTA_FLASH_VAR, delta_flash);
+	if (delta_flash)
+		flags |= RAW_COPY_DELTA;
+	copied = raw_copy_file(Full_FileName.c_str(), Actual_Block_Device.c_str(), flags, &skipped);
+	if (copied < 0) {
+		LOGE("Unable to restore '%s'.\n", Actual_Block_Device.c_str());
+		return false;
+	}
+	if (delta_flash)
+		LOGI("Skipped %llu of %llu unchanged blocks.\n", skipped / RAW_COPY_DELTA_BLOCK, (copied + RAW_COPY_DELTA_BLOCK - 1) / RAW_COPY_DELTA_BLOCK);
 	return true;
 }
 
 bool TWPartition::Restore_Flash_Image(string restore_folder) {
 	string Full_FileName, Command;
+	int delta_flash;
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	ui_print("Restoring %s...\n", Display_Name.c_str());
 	Full_FileName = restore_folder + "/" + Backup_FileName;
+	DataManager::GetValue(TW_DELTA_FLASH_VAR, delta_flash);
+	if (delta_flash && mtd_scan_partitions() > 0) {
+		const MtdPartition* mtd = mtd_find_partition_by_name(MTD_Name.c_str());
+
+		if (mtd != NULL)
+			return Restore_MTD_Delta(mtd, Full_FileName);
+	}
 	// Sometimes flash image doesn't like to flash due to the first 2KB matching, so we erase first to ensure that it flashes
 	Command = "erase_image " + MTD_Name;
 	LOGI("Erase command: '%s'\n", Command.c_str());
@@ -1302,8 +1514,53 @@ bool TWPartition::Restore_Flash_Image(string restore_folder) {
 	return true;
 }
 
+bool TWPartition::Restore_MTD_Delta(const MtdPartition* mtd, string Full_FileName) {
+	MtdWriteContext* ctx;
+	bool success = true;
+	ssize_t len;
+	size_t total_blocks;
+	int fd, skipped;
+	char* buffer;
+
+	fd = open(Full_FileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGE("Unable to open '%s'.\n", Full_FileName.c_str());
+		return false;
+	}
+	ctx = mtd_write_partition(mtd);
+	buffer = (char*)malloc(RAW_COPY_BUFFER_SIZE);
+	if (ctx == NULL || buffer == NULL) {
+		LOGE("Unable to write to MTD partition '%s'.\n", MTD_Name.c_str());
+		if (ctx != NULL)
+			mtd_write_close(ctx);
+		free(buffer);
+		close(fd);
+		return false;
+	}
+	// Erase blocks that already match are neither erased nor rewritten
+	mtd_write_set_delta(ctx, 1);
+	while (success && (len = read(fd, buffer, RAW_COPY_BUFFER_SIZE)) > 0)
+		success = mtd_write_data(ctx, buffer, len) == len;
+	if (len < 0)
+		success = false;
+	free(buffer);
+	close(fd);
+	if (success && mtd_erase_blocks(ctx, -1) == -1)
+		success = false;
+	skipped = mtd_write_skipped(ctx);
+	if (mtd_write_close(ctx) != 0)
+		success = false;
+	if (!success) {
+		LOGE("Error writing '%s' to MTD partition '%s'.\n", Full_FileName.c_str(), MTD_Name.c_str());
+		return false;
+	}
+	total_blocks = mtd->erase_size ? mtd->size / mtd->erase_size : 0;
+	LOGI("Skipped %i of %lu unchanged blocks on '%s'.\n", skipped, (unsigned long)total_blocks, MTD_Name.c_str());
+	return true;
+}
+
 bool TWPartition::Update_Size(bool Display_Error) {
-	bool ret = false, Was_Already_Mounted = false;
+	bool Was_Already_Mounted = false;
 
 	if (!Can_Be_Mounted && !Is_Encrypted)
 		return false;
@@ -1315,20 +1572,26 @@ bool TWPartition::Update_Size(bool Display_Error) {
 	} else if (!Mount(Display_Error))
 		return false;
 
-	ret = Get_Size_Via_statfs(Display_Error);
-	if (!ret || Size == 0) {
-		if (!Get_Size_Via_df(Display_Error)) {
-			if (!Was_Already_Mounted)
-				UnMount(false);
-			return false;
-		}
+	// df only reads statfs too, so there is nothing to fall back on
+	if (!Get_Size_Via_statfs(Display_Error)) {
+		if (!Was_Already_Mounted)
+			UnMount(false);
+		return false;
 	}
 
 	if (Has_Data_Media) {
 		if (Mount(Display_Error)) {
 			unsigned long long data_media_used, actual_data;
-			Used = TWFunc::Get_Folder_Size("/data", Display_Error);
-			data_media_used = TWFunc::Get_Folder_Size("/data/media", Display_Error);
+			twrpDU du;
+
+			// /data/media is totaled in the same walk instead of a second one,
+			// and folders that did not change since the last refresh are not read
+			du.Set_Cache(DU_CACHE_FILE);
+			du.Add_Root("/data");
+			du.Add_Root("/data/media");
+			du.Walk(Display_Error);
+			Used = du.Get_Size("/data");
+			data_media_used = du.Get_Size("/data/media");
 			actual_data = Used - data_media_used;
 			Backup_Size = actual_data;
 			int bak = (int)(Backup_Size / 1048576LLU);
@@ -1337,15 +1600,21 @@ bool TWPartition::Update_Size(bool Display_Error) {
 			int fre = (int)(Free / 1048576LLU);
 			int datmed = (int)(data_media_used / 1048576LLU);
 			LOGI("Data backup size is %iMB, size: %iMB, used: %iMB, free: %iMB, in data/media: %iMB.\n", bak, total, us, fre, datmed);
+			LOGI("Data backup has %llu files.\n", du.Get_File_Count("/data") - du.Get_File_Count("/data/media"));
 		} else {
 			if (!Was_Already_Mounted)
 				UnMount(false);
 			return false;
 		}
 	} else if (Has_Android_Secure) {
-		if (Mount(Display_Error))
-			Backup_Size = TWFunc::Get_Folder_Size(Backup_Path, Display_Error);
-		else {
+		if (Mount(Display_Error)) {
+			twrpDU du;
+
+			du.Set_Cache(DU_CACHE_FILE);
+			du.Add_Root(Backup_Path);
+			du.Walk(Display_Error);
+			Backup_Size = du.Get_Size(Backup_Path);
+		} else {
 			if (!Was_Already_Mounted)
 				UnMount(false);
 			return false;
@@ -31,6 +31,9 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <algorithm>
 
 #include "variables.h"
 #include "common.h"
@@ -39,6 +42,10 @@
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "fixPermissions.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpProcCache.hpp"
+#include "twrpWipe.hpp"
+#include "twrpDU.hpp"
 
 #ifdef TW_INCLUDE_CRYPTO
 	#ifdef TW_INCLUDE_JB_CRYPTO
@@ -74,6 +81,7 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 
 		if (partition->Process_Fstab_Line(line, Display_Error)) {
 			Partitions.push_back(partition);
+			Index_Partition(partition);
 		} else {
 			delete partition;
 		}
@@ -213,6 +221,10 @@ int TWPartitionManager::Mount_By_Path(string Path, bool Display_Error) {
 	if (Local_Path == "/tmp")
 		return true;
 
+	TWPartition* Part = Find_Partition_By_Path(Local_Path);
+	if (Part != NULL && !Part->Has_SubPartition)
+		return Part->Mount(Display_Error);
+
 	// Iterate through all partitions
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
@@ -282,6 +294,10 @@ int TWPartitionManager::UnMount_By_Path(string Path, bool Display_Error) {
 	bool found = false;
 	string Local_Path = TWFunc::Get_Root_Path(Path);
 
+	TWPartition* Part = Find_Partition_By_Path(Local_Path);
+	if (Part != NULL && !Part->Has_SubPartition)
+		return Part->UnMount(Display_Error);
+
 	// Iterate through all partitions
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
@@ -391,35 +407,56 @@ int TWPartitionManager::Mount_Settings_Storage(bool Display_Error) {
 	return Mount_By_Path(DataManager::GetSettingsStoragePath(), Display_Error);
 }
 
+void TWPartitionManager::Index_Partition(TWPartition* Part) {
+	// insert() keeps an existing entry, so the first match in the fstab
+	// wins just like the old linear scans
+	Path_Index.insert(make_pair(Part->Mount_Point, Part));
+	if (!Part->Symlink_Mount_Point.empty())
+		Path_Index.insert(make_pair(Part->Symlink_Mount_Point, Part));
+	if (!Part->Primary_Block_Device.empty())
+		Block_Index.insert(make_pair(Part->Primary_Block_Device, Part));
+	if (!Part->Alternate_Block_Device.empty())
+		Block_Index.insert(make_pair(Part->Alternate_Block_Device, Part));
+	if (Part->Is_Decrypted && !Part->Decrypted_Block_Device.empty())
+		Block_Index.insert(make_pair(Part->Decrypted_Block_Device, Part));
+	Name_Index.insert(make_pair(Part->Display_Name, Part));
+}
+
 TWPartition* TWPartitionManager::Find_Partition_By_Path(string Path) {
-	std::vector<TWPartition*>::iterator iter;
-	string Local_Path = TWFunc::Get_Root_Path(Path);
+	std::map<string, TWPartition*>::iterator it;
 
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path))
-			return (*iter);
-	}
-	return NULL;
+	// Most callers already pass a root path like /data, which is looked up
+	// as is instead of going through Get_Root_Path
+	if (!Path.empty() && Path[0] == '/' && Path.find('/', 1) == string::npos)
+		it = Path_Index.find(Path);
+	else
+		it = Path_Index.find(TWFunc::Get_Root_Path(Path));
+	if (it == Path_Index.end())
+		return NULL;
+	return it->second;
 }
 
 TWPartition* TWPartitionManager::Find_Partition_By_Block(string Block) {
-	std::vector<TWPartition*>::iterator iter;
-
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Primary_Block_Device == Block || (*iter)->Alternate_Block_Device == Block || ((*iter)->Is_Decrypted && (*iter)->Decrypted_Block_Device == Block))
-			return (*iter);
-	}
-	return NULL;
+	std::map<string, TWPartition*>::iterator it = Block_Index.find(Block);
+	TWPartition* Part;
+
+	if (it == Block_Index.end())
+		return NULL;
+	Part = it->second;
+	// The decrypted block device goes away when encryption is wiped
+	if (Part->Primary_Block_Device != Block && Part->Alternate_Block_Device != Block && !(Part->Is_Decrypted && Part->Decrypted_Block_Device == Block)) {
+		Block_Index.erase(it);
+		return NULL;
+	}
+	return Part;
 }
 
 TWPartition* TWPartitionManager::Find_Partition_By_Name(string Name) {
-	std::vector<TWPartition*>::iterator iter;
+	std::map<string, TWPartition*>::iterator it = Name_Index.find(Name);
 
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Display_Name == Name)
-			return (*iter);
-	}
-	return NULL;
+	if (it == Name_Index.end())
+		return NULL;
+	return it->second;
 }
 
 int TWPartitionManager::Check_Backup_Name(bool Display_Error) {
@@ -474,6 +511,15 @@ int TWPartitionManager::Check_Backup_Name(bool Display_Error) {
 	return 0;
 }
 
+// Returns true if the backup writer already created the .md5 file for this archive
+static bool MD5_Already_Generated(string File) {
+	struct stat file_st, md5_st;
+
+	if (stat(File.c_str(), &file_st) != 0 || stat((File + ".md5").c_str(), &md5_st) != 0)
+		return false;
+	return md5_st.st_mtime >= file_st.st_mtime;
+}
+
 bool TWPartitionManager::Make_MD5(bool generate_md5, string Backup_Folder, string Backup_Filename)
 {
 	char command[512];
@@ -482,10 +528,18 @@ bool TWPartitionManager::Make_MD5(bool generate_md5, string Backup_Folder, strin
 	if (!generate_md5)
 		return true;
 
+	// Backups in the chunk store are checked against the chunk hashes instead
+	if (!TWFunc::Path_Exists(Full_File) && twrpChunkStore::Has_Index(Full_File))
+		return true;
+
 	TWFunc::GUI_Operation_Text(TW_GENERATE_MD5_TEXT, "Generating MD5");
 	ui_print(" * Generating md5...\n");
 
 	if (TWFunc::Path_Exists(Full_File)) {
+		if (MD5_Already_Generated(Full_File)) {
+			ui_print(" * MD5 Created.\n");
+			return true;
+		}
 		sprintf(command, "cd '%s' && md5sum %s > %s.md5",Backup_Folder.c_str(), Backup_Filename.c_str(), Backup_Filename.c_str());
 		if (system(command) == 0) {
 			ui_print(" * MD5 Created.\n");
@@ -501,7 +555,7 @@ bool TWPartitionManager::Make_MD5(bool generate_md5, string Backup_Folder, strin
 		sprintf(filename, "%s%03i", Full_File.c_str(), index);
 		while (TWFunc::Path_Exists(filename) == true) {
 			sprintf(command, "cd '%s' && md5sum %s%03i > %s%03i.md5",Backup_Folder.c_str(), Backup_Filename.c_str(), index, Backup_Filename.c_str(), index);
-			if (system(command) != 0) {
+			if (!MD5_Already_Generated(filename) && system(command) != 0) {
 				ui_print(" * MD5 Error.\n");
 				return false;
 			}
@@ -517,6 +571,9 @@ bool TWPartitionManager::Make_MD5(bool generate_md5, string Backup_Folder, strin
 	return true;
 }
 
+// Guards the progress bar and the byte and time totals while partitions are backed up in parallel
+static pthread_mutex_t Backup_Lock = PTHREAD_MUTEX_INITIALIZER;
+
 bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes) {
 	time_t start, stop;
 	int img_bps, file_bps;
@@ -527,6 +584,7 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 	if (Part == NULL)
 		return true;
 
+	pthread_mutex_lock(&Backup_Lock);
 	DataManager::GetValue(TW_BACKUP_AVG_IMG_RATE, img_bps);
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
@@ -553,6 +611,7 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 	// Set the position
 	pos = section_time / (float) total_time;
 	ui->ShowProgress(pos, section_time);
+	pthread_mutex_unlock(&Backup_Lock);
 
 	time(&start);
 
@@ -566,17 +625,24 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 						return false;
 					if (!Make_MD5(generate_md5, Backup_Folder, (*subpart)->Backup_FileName))
 						return false;
+					pthread_mutex_lock(&Backup_Lock);
 					if (Part->Backup_Method == 1) {
 						*file_bytes_remaining -= (*subpart)->Backup_Size;
 					} else {
 						*img_bytes_remaining -= (*subpart)->Backup_Size;
 					}
+					pthread_mutex_unlock(&Backup_Lock);
 				}
 			}
 		}
 		time(&stop);
 		backup_time = (int) difftime(stop, start);
 		LOGI("Partition Backup time: %d\n", backup_time);
+		if (backup_time > 0)
+			LOGI("Partition Backup processed %llu bytes (%llu MB/sec)\n", Part->Backup_Bytes_Processed, Part->Backup_Bytes_Processed / (unsigned long long)backup_time / 1048576);
+		else
+			LOGI("Partition Backup processed %llu bytes\n", Part->Backup_Bytes_Processed);
+		pthread_mutex_lock(&Backup_Lock);
 		if (Part->Backup_Method == 1) {
 			*file_bytes_remaining -= Part->Backup_Size;
 			*file_time += backup_time;
@@ -584,12 +650,194 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 			*img_bytes_remaining -= Part->Backup_Size;
 			*img_time += backup_time;
 		}
+		pthread_mutex_unlock(&Backup_Lock);
 		return Make_MD5(generate_md5, Backup_Folder, Part->Backup_FileName);
 	} else {
 		return false;
 	}
 }
 
+struct TWPartitionManager::Backup_Schedule {
+	struct Job {
+		TWPartition* Part;
+		vector<string> Disks;                                                 // Disks read by this job, including those of its subpartitions
+		bool Started;
+	};
+
+	TWPartitionManager* Manager;
+	vector<Job> Jobs;
+	vector<string> Busy_Disks;
+	string Backup_Folder;
+	bool generate_md5;
+	bool Failed;
+	unsigned long long* img_bytes_remaining;
+	unsigned long long* file_bytes_remaining;
+	unsigned long* img_time;
+	unsigned long* file_time;
+	unsigned long long* img_bytes;
+	unsigned long long* file_bytes;
+	pthread_mutex_t Lock;
+	pthread_cond_t Job_Done;
+};
+
+string TWPartitionManager::Get_Disk_Name(string Block_Device) {
+	char path[PATH_MAX], link[PATH_MAX];
+	string Name;
+	ssize_t len;
+	DIR* d;
+	struct dirent* de;
+
+	if (Block_Device.empty())
+		return "";
+	if (realpath(Block_Device.c_str(), path) != NULL)
+		Name = TWFunc::Get_Filename(path);
+	else
+		Name = TWFunc::Get_Filename(Block_Device);
+	// All MTD partitions are on the same NAND chip
+	if (Name.substr(0, 3) == "mtd")
+		return "mtd";
+
+	// A device mapper device such as decrypted data is on the disk of the device under it
+	string Slaves = "/sys/class/block/" + Name + "/slaves";
+	d = opendir(Slaves.c_str());
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.') {
+				string Slave = de->d_name;
+				closedir(d);
+				return Get_Disk_Name("/dev/block/" + Slave);
+			}
+		}
+		closedir(d);
+	}
+
+	// /sys/class/block/mmcblk0p12 links to .../mmcblk0/mmcblk0p12
+	string Sys_Path = "/sys/class/block/" + Name;
+	if (!TWFunc::Path_Exists(Sys_Path + "/partition"))
+		return Name;
+	len = readlink(Sys_Path.c_str(), link, sizeof(link) - 1);
+	if (len <= 0)
+		return Name;
+	link[len] = '\0';
+	string Parent = link;
+	if (Parent.rfind('/') == string::npos)
+		return Name;
+	Parent.resize(Parent.rfind('/'));
+	return TWFunc::Get_Filename(Parent);
+}
+
+void* TWPartitionManager::Backup_Thread(void* cookie) {
+	Backup_Schedule* Schedule = (Backup_Schedule*)cookie;
+	vector<Backup_Schedule::Job>::iterator job;
+	vector<string>::iterator disk;
+
+	pthread_mutex_lock(&Schedule->Lock);
+	while (!Schedule->Failed) {
+		Backup_Schedule::Job* Next = NULL;
+		bool Pending = false;
+
+		for (job = Schedule->Jobs.begin(); job != Schedule->Jobs.end() && Next == NULL; job++) {
+			if (job->Started)
+				continue;
+			Pending = true;
+			bool Busy = false;
+			for (disk = job->Disks.begin(); disk != job->Disks.end() && !Busy; disk++)
+				Busy = find(Schedule->Busy_Disks.begin(), Schedule->Busy_Disks.end(), *disk) != Schedule->Busy_Disks.end();
+			if (!Busy)
+				Next = &(*job);
+		}
+		if (!Pending)
+			break;
+		if (Next == NULL) {
+			// Everything left reads a disk that another thread is using
+			pthread_cond_wait(&Schedule->Job_Done, &Schedule->Lock);
+			continue;
+		}
+
+		Next->Started = true;
+		Schedule->Busy_Disks.insert(Schedule->Busy_Disks.end(), Next->Disks.begin(), Next->Disks.end());
+		pthread_mutex_unlock(&Schedule->Lock);
+
+		bool ret = Schedule->Manager->Backup_Partition(Next->Part, Schedule->Backup_Folder, Schedule->generate_md5, Schedule->img_bytes_remaining, Schedule->file_bytes_remaining, Schedule->img_time, Schedule->file_time, Schedule->img_bytes, Schedule->file_bytes);
+
+		pthread_mutex_lock(&Schedule->Lock);
+		for (disk = Next->Disks.begin(); disk != Next->Disks.end(); disk++) {
+			vector<string>::iterator busy = find(Schedule->Busy_Disks.begin(), Schedule->Busy_Disks.end(), *disk);
+			if (busy != Schedule->Busy_Disks.end())
+				Schedule->Busy_Disks.erase(busy);
+		}
+		if (!ret)
+			Schedule->Failed = true;
+		pthread_cond_broadcast(&Schedule->Job_Done);
+	}
+	pthread_mutex_unlock(&Schedule->Lock);
+	return NULL;
+}
+
+bool TWPartitionManager::Backup_Partitions(vector<TWPartition*>& Backup_List, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes) {
+	std::vector<TWPartition*>::iterator iter, subpart;
+	Backup_Schedule Schedule;
+	int threads, count, started = 0;
+
+	DataManager::GetValue(TW_BACKUP_THREADS_VAR, threads);
+	if (threads <= 1 || Backup_List.size() <= 1) {
+		for (iter = Backup_List.begin(); iter != Backup_List.end(); iter++) {
+			if (!Backup_Partition(*iter, Backup_Folder, generate_md5, img_bytes_remaining, file_bytes_remaining, img_time, file_time, img_bytes, file_bytes))
+				return false;
+		}
+		return true;
+	}
+
+	for (iter = Backup_List.begin(); iter != Backup_List.end(); iter++) {
+		Backup_Schedule::Job Job;
+
+		Job.Part = *iter;
+		Job.Started = false;
+		// Partitions without a block device are backed up from storage
+		Job.Disks.push_back((*iter)->Actual_Block_Device.empty() ? "storage" : Get_Disk_Name((*iter)->Actual_Block_Device));
+		if ((*iter)->Has_SubPartition) {
+			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
+				if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == (*iter)->Mount_Point && !(*subpart)->Actual_Block_Device.empty())
+					Job.Disks.push_back(Get_Disk_Name((*subpart)->Actual_Block_Device));
+			}
+		}
+		LOGI("Backup of '%s' reads from %s\n", (*iter)->Mount_Point.c_str(), Job.Disks[0].c_str());
+		Schedule.Jobs.push_back(Job);
+	}
+	Schedule.Manager = this;
+	Schedule.Backup_Folder = Backup_Folder;
+	Schedule.generate_md5 = generate_md5;
+	Schedule.Failed = false;
+	Schedule.img_bytes_remaining = img_bytes_remaining;
+	Schedule.file_bytes_remaining = file_bytes_remaining;
+	Schedule.img_time = img_time;
+	Schedule.file_time = file_time;
+	Schedule.img_bytes = img_bytes;
+	Schedule.file_bytes = file_bytes;
+	pthread_mutex_init(&Schedule.Lock, NULL);
+	pthread_cond_init(&Schedule.Job_Done, NULL);
+
+	count = threads < (int)Schedule.Jobs.size() ? threads : (int)Schedule.Jobs.size();
+	pthread_t* thread_ids = new pthread_t[count];
+	for (int i = 0; i < count; i++) {
+		if (pthread_create(&thread_ids[i], NULL, Backup_Thread, &Schedule) != 0) {
+			LOGE("Unable to start backup thread\n");
+			break;
+		}
+		started++;
+	}
+	// With no threads at all, this thread does the work itself
+	if (started == 0)
+		Backup_Thread(&Schedule);
+	for (int i = 0; i < started; i++)
+		pthread_join(thread_ids[i], NULL);
+	delete [] thread_ids;
+
+	pthread_cond_destroy(&Schedule.Job_Done);
+	pthread_mutex_destroy(&Schedule.Lock);
+	return !Schedule.Failed;
+}
+
 int TWPartitionManager::Run_Backup(void) {
 	int check, do_md5, partition_count = 0;
 	string Backup_Folder, Backup_Name, Full_Backup_Path;
@@ -834,25 +1082,13 @@ int TWPartitionManager::Run_Backup(void) {
 
 	ui->SetProgress(0.0);
 
-	if (!Backup_Partition(backup_sys, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_data, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_cache, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_recovery, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_boot, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_andsec, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_sdext, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_sp1, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_sp2, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-		return false;
-	if (!Backup_Partition(backup_sp3, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
+	vector<TWPartition*> Backup_List;
+	TWPartition* Selected[] = {backup_sys, backup_data, backup_cache, backup_recovery, backup_boot, backup_andsec, backup_sdext, backup_sp1, backup_sp2, backup_sp3};
+	for (unsigned i = 0; i < sizeof(Selected) / sizeof(Selected[0]); i++) {
+		if (Selected[i] != NULL)
+			Backup_List.push_back(Selected[i]);
+	}
+	if (!Backup_Partitions(Backup_List, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
 		return false;
 
 	// Average BPS
@@ -891,6 +1127,14 @@ int TWPartitionManager::Run_Backup(void) {
 		DataManager::SetValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
 
 	ui_print("[%llu MB TOTAL BACKED UP]\n", actual_backup_size);
+
+	DataManager::GetValue(TW_DEDUP_BACKUP_VAR, check);
+	if (check) {
+		// Chunks only used by backups that have been deleted are not needed anymore
+		string Backups_Root = TWFunc::Get_Path(Backup_Folder); // TWRP/BACKUPS/ above the device folder
+
+		twrpChunkStore::Remove_Unused_Chunks(Backups_Root + CHUNK_STORE_FOLDER, Backups_Root);
+	}
 	Update_System_Details();
 	UnMount_Main_Partitions();
 	ui_print("[BACKUP COMPLETED IN %d SECONDS]\n\n", total_time); // the end
@@ -918,176 +1162,151 @@ bool TWPartitionManager::Restore_Partition(TWPartition* Part, string Restore_Nam
 	return true;
 }
 
-int TWPartitionManager::Run_Restore(string Restore_Name) {
-	int check_md5, check, partition_count = 0;
-	TWPartition* restore_sys = NULL;
-	TWPartition* restore_data = NULL;
-	TWPartition* restore_cache = NULL;
-	TWPartition* restore_boot = NULL;
-	TWPartition* restore_andsec = NULL;
-	TWPartition* restore_sdext = NULL;
-	TWPartition* restore_sp1 = NULL;
-	TWPartition* restore_sp2 = NULL;
-	TWPartition* restore_sp3 = NULL;
-	time_t rStart, rStop;
-	time(&rStart);
+bool TWPartitionManager::Get_Restore_List(vector<TWPartition*>& Restore_List) {
+	int check;
+	TWPartition* restore_part;
 
-	ui_print("\n[RESTORE STARTED]\n\n");
-	ui_print("Restore folder: '%s'\n", Restore_Name.c_str());
-
-	if (!Mount_Current_Storage(true))
-		return false;
-
-	DataManager::GetValue(TW_SKIP_MD5_CHECK_VAR, check_md5);
 	DataManager::GetValue(TW_RESTORE_SYSTEM_VAR, check);
 	if (check > 0) {
-		restore_sys = Find_Partition_By_Path("/system");
-		if (restore_sys == NULL) {
+		restore_part = Find_Partition_By_Path("/system");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate system partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 	DataManager::GetValue(TW_RESTORE_DATA_VAR, check);
 	if (check > 0) {
-		restore_data = Find_Partition_By_Path("/data");
-		if (restore_data == NULL) {
+		restore_part = Find_Partition_By_Path("/data");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate data partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 	DataManager::GetValue(TW_RESTORE_CACHE_VAR, check);
 	if (check > 0) {
-		restore_cache = Find_Partition_By_Path("/cache");
-		if (restore_cache == NULL) {
+		restore_part = Find_Partition_By_Path("/cache");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate cache partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 	DataManager::GetValue(TW_RESTORE_BOOT_VAR, check);
 	if (check > 0) {
-		restore_boot = Find_Partition_By_Path("/boot");
-		if (restore_boot == NULL) {
+		restore_part = Find_Partition_By_Path("/boot");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate boot partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 	DataManager::GetValue(TW_RESTORE_ANDSEC_VAR, check);
 	if (check > 0) {
-		restore_andsec = Find_Partition_By_Path("/and-sec");
-		if (restore_andsec == NULL) {
+		restore_part = Find_Partition_By_Path("/and-sec");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate android secure partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 	DataManager::GetValue(TW_RESTORE_SDEXT_VAR, check);
 	if (check > 0) {
-		restore_sdext = Find_Partition_By_Path("/sd-ext");
-		if (restore_sdext == NULL) {
+		restore_part = Find_Partition_By_Path("/sd-ext");
+		if (restore_part == NULL) {
 			LOGE("Unable to locate sd-ext partition.\n");
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 #ifdef SP1_NAME
 	DataManager::GetValue(TW_RESTORE_SP1_VAR, check);
 	if (check > 0) {
-		restore_sp1 = Find_Partition_By_Path(EXPAND(SP1_NAME));
-		if (restore_sp1 == NULL) {
+		restore_part = Find_Partition_By_Path(EXPAND(SP1_NAME));
+		if (restore_part == NULL) {
 			LOGE("Unable to locate %s partition.\n", EXPAND(SP1_NAME));
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 #endif
 #ifdef SP2_NAME
 	DataManager::GetValue(TW_RESTORE_SP2_VAR, check);
 	if (check > 0) {
-		restore_sp2 = Find_Partition_By_Path(EXPAND(SP2_NAME));
-		if (restore_sp2 == NULL) {
+		restore_part = Find_Partition_By_Path(EXPAND(SP2_NAME));
+		if (restore_part == NULL) {
 			LOGE("Unable to locate %s partition.\n", EXPAND(SP2_NAME));
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 #endif
 #ifdef SP3_NAME
 	DataManager::GetValue(TW_RESTORE_SP3_VAR, check);
 	if (check > 0) {
-		restore_sp3 = Find_Partition_By_Path(EXPAND(SP3_NAME));
-		if (restore_sp3 == NULL) {
+		restore_part = Find_Partition_By_Path(EXPAND(SP3_NAME));
+		if (restore_part == NULL) {
 			LOGE("Unable to locate %s partition.\n", EXPAND(SP3_NAME));
 			return false;
 		}
-		partition_count++;
+		Restore_List.push_back(restore_part);
 	}
 #endif
 
-	if (partition_count == 0) {
+	if (Restore_List.empty()) {
 		LOGE("No partitions selected for restore.\n");
 		return false;
 	}
+	return true;
+}
+
+int TWPartitionManager::Run_Restore(string Restore_Name) {
+	int check_md5, partition_count;
+	vector<TWPartition*> Restore_List;
+	std::vector<TWPartition*>::iterator iter, subpart;
+	time_t rStart, rStop;
+	time(&rStart);
+
+	ui_print("\n[RESTORE STARTED]\n\n");
+	ui_print("Restore folder: '%s'\n", Restore_Name.c_str());
+
+	if (!Mount_Current_Storage(true))
+		return false;
+
+	DataManager::GetValue(TW_SKIP_MD5_CHECK_VAR, check_md5);
+	if (!Get_Restore_List(Restore_List))
+		return false;
+	partition_count = Restore_List.size();
 
 	if (check_md5 > 0) {
-		// Check MD5 files first before restoring to ensure that all of them match before starting a restore
+		// File system backups are checked while they are extracted, images
+		// are checked first so that nothing is flashed from a bad one
 		TWFunc::GUI_Operation_Text(TW_VERIFY_MD5_TEXT, "Verifying MD5");
 		ui_print("Verifying MD5...\n");
-		if (restore_sys != NULL && !restore_sys->Check_MD5(Restore_Name))
-			return false;
-		if (restore_data != NULL && !restore_data->Check_MD5(Restore_Name))
-			return false;
-		if (restore_data != NULL && restore_data->Has_SubPartition) {
-			std::vector<TWPartition*>::iterator subpart;
-
+		for (iter = Restore_List.begin(); iter != Restore_List.end(); iter++) {
+			if ((*iter)->Backup_Method != 1 && !(*iter)->Check_MD5(Restore_Name))
+				return false;
+			if (!(*iter)->Has_SubPartition)
+				continue;
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
-				if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == restore_data->Mount_Point) {
-					if (!(*subpart)->Check_MD5(Restore_Name))
+				if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == (*iter)->Mount_Point) {
+					if ((*subpart)->Backup_Method != 1 && !(*subpart)->Check_MD5(Restore_Name))
 						return false;
 				}
 			}
 		}
-		if (restore_cache != NULL && !restore_cache->Check_MD5(Restore_Name))
-			return false;
-		if (restore_boot != NULL && !restore_boot->Check_MD5(Restore_Name))
-			return false;
-		if (restore_andsec != NULL && !restore_andsec->Check_MD5(Restore_Name))
-			return false;
-		if (restore_sdext != NULL && !restore_sdext->Check_MD5(Restore_Name))
-			return false;
-		if (restore_sp1 != NULL && !restore_sp1->Check_MD5(Restore_Name))
-			return false;
-		if (restore_sp2 != NULL && !restore_sp2->Check_MD5(Restore_Name))
-			return false;
-		if (restore_sp3 != NULL && !restore_sp3->Check_MD5(Restore_Name))
-			return false;
 		ui_print("Done verifying MD5.\n");
 	} else
 			ui_print("Skipping MD5 check based on user setting.\n");
 
 	ui_print("Restoring %i partitions...\n", partition_count);
 	ui->SetProgress(0.0);
-	if (restore_sys != NULL && !Restore_Partition(restore_sys, Restore_Name, partition_count))
-		return false;
-	if (restore_data != NULL && !Restore_Partition(restore_data, Restore_Name, partition_count))
-		return false;
-	if (restore_cache != NULL && !Restore_Partition(restore_cache, Restore_Name, partition_count))
-		return false;
-	if (restore_boot != NULL && !Restore_Partition(restore_boot, Restore_Name, partition_count))
-		return false;
-	if (restore_andsec != NULL && !Restore_Partition(restore_andsec, Restore_Name, partition_count))
-		return false;
-	if (restore_sdext != NULL && !Restore_Partition(restore_sdext, Restore_Name, partition_count))
-		return false;
-	if (restore_sp1 != NULL && !Restore_Partition(restore_sp1, Restore_Name, partition_count))
-		return false;
-	if (restore_sp2 != NULL && !Restore_Partition(restore_sp2, Restore_Name, partition_count))
-		return false;
-	if (restore_sp3 != NULL && !Restore_Partition(restore_sp3, Restore_Name, partition_count))
-		return false;
+	twrpDU::Drop_Cache();
+	for (iter = Restore_List.begin(); iter != Restore_List.end(); iter++) {
+		if (!Restore_Partition(*iter, Restore_Name, partition_count))
+			return false;
+	}
 
 	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, "Updating System Details");
 	Update_System_Details();
@@ -1097,6 +1316,97 @@ int TWPartitionManager::Run_Restore(string Restore_Name) {
 	return true;
 }
 
+// Archive files shared by the verify threads
+struct Verify_Queue {
+	vector<string>* Files;
+	size_t Next;
+	size_t Done;
+	bool Failed;
+	pthread_mutex_t Lock;
+};
+
+static void* Verify_Thread(void* cookie) {
+	Verify_Queue* Queue = (Verify_Queue*)cookie;
+
+	pthread_mutex_lock(&Queue->Lock);
+	while (!Queue->Failed && Queue->Next < Queue->Files->size()) {
+		string File = (*Queue->Files)[Queue->Next++];
+
+		pthread_mutex_unlock(&Queue->Lock);
+		bool ret = TWPartition::Check_Archive_File(File);
+		pthread_mutex_lock(&Queue->Lock);
+		if (!ret)
+			Queue->Failed = true;
+		Queue->Done++;
+		ui->SetProgress(Queue->Done / (float)Queue->Files->size());
+	}
+	pthread_mutex_unlock(&Queue->Lock);
+	return NULL;
+}
+
+int TWPartitionManager::Verify_Backup(string Restore_Name) {
+	vector<TWPartition*> Restore_List;
+	vector<string> Files;
+	std::vector<TWPartition*>::iterator iter, subpart;
+	Verify_Queue Queue;
+	int threads, started = 0;
+	time_t vStart, vStop;
+	time(&vStart);
+
+	ui_print("\n[VERIFY STARTED]\n\n");
+	ui_print("Backup folder: '%s'\n", Restore_Name.c_str());
+
+	if (!Mount_Current_Storage(true))
+		return false;
+	if (!Get_Restore_List(Restore_List))
+		return false;
+	for (iter = Restore_List.begin(); iter != Restore_List.end(); iter++) {
+		if (!(*iter)->Get_Archive_Files(Restore_Name, Files))
+			return false;
+		if (!(*iter)->Has_SubPartition)
+			continue;
+		for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
+			if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == (*iter)->Mount_Point) {
+				if (!(*subpart)->Get_Archive_Files(Restore_Name, Files))
+					return false;
+			}
+		}
+	}
+
+	TWFunc::GUI_Operation_Text(TW_VERIFY_MD5_TEXT, "Verifying MD5");
+	ui_print("Verifying %i archive files...\n", (int)Files.size());
+	ui->SetProgress(0.0);
+
+	// Each archive file has its own .md5, so the files are hashed in parallel
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > VERIFY_MAX_THREADS)
+		threads = VERIFY_MAX_THREADS;
+	if (threads > (int)Files.size())
+		threads = Files.size();
+	Queue.Files = &Files;
+	Queue.Next = Queue.Done = 0;
+	Queue.Failed = false;
+	pthread_mutex_init(&Queue.Lock, NULL);
+	pthread_t* thread_ids = new pthread_t[threads > 0 ? threads : 1];
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&thread_ids[i], NULL, Verify_Thread, &Queue) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		Verify_Thread(&Queue);
+	for (int i = 0; i < started; i++)
+		pthread_join(thread_ids[i], NULL);
+	delete [] thread_ids;
+	pthread_mutex_destroy(&Queue.Lock);
+
+	if (Queue.Failed)
+		return false;
+	time(&vStop);
+	ui_print("[VERIFY COMPLETED IN %d SECONDS]\n\n",(int)difftime(vStop,vStart));
+	return true;
+}
+
 void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 	// Start with the default values
 	int tw_restore_system = -1;
@@ -1128,6 +1438,7 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 		char* fstype = NULL;
 		char* extn = NULL;
 		char* ptr;
+		size_t sparse_len = 0;
 
 		strcpy(str, de->d_name);
 		if (strlen(str) <= 2)
@@ -1226,7 +1537,10 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 			extn = ptr;
 		}
 
-		if (extn == NULL || (strlen(extn) >= 3 && strncmp(extn, "win", 3) != 0))   continue;
+		// Sparse images are <name>.<fs>.sparse.win so that older builds skip them
+		if (extn != NULL && strncmp(extn, "sparse.win", 10) == 0)
+			sparse_len = 7;
+		if (extn == NULL || (strlen(extn) >= 3 && strncmp(extn + sparse_len, "win", 3) != 0))   continue;
 
 		Part = Find_Partition_By_Path(label);
 		if (Part == NULL)
@@ -1236,8 +1550,8 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 		}
 
 		Part->Backup_FileName = de->d_name;
-		if (strlen(extn) > 3) {
-			Part->Backup_FileName.resize(Part->Backup_FileName.size() - strlen(extn) + 3);
+		if (strlen(extn) > sparse_len + 3) {
+			Part->Backup_FileName.resize(Part->Backup_FileName.size() - strlen(extn) + sparse_len + 3);
 		}
 
 		// Now, we just need to find the correct label
@@ -1366,6 +1680,7 @@ int TWPartitionManager::Factory_Reset(void) {
 
 int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 	struct stat st;
+	twrpWipe wipe;
 
 	if (!Mount_By_Path("/data", true))
 		return false;
@@ -1374,18 +1689,18 @@ int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 		return false;
 
 	ui_print("\nWiping Dalvik Cache Directories...\n");
-	system("rm -rf /data/dalvik-cache");
+	wipe.Remove("/data/dalvik-cache");
 	ui_print("Cleaned: /data/dalvik-cache...\n");
-	system("rm -rf /cache/dalvik-cache");
+	wipe.Remove("/cache/dalvik-cache");
 	ui_print("Cleaned: /cache/dalvik-cache...\n");
-	system("rm -rf /cache/dc");
+	wipe.Remove("/cache/dc");
 	ui_print("Cleaned: /cache/dc\n");
 
 	TWPartition* sdext = Find_Partition_By_Path("/sd-ext");
 	if (sdext != NULL) {
 		if (sdext->Is_Present && sdext->Mount(false)) {
 			if (stat("/sd-ext/dalvik-cache", &st) == 0) {
-                system("rm -rf /sd-ext/dalvik-cache");
+                wipe.Remove("/sd-ext/dalvik-cache");
         	    ui_print("Cleaned: /sd-ext/dalvik-cache...\n");
     	    }
         }
@@ -1467,7 +1782,9 @@ int TWPartitionManager::Wipe_Media_From_Data(void) {
 			return false;
 
 		ui_print("Wiping internal storage -- /data/media...\n");
-		system("rm -rf /data/media");
+		twrpWipe wipe;
+		wipe.Set_Progress(true);
+		wipe.Remove("/data/media");
 		system("cd /data && mkdir media && chmod 775 media");
 		if (dat->Has_Data_Media) {
 			dat->Recreate_Media_Folder();
@@ -1660,6 +1977,7 @@ int TWPartitionManager::Decrypt_Device(string Password) {
 			DataManager::SetValue(TW_IS_DECRYPTED, 1);
 			dat->Is_Decrypted = true;
 			dat->Decrypted_Block_Device = crypto_blkdev;
+			Index_Partition(dat);
 			ui_print("Data successfully decrypted, new block device: '%s'\n", crypto_blkdev);
 			// Sleep for a bit so that the device will be ready
 			sleep(1);
@@ -1834,10 +2152,10 @@ void TWPartitionManager::UnMount_Main_Partitions(void) {
 }
 
 int TWPartitionManager::Partition_SDCard(void) {
-	char mkdir_path[255], temp[255], line[512];
-	string Command, Device, fat_str, ext_str, swap_str, start_loc, end_loc, ext_format, sd_path, tmpdevice;
+	char mkdir_path[255], temp[255];
+	string Command, Device, fat_str, ext_str, swap_str, start_loc, end_loc, ext_format, sd_path;
 	int ext, swap, total_size = 0, fat_size;
-	FILE* fp;
+	unsigned long long device_size;
 
 	ui_print("Partitioning SD Card...\n");
 #ifdef TW_EXTERNAL_STORAGE_PATH
@@ -1862,30 +2180,8 @@ int TWPartitionManager::Partition_SDCard(void) {
 	Device.resize(strlen("/dev/block/mmcblkX"));
 
 	// Find the size of the block device:
-	fp = fopen("/proc/partitions", "rt");
-	if (fp == NULL) {
-		LOGE("Unable to open /proc/partitions\n");
-		return false;
-	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long major, minor, blocks;
-		char device[512];
-		char tmpString[64];
-
-		if (strlen(line) < 7 || line[0] == 'm')	 continue;
-		sscanf(line + 1, "%lu %lu %lu %s", &major, &minor, &blocks, device);
-
-		tmpdevice = "/dev/block/";
-		tmpdevice += device;
-		if (tmpdevice == Device) {
-			// Adjust block size to byte size
-			total_size = (int)(blocks * 1024ULL  / 1000000LLU);
-			break;
-		}
-	}
-	fclose(fp);
+	if (twrpProcCache::Get_Block_Size(Device, &device_size))
+		total_size = (int)(device_size / 1000000LLU);
 
 	DataManager::GetValue("tw_sdext_size", ext);
 	DataManager::GetValue("tw_swap_size", swap);
@@ -1910,6 +2206,7 @@ int TWPartitionManager::Partition_SDCard(void) {
 	LOGI("Command is: '%s'\n", Command.c_str());
 	if (system(Command.c_str()) != 0) {
 		LOGE("Unable to remove partition table.\n");
+		twrpProcCache::Refresh_Partitions();
 		Update_System_Details();
 		return false;
 	}
@@ -1926,6 +2223,7 @@ int TWPartitionManager::Partition_SDCard(void) {
 		LOGI("Command is: '%s'\n", Command.c_str());
 		if (system(Command.c_str()) != 0) {
 			LOGE("Unable to create EXT partition.\n");
+			twrpProcCache::Refresh_Partitions();
 			Update_System_Details();
 			return false;
 		}
@@ -1936,10 +2234,13 @@ int TWPartitionManager::Partition_SDCard(void) {
 		LOGI("Command is: '%s'\n", Command.c_str());
 		if (system(Command.c_str()) != 0) {
 			LOGE("Unable to create swap partition.\n");
+			twrpProcCache::Refresh_Partitions();
 			Update_System_Details();
 			return false;
 		}
 	}
+	// The partition table changed under the cached copy of /proc/partitions
+	twrpProcCache::Refresh_Partitions();
 	// recreate TWRP folder and rewrite settings - these will be gone after sdcard is partitioned
 #ifdef TW_EXTERNAL_STORAGE_PATH
 	Mount_By_Path(EXPAND(TW_EXTERNAL_STORAGE_PATH), 1);
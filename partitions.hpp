@@ -25,8 +25,10 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 #define MAX_FSTAB_LINE_LENGTH 2048
+#define VERIFY_MAX_THREADS 4                                                    // Archive files hashed at once by Verify_Backup
 
 using namespace std;
 
@@ -53,11 +55,13 @@ public:
 	virtual bool Wipe_AndSec();                                               // Wipes android secure
 	virtual bool Backup(string backup_folder);                                // Backs up the partition to the folder specified
 	virtual bool Check_MD5(string restore_folder);                            // Checks MD5 of a backup
+	bool Get_Archive_Files(string restore_folder, vector<string>& Files);     // Lists every archive file of the backup, including the backups an incremental one builds on
+	static bool Check_Archive_File(string File);                              // Checks one archive file against its .md5, or the chunks of an index
 	virtual bool Restore(string restore_folder);                              // Restores the partition using the backup folder provided
 	virtual string Backup_Method_By_Name();                                   // Returns a string of the backup method for human readable output
 	virtual bool Decrypt(string Password);                                    // Decrypts the partition, return 0 for failure and -1 for success
 	virtual bool Wipe_Encryption();                                           // Ignores wipe commands for /data/media devices and formats the original block device
-	virtual void Check_FS_Type();                                             // Checks the fs type using blkid, does not do anything on MTD / yaffs2 because this crashes on some devices
+	virtual void Check_FS_Type();                                             // Checks the fs type from the superblock or with blkid, does not do anything on MTD / yaffs2 because blkid crashes on some devices
 	virtual bool Update_Size(bool Display_Error);                             // Updates size information
 	virtual void Recreate_Media_Folder();                                     // Recreates the /data/media folder
 
@@ -81,6 +85,7 @@ protected:
 	string Symlink_Path;                                                      // Symlink path (e.g. /data/media)
 	string Symlink_Mount_Point;                                               // /sdcard could be the symlink mount point for /data/media
 	string Mount_Point;                                                       // Mount point for this partition (e.g. /system or /data)
+	string Real_Mount_Point;                                                  // Mount_Point with symlinks resolved, as /proc/self/mounts lists it
 	string Backup_Path;                                                       // Path for backup
 	string Primary_Block_Device;                                              // Block device (e.g. /dev/block/mmcblk1p1)
 	string Alternate_Block_Device;                                            // Alternate block device (e.g. /dev/block/mmcblk1)
@@ -105,6 +110,7 @@ protected:
 	string Storage_Path;                                                      // Indicates the path to the storage -- root indicates mount point, media/ indicates e.g. /data/media
 	string Fstab_File_System;                                                 // File system from the recovery.fstab
 	int Format_Block_Size;                                                    // Block size for formatting
+	unsigned long long Backup_Bytes_Processed;                                // Bytes of data read during the last backup of this partition
 
 private:
 	bool Process_Flags(string Flags, bool Display_Error);                     // Process custom fstab flags
@@ -120,7 +126,9 @@ private:
 	bool Wipe_EXT4();                                                         // Formats using ext4, uses make_ext4fs when present
 	bool Wipe_FAT();                                                          // Formats as FAT except that mkdosfs from busybox usually fails so oftentimes this is actually a rm -rf wipe
 	bool Wipe_MTD();                                                          // Formats as yaffs2 for MTD memory types
-	bool Wipe_RMRF();                                                         // Uses rm -rf to wipe
+	bool Wipe_RMRF();                                                         // Deletes everything on the mounted partition with twrpWipe
+	bool Wipe_DD();                                                           // Discards or zero fills emmc partitions that have no file system
+	bool Discard_Block_Device(bool Zero_Fill);                                // BLKDISCARD or BLKSECDISCARD on the space the file system will use, Zero_Fill writes zeros if the discard does not leave zeros behind
 	bool Wipe_Data_Without_Wiping_Media();                                    // Uses rm -rf to wipe but does not wipe /data/media
 	bool Backup_Tar(string backup_folder);                                    // Backs up using tar for file systems
 	bool Backup_DD(string backup_folder);                                     // Backs up using dd for emmc memory types
@@ -128,8 +136,10 @@ private:
 	bool Restore_Tar(string restore_folder);                                  // Restore using tar for file systems
 	bool Restore_DD(string restore_folder);                                   // Restore using dd for emmc memory types
 	bool Restore_Flash_Image(string restore_folder);                          // Restore using flash_image for MTD memory types
+	bool Restore_MTD_Delta(const struct MtdPartition* mtd, string Full_FileName); // Writes an image to an MTD partition in place, skipping unchanged erase blocks
+	string Find_Previous_Backup(string backup_folder);                        // Newest other backup with a manifest for this partition, for incremental backups
+	bool Get_Backup_Chain(string restore_folder, vector<string>& Chain);      // Lists the backup folders an incremental backup builds on, oldest first
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
@@ -165,6 +175,7 @@ public:
 	virtual int Check_Backup_Name(bool Display_Error);                        // Checks the current backup name to ensure that it is valid
 	virtual int Run_Backup();                                                 // Initiates a backup in the current storage
 	virtual int Run_Restore(string Restore_Name);                             // Restores a backup
+	virtual int Verify_Backup(string Restore_Name);                           // Checks the MD5 of every archive selected for restore without restoring anything
 	virtual void Set_Restore_Files(string Restore_Name);                      // Used to gather a list of available backup partitions for the user to select for a restore
 	virtual int Wipe_By_Path(string Path);                                    // Wipes a partition based on path
 	virtual int Wipe_By_Block(string Block);                                  // Wipes a partition based on block device
@@ -189,12 +200,21 @@ public:
 private:
 	bool Make_MD5(bool generate_md5, string Backup_Folder, string Backup_Filename); // Generates an MD5 after a backup is made
 	bool Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes);
+	bool Backup_Partitions(vector<TWPartition*>& Backup_List, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes); // Backs up the list in order, or with up to tw_backup_threads partitions on different disks at once
+	static void* Backup_Thread(void* cookie);                                 // Takes jobs from a Backup_Schedule until none are left
+	string Get_Disk_Name(string Block_Device);                                // Name of the disk that holds the block device, e.g. mmcblk0 for mmcblk0p12
+	struct Backup_Schedule;                                                   // Jobs and accounting shared by the backup threads
 	bool Restore_Partition(TWPartition* Part, string Restore_Name, int partition_count);
+	bool Get_Restore_List(vector<TWPartition*>& Restore_List);                // Partitions selected for restore, in restore order
 	void Output_Partition(TWPartition* Part);
 	int Open_Lun_File(string Partition_Path, string Lun_File);
+	void Index_Partition(TWPartition* Part);                                  // Adds the paths, block devices and name of Part to the lookup maps, earlier partitions win
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
+	std::map<string, TWPartition*> Path_Index;                                // Mount points and symlink mount points
+	std::map<string, TWPartition*> Block_Index;                               // Primary, alternate and decrypted block devices
+	std::map<string, TWPartition*> Name_Index;                                // Display names
 };
 
 extern TWPartitionManager PartitionManager;
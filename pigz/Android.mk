@@ -30,3 +30,15 @@ ALL_DEFAULT_INSTALLED_MODULES += $(SYMLINKS)
 # local module name
 ALL_MODULES.$(LOCAL_MODULE).INSTALLED := \
     $(ALL_MODULES.$(LOCAL_MODULE).INSTALLED) $(SYMLINKS)
+
+# Library version used by the recovery backup code, see pigz.h
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libtwpigz
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS = -DPIGZ_LIBRARY
+LOCAL_SRC_FILES = pigz.c yarn.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH) \
+					external/zlib
+
+include $(BUILD_STATIC_LIBRARY)
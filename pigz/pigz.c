@@ -467,12 +467,65 @@ local int complain(char *fmt, ...)
     return 0;
 }
 
+#ifdef PIGZ_LIBRARY
+#  include <setjmp.h>
+#  include <pthread.h>
+
+/* the library must not exit on an error, so each thread that can fail sets a
+   return point for bail() -- the stream is then marked as failed, and the
+   rest of it is passed along without being compressed or written so that no
+   thread is left waiting for another */
+local pthread_key_t lib_catch;          /* jmp_buf of this thread, if any */
+local pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+local int lib_error;                    /* true once the stream has failed */
+
+local void lib_init(void)
+{
+    (void)pthread_key_create(&lib_catch, NULL);
+}
+
+/* set or clear (NULL) the return point for a failure in this thread */
+local void lib_set_catch(jmp_buf *env)
+{
+    (void)pthread_setspecific(lib_catch, env);
+}
+
+/* true if the stream being compressed has failed */
+local int lib_failed(void)
+{
+    return __sync_fetch_and_add(&lib_error, 0);
+}
+
+/* mark the stream as failed and return to the catch point of this thread --
+   only returns if there isn't one (the write thread neither reads nor
+   allocates, so it has none) */
+local void lib_fail(void)
+{
+    jmp_buf *env;
+
+    (void)__sync_lock_test_and_set(&lib_error, 1);
+    env = pthread_getspecific(lib_catch);
+    if (env != NULL)
+        longjmp(*env, 1);
+}
+
+/* yarn error handler, called instead of exiting on a thread or memory error */
+local void lib_abort(int err)
+{
+    (void)err;
+    lib_fail();
+}
+#endif
+
 /* exit with error, delete output file if in the middle of writing it */
 local int bail(char *why, char *what)
 {
     if (outd != -1 && out != NULL)
         unlink(out);
     complain("abort: %s%s", why, what);
+#ifdef PIGZ_LIBRARY
+    lib_fail();
+#endif
     exit(1);
     return 0;
 }
@@ -647,11 +700,24 @@ local size_t readn(int desc, unsigned char *buf, size_t len)
     return got;
 }
 
+#ifdef PIGZ_LIBRARY
+#  include "pigz.h"
+local pigz_write_fn out_fn = NULL;  /* library output callback, if any */
+local void *out_cookie;             /* passed to out_fn */
+#endif
+
 /* write len bytes, repeating write() calls as needed */
 local void writen(int desc, unsigned char *buf, size_t len)
 {
     ssize_t ret;
 
+#ifdef PIGZ_LIBRARY
+    if (out_fn != NULL && desc == outd) {
+        if (!lib_failed())
+            out_fn(out_cookie, buf, len);
+        return;
+    }
+#endif
     while (len) {
         ret = write(desc, buf, len);
         if (ret < 1) {
@@ -1047,6 +1113,7 @@ local size_t grow(size_t size)
 local void grow_space(struct space *space)
 {
     size_t more;
+    unsigned char *buf;
 
     /* compute next size up */
     more = grow(space->size);
@@ -1054,9 +1121,10 @@ local void grow_space(struct space *space)
         bail("not enough memory", "");
 
     /* reallocate the buffer */
-    space->buf = realloc(space->buf, more);
-    if (space->buf == NULL)
+    buf = realloc(space->buf, more);
+    if (buf == NULL)
         bail("not enough memory", "");
+    space->buf = buf;
     space->size = more;
 }
 
@@ -1103,7 +1171,12 @@ local int free_pool(struct pool *pool)
         free(space);
         count++;
     }
+#ifdef PIGZ_LIBRARY
+    /* spaces held by a thread when the stream failed are not given back */
+    assert(count == pool->made || lib_failed());
+#else
     assert(count == pool->made);
+#endif
     release(pool->have);
     free_lock(pool->have);
     return count;
@@ -1145,6 +1218,13 @@ local int cthreads = 0;
 /* write thread if running */
 local thread *writeth = NULL;
 
+#ifdef PIGZ_LIBRARY
+/* job that ends the write thread after a failure in parallel_compress(), and
+   how many jobs have been given to the compress threads before it */
+local struct job *lib_last = NULL;
+local long lib_seq;
+#endif
+
 /* setup job lists (call from main thread) */
 local void setup_jobs(void)
 {
@@ -1153,7 +1233,6 @@ local void setup_jobs(void)
         return;
 
     /* allocate locks and initialize lists */
-    compress_have = new_lock(0);
     compress_head = NULL;
     compress_tail = &compress_head;
     write_first = new_lock(-1);
@@ -1166,6 +1245,9 @@ local void setup_jobs(void)
     new_pool(&out_pool, OUTPOOL(size), -1);
     new_pool(&dict_pool, DICT, -1);
     new_pool(&lens_pool, size >> (RSYNCBITS - 1), -1);
+
+    /* last, since this marks the jobs as set up for finish_jobs() */
+    compress_have = new_lock(0);
 }
 
 /* command the compress threads to all return, then join them all (call from
@@ -1207,6 +1289,88 @@ local void finish_jobs(void)
     compress_have = NULL;
 }
 
+#ifdef PIGZ_LIBRARY
+/* give job to the write thread without compressing it, once the stream has
+   failed -- nothing is written then, but the write thread still has to see
+   every job to get to the end */
+local void lib_pass(struct job *job)
+{
+    struct job *here, **prior;
+
+    if (job->out != NULL) {
+        drop_space(job->out);
+        job->out = NULL;
+    }
+    if (job->lens != NULL) {
+        drop_space(job->lens);
+        job->lens = NULL;
+    }
+    job->check = CHECK(0L, Z_NULL, 0);
+
+    /* insert write job in list in sorted order, alert write thread */
+    possess(write_first);
+    prior = &write_head;
+    while ((here = *prior) != NULL) {
+        if (here->seq > job->seq)
+            break;
+        prior = &(here->next);
+    }
+    job->next = here;
+    *prior = job;
+    twist(write_first, TO, write_head->seq);
+    possess(job->calc);
+    twist(job->calc, TO, 1);
+}
+
+/* pass the remaining jobs to the write thread until told to return, after a
+   failure in a compress thread */
+local void lib_pass_rest(void)
+{
+    struct job *job;
+
+    for (;;) {
+        possess(compress_have);
+        wait_for(compress_have, NOT_TO_BE, 0);
+        job = compress_head;
+        assert(job != NULL);
+        if (job->seq == -1)
+            break;
+        compress_head = job->next;
+        if (job->next == NULL)
+            compress_tail = &compress_head;
+        twist(compress_have, BY, -1);
+        lib_pass(job);
+    }
+    release(compress_have);
+}
+
+/* end the write thread after a failure in parallel_compress(), by
+   following the jobs already given to the compress threads with a last, empty
+   one -- or just free that job if the write thread wasn't started */
+local void lib_end_write(void)
+{
+    struct job *job;
+
+    job = lib_last;
+    lib_last = NULL;
+    if (job == NULL)
+        return;
+    if (writeth == NULL) {
+        free_lock(job->calc);
+        free(job);
+        return;
+    }
+    job->seq = lib_seq;
+    job->more = 0;
+    job->in = NULL;
+    job->out = NULL;
+    job->lens = NULL;
+    lib_pass(job);
+    join(writeth);
+    writeth = NULL;
+}
+#endif
+
 /* compress all strm->avail_in bytes at strm->next_in to out->buf, updating
    out->len, grow the size of the buffer (out->size) if necessary -- respect
    the size limitations of the zlib stream data types (size_t may be larger
@@ -1246,9 +1410,28 @@ local void compress_thread(void *dummy)
     int bits;                       /* deflate pending bits */
 #endif
     z_stream strm;                  /* deflate stream */
+#ifdef PIGZ_LIBRARY
+    jmp_buf env;                    /* return point for a failure */
+    struct job *volatile current = NULL;    /* job being compressed */
+    volatile int ready = 0;         /* true if strm was initialized */
+#endif
 
     (void)dummy;
 
+#ifdef PIGZ_LIBRARY
+    /* a failure in this thread comes back here, then this and all of the
+       following jobs are passed on to the write thread as they are */
+    lib_set_catch(&env);
+    if (setjmp(env) != 0) {
+        if (current != NULL)
+            lib_pass(current);
+        lib_pass_rest();
+        if (ready)
+            (void)deflateEnd(&strm);
+        return;
+    }
+#endif
+
     /* initialize the deflate stream for this thread */
     strm.zfree = Z_NULL;
     strm.zalloc = Z_NULL;
@@ -1256,6 +1439,9 @@ local void compress_thread(void *dummy)
     if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
             Z_OK)
         bail("not enough memory", "");
+#ifdef PIGZ_LIBRARY
+    ready = 1;
+#endif
 
     /* keep looking for work */
     for (;;) {
@@ -1270,6 +1456,13 @@ local void compress_thread(void *dummy)
         if (job->next == NULL)
             compress_tail = &compress_head;
         twist(compress_have, BY, -1);
+#ifdef PIGZ_LIBRARY
+        if (lib_failed()) {
+            lib_pass(job);
+            continue;
+        }
+        current = job;
+#endif
 
         /* got a job -- initialize and set the compression level (note that if
            deflateParams() is called immediately after deflateReset(), there is
@@ -1285,6 +1478,7 @@ local void compress_thread(void *dummy)
             left = len < DICT ? len : DICT;
             deflateSetDictionary(&strm, job->out->buf + (len - left), left);
             drop_space(job->out);
+            job->out = NULL;
         }
 
         /* set up input and output */
@@ -1386,6 +1580,9 @@ local void compress_thread(void *dummy)
         Trace(("-- checked #%ld%s", job->seq, job->more ? "" : " (last)"));
         possess(job->calc);
         twist(job->calc, TO, 1);
+#ifdef PIGZ_LIBRARY
+        current = NULL;
+#endif
 
         /* done with that one -- go find another job */
     }
@@ -1427,18 +1624,24 @@ local void write_thread(void *dummy)
         write_head = job->next;
         twist(write_first, TO, write_head == NULL ? -1 : write_head->seq);
 
-        /* update lengths, save uncompressed length for COMB */
+        /* update lengths, save uncompressed length for COMB (no input or output
+           in a job passed on after a library failure, see lib_pass()) */
         more = job->more;
-        len = job->in->len;
-        drop_space(job->in);
+        len = 0;
+        if (job->in != NULL) {
+            len = job->in->len;
+            drop_space(job->in);
+        }
         ulen += (unsigned long)len;
-        clen += (unsigned long)(job->out->len);
 
         /* write the compressed data and drop the output buffer */
-        Trace(("-- writing #%ld", seq));
-        writen(outd, job->out->buf, job->out->len);
-        drop_space(job->out);
-        Trace(("-- wrote #%ld%s", seq, more ? "" : " (last)"));
+        if (job->out != NULL) {
+            clen += (unsigned long)(job->out->len);
+            Trace(("-- writing #%ld", seq));
+            writen(outd, job->out->buf, job->out->len);
+            drop_space(job->out);
+            Trace(("-- wrote #%ld%s", seq, more ? "" : " (last)"));
+        }
 
         /* wait for check calculation to complete, then combine, once
            the compress thread is done with the input, release it */
@@ -1516,6 +1719,16 @@ local void parallel_compress(void)
     /* if first time or after an option change, setup the job lists */
     setup_jobs();
 
+#ifdef PIGZ_LIBRARY
+    /* set aside the job that ends the write thread after a failure here */
+    job = malloc(sizeof(struct job));
+    if (job == NULL)
+        bail("not enough memory", "");
+    job->calc = new_lock(0);
+    lib_last = job;
+    lib_seq = 0;
+#endif
+
     /* start write thread */
     writeth = launch(write_thread, NULL);
 
@@ -1530,6 +1743,12 @@ local void parallel_compress(void)
     hash = RSYNCHIT;
     left = 0;
     do {
+#ifdef PIGZ_LIBRARY
+        /* stop reading if a compress thread failed */
+        if (lib_failed())
+            bail("compression failed", "");
+#endif
+
         /* create a new job */
         job = malloc(sizeof(struct job));
         if (job == NULL)
@@ -1665,6 +1884,9 @@ local void parallel_compress(void)
         *compress_tail = job;
         compress_tail = &(job->next);
         twist(compress_have, BY, +1);
+#ifdef PIGZ_LIBRARY
+        lib_seq = seq;
+#endif
     } while (more);
     drop_space(next);
 
@@ -1673,6 +1895,11 @@ local void parallel_compress(void)
     join(writeth);
     writeth = NULL;
     Trace(("-- write thread joined"));
+#ifdef PIGZ_LIBRARY
+    free_lock(lib_last->calc);
+    free(lib_last);
+    lib_last = NULL;
+#endif
 }
 
 #endif
@@ -1729,17 +1956,26 @@ local void single_compress(int reset)
     /* initialize the deflate structure if this is the first time */
     if (strm == NULL) {
         out_size = size > MAXP2 ? MAXP2 : (unsigned)size;
-        if ((in = malloc(size)) == NULL ||
-            (next = malloc(size)) == NULL ||
-            (out = malloc(out_size)) == NULL ||
-            (strm = malloc(sizeof(z_stream))) == NULL)
-            bail("not enough memory", "");
-        strm->zfree = Z_NULL;
-        strm->zalloc = Z_NULL;
-        strm->opaque = Z_NULL;
-        if (deflateInit2(strm, level, Z_DEFLATED, -15, 8,
-                         Z_DEFAULT_STRATEGY) != Z_OK)
+        in = malloc(size);
+        next = malloc(size);
+        out = malloc(out_size);
+        strm = malloc(sizeof(z_stream));
+        if (strm != NULL) {
+            strm->zfree = Z_NULL;
+            strm->zalloc = Z_NULL;
+            strm->opaque = Z_NULL;
+        }
+        if (in == NULL || next == NULL || out == NULL || strm == NULL ||
+            deflateInit2(strm, level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            /* free what was allocated, so the next call starts over */
+            free(strm);
+            free(out);
+            free(next);
+            free(in);
+            strm = NULL;
             bail("not enough memory", "");
+        }
     }
 
     /* write header */
@@ -3583,6 +3819,83 @@ local void cut_short(int sig)
 /* Process arguments, compress in the gzip format.  Note that procs must be at
    least two in order to provide a dictionary in one work unit for the other
    work unit, and that size must be at least 32K to store a full dictionary. */
+#ifdef PIGZ_LIBRARY
+
+#ifndef NOTHREAD
+#  include <pthread.h>
+local pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* compress in_fd to write_fn as a single gzip stream -- the globals are shared
+   with the command line code, so only one stream can be compressed at a time */
+int pigz_compress_fd(int in_fd, pigz_write_fn write_fn, void *cookie,
+                     int lev, int threads)
+{
+    jmp_buf env;                    /* return point for a failure */
+    unsigned char buf[4096];        /* for reading the rest after a failure */
+    ssize_t got;                    /* amount read */
+
+#ifndef NOTHREAD
+    pthread_mutex_lock(&lib_lock);
+#endif
+    defaults();
+    prog = "pigz";
+    strcpy(in, "<stream>");
+    out = NULL;
+    verbosity = 0;
+    headis = 0;                     /* no name or time stamp in the header */
+    name = NULL;
+    mtime = 0;
+    level = lev;
+    if (threads > 0)
+        procs = threads;
+    ind = in_fd;
+    outd = 1;
+    out_fn = write_fn;
+    out_cookie = cookie;
+
+    /* errors come back here instead of exiting, see bail() */
+    (void)pthread_once(&lib_once, lib_init);
+    lib_error = 0;
+    yarn_prefix = prog;
+    yarn_abort = lib_abort;
+    lib_set_catch(&env);
+    if (setjmp(env) == 0) {
+#ifndef NOTHREAD
+        if (procs > 1)
+            parallel_compress();
+        else
+#endif
+            single_compress(0);
+    }
+    else {
+        /* let the write thread finish, then read the rest of the input so
+           that whoever writes to in_fd is not left blocked */
+#ifndef NOTHREAD
+        lib_end_write();
+#endif
+        for (;;) {
+            got = read(ind, buf, sizeof(buf));
+            if (got == 0 || (got < 0 && errno != EINTR))
+                break;
+        }
+    }
+    lib_set_catch(NULL);
+
+    /* release the threads and buffers so nothing lingers between backups */
+    new_opts();
+    yarn_abort = NULL;
+    out_fn = NULL;
+    out_cookie = NULL;
+    outd = -1;
+#ifndef NOTHREAD
+    pthread_mutex_unlock(&lib_lock);
+#endif
+    return lib_failed() ? -1 : 0;
+}
+
+#else /* !PIGZ_LIBRARY */
+
 int main(int argc, char **argv)
 {
     int n;                          /* general index */
@@ -3680,3 +3993,5 @@ int main(int argc, char **argv)
     log_dump();
     return warned ? 2 : 0;
 }
+
+#endif /* PIGZ_LIBRARY */
@@ -0,0 +1,33 @@
+/* pigz.h -- library interface to the pigz parallel gzip compressor
+ *
+ * Built into libtwpigz when pigz.c is compiled with PIGZ_LIBRARY defined.
+ */
+
+#ifndef PIGZ_H
+#define PIGZ_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* called from the pigz write thread, in order, with each piece of gzip output
+   -- the callback must consume all len bytes, errors have to be recorded by
+   the caller since pigz has no way to stop early */
+typedef void (*pigz_write_fn)(void *cookie, const unsigned char *buf, size_t len);
+
+/* compress everything read from in_fd until end of file into a single gzip
+   stream passed to write_fn, using level (Z_DEFAULT_COMPRESSION for the
+   default) and up to threads compression threads (0 for the number of
+   processors) -- calls are serialized, returns 0, or -1 if reading in_fd or
+   allocating memory failed, in which case the output stops early and the rest
+   of in_fd is read and dropped */
+int pigz_compress_fd(int in_fd, pigz_write_fn write_fn, void *cookie,
+                     int level, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -272,23 +272,31 @@ thread *launch(void (*probe)(void *), void *payload)
     capsule->probe = probe;
     capsule->payload = payload;
 
+    /* allocate before taking threads_lock, so that it is not left held if
+       yarn_abort() returns to the application instead of exiting */
+    th = my_malloc(sizeof(struct thread_s));
+
     /* assure this thread is in the list before join_all() or ignition() looks
        for it */
     possess(&(threads_lock));
 
     /* create the thread and call ignition() from that thread */
-    th = my_malloc(sizeof(struct thread_s));
     if ((ret = pthread_attr_init(&attr)) ||
         (ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE)) ||
-        (ret = pthread_create(&(th->id), &attr, ignition, capsule)) ||
-        (ret = pthread_attr_destroy(&attr)))
+        (ret = pthread_create(&(th->id), &attr, ignition, capsule))) {
+        release(&(threads_lock));
+        my_free(th);
+        my_free(capsule);
         fail(ret);
+    }
 
     /* put the thread in the threads list for join_all() */
     th->done = 0;
     th->next = threads;
     threads = th;
     release(&(threads_lock));
+    if ((ret = pthread_attr_destroy(&attr)) != 0)
+        fail(ret);
     return th;
 }
 
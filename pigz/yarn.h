@@ -106,7 +106,9 @@
    yarn_abort - an external function that will be executed when there is an
         internal yarn error, due to out of memory or misuse -- this function
         may exit to abort the application, or if it returns, the yarn error
-        handler will exit (set to NULL by default for no action)
+        handler will exit (set to NULL by default for no action) -- it may also
+        longjmp() back to the application after a memory or thread creation
+        error, which does not leave any yarn lock held
  */
 
 extern char *yarn_prefix;
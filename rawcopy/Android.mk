@@ -0,0 +1,11 @@
+LOCAL_PATH := $(call my-dir)
+
+# Raw block device copies used by the recovery, see rawcopy.h
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libtwrawcopy
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES = rawcopy.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+
+include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,518 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "rawcopy.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 040000
+#endif
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+/* largest piece handed to the kernel at a time by the in-kernel copies */
+#define RAW_COPY_KERNEL_CHUNK (1024 * 1024)
+
+/* the two buffers of a buffered copy, the reader fills them in turn and the
+   writer empties them in the same order */
+struct raw_copy {
+	int in_fd;
+	int out_fd;
+	unsigned long long remaining;   /* bytes the reader has left to read */
+	char *buf[2];
+	size_t len[2];
+	int full[2];
+	int eof;                        /* the reader is done */
+	int error;
+	int delta;                      /* RAW_COPY_DELTA, only write what differs */
+	char *old[2];                   /* what out_fd holds where buf[] goes */
+	size_t old_len[2];
+	unsigned long long read_pos;    /* offset in out_fd of the next read */
+	unsigned long long write_pos;   /* offset in out_fd of the next write */
+	unsigned long long skipped;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+unsigned long long raw_copy_size(int fd)
+{
+	struct stat st;
+	unsigned long long size = 0;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size) != 0)
+			return 0;
+		return size;
+	}
+	return st.st_size;
+}
+
+/* O_DIRECT needs the length to be a multiple of the logical block size, the
+   tail of an odd sized image is done through the page cache instead */
+static int clear_direct(int fd)
+{
+	int fl = fcntl(fd, F_GETFL);
+
+	if (fl < 0 || !(fl & O_DIRECT))
+		return -1;
+	return fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+}
+
+static ssize_t read_full(int fd, char *data, size_t len)
+{
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t ret = read(fd, data + total, len - total);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL && clear_direct(fd) == 0)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+}
+
+static int write_full(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, data, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL && clear_direct(fd) == 0)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static ssize_t pread_full(int fd, char *data, size_t len, unsigned long long pos)
+{
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t ret = pread64(fd, data + total, len - total, pos + total);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL && clear_direct(fd) == 0)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+}
+
+static int pwrite_full(int fd, const char *data, size_t len, unsigned long long pos)
+{
+	while (len > 0) {
+		ssize_t ret = pwrite64(fd, data, len, pos);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL && clear_direct(fd) == 0)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		len -= ret;
+		pos += ret;
+	}
+	return 0;
+}
+
+/* errors that mean the kernel cannot copy between these two files */
+static int no_kernel_copy(int err)
+{
+	return err == ENOSYS || err == EINVAL || err == EXDEV || err == EOPNOTSUPP;
+}
+
+/* returns the bytes copied, or -1 with errno set -- errno is ENOSYS if
+   nothing was copied because the kernel cannot do this copy */
+static long long copy_kernel(int in_fd, int out_fd, unsigned long long size)
+{
+	unsigned long long total = 0;
+
+#ifdef __NR_copy_file_range
+	while (total < size) {
+		size_t chunk = size - total > RAW_COPY_KERNEL_CHUNK ? RAW_COPY_KERNEL_CHUNK : size - total;
+		long ret = syscall(__NR_copy_file_range, in_fd, NULL, out_fd, NULL, chunk, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && total == 0 && no_kernel_copy(errno))
+			break; /* try splice */
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+	if (total > 0)
+		return total;
+#endif
+
+#ifdef __NR_splice
+	{
+		int pipe_fd[2], err = 0;
+
+		if (pipe(pipe_fd) != 0)
+			return -1;
+		while (total < size && err == 0) {
+			size_t chunk = size - total > RAW_COPY_KERNEL_CHUNK ? RAW_COPY_KERNEL_CHUNK : size - total;
+			long in = syscall(__NR_splice, in_fd, NULL, pipe_fd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (in < 0 && errno == EINTR)
+				continue;
+			if (in < 0) {
+				err = (total == 0 && no_kernel_copy(errno)) ? ENOSYS : errno;
+				break;
+			}
+			if (in == 0)
+				break;
+			while (in > 0) {
+				long out = syscall(__NR_splice, pipe_fd[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+				if (out < 0 && errno == EINTR)
+					continue;
+				if (out <= 0) {
+					/* the data has already left in_fd, so there is no falling back now */
+					err = out < 0 && errno != EINVAL ? errno : EIO;
+					break;
+				}
+				in -= out;
+				total += out;
+			}
+		}
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		return total;
+	}
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void *reader_thread(void *cookie)
+{
+	struct raw_copy *copy = (struct raw_copy *)cookie;
+	int slot = 0;
+
+	while (1) {
+		size_t len = RAW_COPY_BUFFER_SIZE;
+		ssize_t ret;
+
+		pthread_mutex_lock(&copy->lock);
+		while (copy->full[slot] && !copy->error)
+			pthread_cond_wait(&copy->changed, &copy->lock);
+		if (copy->error) {
+			pthread_mutex_unlock(&copy->lock);
+			break;
+		}
+		pthread_mutex_unlock(&copy->lock);
+
+		if (len > copy->remaining)
+			len = copy->remaining;
+		ret = len ? read_full(copy->in_fd, copy->buf[slot], len) : 0;
+		if (ret > 0 && copy->delta) {
+			/* a failed or short read only means more gets written */
+			ssize_t old = pread_full(copy->out_fd, copy->old[slot], ret, copy->read_pos);
+
+			copy->old_len[slot] = old > 0 ? old : 0;
+			copy->read_pos += ret;
+		}
+
+		pthread_mutex_lock(&copy->lock);
+		if (ret < 0) {
+			fprintf(stderr, "rawcopy: read error: %s\n", strerror(errno));
+			copy->error = 1;
+		} else if (ret > 0) {
+			copy->len[slot] = ret;
+			copy->full[slot] = 1;
+			copy->remaining -= ret;
+		}
+		if (ret <= 0 || copy->remaining == 0)
+			copy->eof = 1;
+		pthread_cond_broadcast(&copy->changed);
+		if (copy->eof || copy->error) {
+			pthread_mutex_unlock(&copy->lock);
+			break;
+		}
+		pthread_mutex_unlock(&copy->lock);
+		slot ^= 1;
+	}
+	return NULL;
+}
+
+/* writes buf[slot], in delta mode only the blocks that differ from old[slot] */
+static int write_slot(struct raw_copy *copy, int slot)
+{
+	const char *data = copy->buf[slot], *old = copy->old[slot];
+	size_t len = copy->len[slot], pos = 0;
+
+	if (!copy->delta)
+		return write_full(copy->out_fd, data, len);
+
+	while (pos < len) {
+		size_t start, block;
+
+		/* skip over the blocks that already match */
+		while (pos < len) {
+			block = len - pos > RAW_COPY_DELTA_BLOCK ? RAW_COPY_DELTA_BLOCK : len - pos;
+			if (pos + block > copy->old_len[slot] || memcmp(data + pos, old + pos, block) != 0)
+				break;
+			copy->skipped += block;
+			pos += block;
+		}
+		if (pos == len)
+			break;
+		/* and write the run of blocks that don't in one go */
+		start = pos;
+		while (pos < len) {
+			block = len - pos > RAW_COPY_DELTA_BLOCK ? RAW_COPY_DELTA_BLOCK : len - pos;
+			if (pos + block <= copy->old_len[slot] && memcmp(data + pos, old + pos, block) == 0)
+				break;
+			pos += block;
+		}
+		if (pwrite_full(copy->out_fd, data + start, pos - start, copy->write_pos + start) != 0)
+			return -1;
+	}
+	copy->write_pos += len;
+	return 0;
+}
+
+static long long copy_buffered(int in_fd, int out_fd, unsigned long long size, int flags, unsigned long long *skipped)
+{
+	struct raw_copy copy;
+	pthread_t reader;
+	long long total = 0;
+	int slot = 0;
+
+	memset(&copy, 0, sizeof(copy));
+	copy.in_fd = in_fd;
+	copy.out_fd = out_fd;
+	copy.remaining = size;
+	/* page aligned for O_DIRECT */
+	copy.buf[0] = (char *)memalign(4096, RAW_COPY_BUFFER_SIZE);
+	copy.buf[1] = (char *)memalign(4096, RAW_COPY_BUFFER_SIZE);
+	if (flags & RAW_COPY_DELTA) {
+		copy.delta = 1;
+		copy.read_pos = copy.write_pos = lseek64(out_fd, 0, SEEK_CUR);
+		copy.old[0] = (char *)memalign(4096, RAW_COPY_BUFFER_SIZE);
+		copy.old[1] = (char *)memalign(4096, RAW_COPY_BUFFER_SIZE);
+	}
+	if (copy.buf[0] == NULL || copy.buf[1] == NULL || (copy.delta && (copy.old[0] == NULL || copy.old[1] == NULL))) {
+		fprintf(stderr, "rawcopy: unable to allocate buffers\n");
+		free(copy.buf[0]);
+		free(copy.buf[1]);
+		free(copy.old[0]);
+		free(copy.old[1]);
+		return -1;
+	}
+	pthread_mutex_init(&copy.lock, NULL);
+	pthread_cond_init(&copy.changed, NULL);
+
+	if (pthread_create(&reader, NULL, reader_thread, &copy) != 0) {
+		/* no thread, read and write in turn with one buffer */
+		while (copy.remaining > 0) {
+			size_t len = copy.remaining > RAW_COPY_BUFFER_SIZE ? RAW_COPY_BUFFER_SIZE : copy.remaining;
+			ssize_t ret = read_full(in_fd, copy.buf[0], len);
+
+			if (ret < 0) {
+				total = -1;
+				break;
+			}
+			if (ret == 0)
+				break;
+			copy.len[0] = ret;
+			if (copy.delta) {
+				ssize_t old = pread_full(out_fd, copy.old[0], ret, copy.write_pos);
+
+				copy.old_len[0] = old > 0 ? old : 0;
+			}
+			if (write_slot(&copy, 0) != 0) {
+				total = -1;
+				break;
+			}
+			total += ret;
+			copy.remaining -= ret;
+		}
+	} else {
+		while (1) {
+			pthread_mutex_lock(&copy.lock);
+			while (!copy.full[slot] && !copy.eof && !copy.error)
+				pthread_cond_wait(&copy.changed, &copy.lock);
+			if (copy.error || !copy.full[slot]) {
+				pthread_mutex_unlock(&copy.lock);
+				break;
+			}
+			pthread_mutex_unlock(&copy.lock);
+
+			if (write_slot(&copy, slot) != 0) {
+				fprintf(stderr, "rawcopy: write error: %s\n", strerror(errno));
+				pthread_mutex_lock(&copy.lock);
+				copy.error = 1;
+				pthread_cond_broadcast(&copy.changed);
+				pthread_mutex_unlock(&copy.lock);
+				break;
+			}
+			total += copy.len[slot];
+
+			pthread_mutex_lock(&copy.lock);
+			copy.full[slot] = 0;
+			pthread_cond_broadcast(&copy.changed);
+			pthread_mutex_unlock(&copy.lock);
+			slot ^= 1;
+		}
+		pthread_join(reader, NULL);
+		if (copy.error)
+			total = -1;
+	}
+
+	/* leave out_fd where a plain copy would have */
+	if (copy.delta && total >= 0)
+		lseek64(out_fd, copy.write_pos, SEEK_SET);
+	if (skipped != NULL)
+		*skipped = copy.skipped;
+
+	pthread_cond_destroy(&copy.changed);
+	pthread_mutex_destroy(&copy.lock);
+	free(copy.buf[0]);
+	free(copy.buf[1]);
+	free(copy.old[0]);
+	free(copy.old[1]);
+	return total;
+}
+
+long long raw_copy_fd(int in_fd, int out_fd, unsigned long long size, int flags, unsigned long long *skipped)
+{
+	long long total = -1;
+	struct stat st;
+
+	if (skipped != NULL)
+		*skipped = 0;
+	if (size == 0)
+		size = raw_copy_size(in_fd);
+	if (size == 0)
+		return 0;
+	/* only a block device keeps its old contents to compare with */
+	if ((flags & RAW_COPY_DELTA) && (fstat(out_fd, &st) != 0 || !S_ISBLK(st.st_mode)))
+		flags &= ~RAW_COPY_DELTA;
+
+	if (!(flags & (RAW_COPY_DIRECT | RAW_COPY_DELTA))) {
+		total = copy_kernel(in_fd, out_fd, size);
+		if (total < 0 && errno != ENOSYS) {
+			fprintf(stderr, "rawcopy: copy error: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	if (total < 0)
+		total = copy_buffered(in_fd, out_fd, size, flags, skipped);
+	if (total < 0)
+		return -1;
+
+	if (flags & RAW_COPY_SYNC) {
+		if (fsync(out_fd) != 0 && errno != EINVAL) {
+			fprintf(stderr, "rawcopy: fsync error: %s\n", strerror(errno));
+			return -1;
+		}
+		/* drop what the device has cached so it reads back what was written */
+		if (fstat(out_fd, &st) == 0 && S_ISBLK(st.st_mode))
+			ioctl(out_fd, BLKFLSBUF, 0);
+	}
+	return total;
+}
+
+/* block devices get O_DIRECT if asked for and it can be used */
+static int open_raw(const char *path, int mode, int flags)
+{
+	struct stat st;
+	int fd;
+
+	if ((flags & RAW_COPY_DIRECT) && stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+		fd = open(path, mode | O_LARGEFILE | O_DIRECT, 0644);
+		if (fd >= 0)
+			return fd;
+	}
+	return open(path, mode | O_LARGEFILE, 0644);
+}
+
+long long raw_copy_file(const char *in_file, const char *out_file, int flags, unsigned long long *skipped)
+{
+	struct stat st;
+	long long ret;
+	int in_fd, out_fd, mode = O_WRONLY;
+
+	in_fd = open_raw(in_file, O_RDONLY, flags);
+	if (in_fd < 0) {
+		fprintf(stderr, "rawcopy: unable to open '%s': %s\n", in_file, strerror(errno));
+		return -1;
+	}
+	/* files are replaced, block devices are written in place */
+	if (stat(out_file, &st) != 0 || !S_ISBLK(st.st_mode))
+		mode |= O_CREAT | O_TRUNC;
+	else if (flags & RAW_COPY_DELTA)
+		mode = O_RDWR;
+	out_fd = open_raw(out_file, mode, flags);
+	if (out_fd < 0) {
+		fprintf(stderr, "rawcopy: unable to open '%s': %s\n", out_file, strerror(errno));
+		close(in_fd);
+		return -1;
+	}
+	ret = raw_copy_fd(in_fd, out_fd, 0, flags, skipped);
+	if (close(out_fd) != 0)
+		ret = -1;
+	close(in_fd);
+	return ret;
+}
@@ -0,0 +1,70 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* rawcopy.h -- raw block device copies for backup, restore and flashing
+ *
+ * Built into libtwrawcopy for the recovery and compiled into libmmcutils.
+ */
+
+#ifndef RAWCOPY_H
+#define RAWCOPY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size of each of the two buffers used by a buffered copy */
+#define RAW_COPY_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* open block devices with O_DIRECT so that a large copy does not push
+   everything else out of the page cache, this also skips the in-kernel
+   copy since it cannot be combined with O_DIRECT */
+#define RAW_COPY_DIRECT 0x1
+
+/* fsync the output and, for a block device, flush its buffer cache with
+   BLKFLSBUF once the copy is done */
+#define RAW_COPY_SYNC   0x2
+
+/* read what a block device already holds alongside the image and only
+   write the blocks that differ, to save flash wear and time when an image
+   is flashed over a nearly identical one -- ignored for regular files */
+#define RAW_COPY_DELTA  0x4
+
+/* blocks compared by RAW_COPY_DELTA */
+#define RAW_COPY_DELTA_BLOCK 4096
+
+/* copy size bytes, or everything if size is 0, from in_fd to out_fd
+   starting at their current offsets -- copy_file_range or splice is used
+   when the kernel supports it, otherwise a reader thread fills one buffer
+   while the calling thread writes the other, returns the number of bytes
+   copied or -1 on error, if skipped is not NULL it gets the bytes that
+   RAW_COPY_DELTA found already matching and did not write */
+long long raw_copy_fd(int in_fd, int out_fd, unsigned long long size, int flags, unsigned long long *skipped);
+
+/* open in_file and out_file (created if needed) and copy all of in_file
+   with raw_copy_fd, returns the number of bytes copied or -1 on error */
+long long raw_copy_file(const char *in_file, const char *out_file, int flags, unsigned long long *skipped);
+
+/* size of a block device or regular file, 0 if it cannot be found */
+unsigned long long raw_copy_size(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
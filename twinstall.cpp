@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -40,6 +41,7 @@
 #include "data.hpp"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpDU.hpp"
 
 extern RecoveryUI* ui;
 
@@ -259,40 +261,178 @@ exit:
     return NULL;
 }
 
+// The zip that will be installed after the current one is checked by a
+// background thread while the current one's update-binary runs
+struct Zip_Prefetch {
+	string Path;
+	struct stat St;                 // Identifies the file that was checked
+	bool Running;
+	pthread_t Thread;
+	bool Zip_Verify;                // Whether the signature was to be checked
+	bool Signature_Verified;
+	bool MD5_Computed;
+	unsigned char MD5_Digest[16];
+};
+
+static Zip_Prefetch prefetch;
+static string next_zip;
+
+// SHA-1 of the signed part of a zip that was hashed while it was received
+struct Zip_Digest {
+	string Path;
+	struct stat St;
+	unsigned char SHA1[SHA_DIGEST_SIZE];
+	size_t Signed_Len;
+};
+
+static Zip_Digest known_digest;
+
+static void* prefetch_thread(void* cookie) {
+	unsigned char md5_expected[16];
+	bool need_md5;
+
+	need_md5 = (TWFunc::Read_MD5(prefetch.Path, md5_expected) == 1);
+	if (prefetch.Zip_Verify) {
+		int numKeys;
+		RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+		if (loadedKeys != NULL) {
+			prefetch.Signature_Verified = verify_file_md5(prefetch.Path.c_str(), loadedKeys, numKeys, need_md5 ? prefetch.MD5_Digest : NULL, true) == VERIFY_SUCCESS;
+			prefetch.MD5_Computed = need_md5 && prefetch.Signature_Verified;
+			free(loadedKeys);
+		}
+	} else if (need_md5) {
+		prefetch.MD5_Computed = TWFunc::Get_MD5(prefetch.Path, prefetch.MD5_Digest);
+	}
+	LOGI("Prefetched '%s': signature %s, md5 %s\n", prefetch.Path.c_str(),
+		prefetch.Signature_Verified ? "verified" : "not verified",
+		prefetch.MD5_Computed ? "computed" : "not computed");
+	return NULL;
+}
+
+static void finish_prefetch(void) {
+	if (prefetch.Running) {
+		pthread_join(prefetch.Thread, NULL);
+		prefetch.Running = false;
+	}
+}
+
+static void drop_prefetch(void) {
+	finish_prefetch();
+	prefetch.Path.clear();
+}
+
+// The updater may unmount or format any partition except the one holding
+// the zip it is installing, so the next zip is only read if it is there too
+static void start_prefetch(const string& Path, const char* installing, bool zip_verify) {
+	struct stat st;
+
+	drop_prefetch();
+	if (stat(Path.c_str(), &prefetch.St) != 0 || stat(installing, &st) != 0)
+		return;
+	if (prefetch.St.st_dev != st.st_dev) {
+		LOGI("Not prefetching '%s', it is not on the same storage as '%s'\n", Path.c_str(), installing);
+		return;
+	}
+	prefetch.Path = Path;
+	prefetch.Zip_Verify = zip_verify;
+	prefetch.Signature_Verified = false;
+	prefetch.MD5_Computed = false;
+	if (pthread_create(&prefetch.Thread, NULL, prefetch_thread, NULL) == 0)
+		prefetch.Running = true;
+	else
+		prefetch.Path.clear();
+}
+
+// Waits for the prefetch of path, true if it is for this same file
+static bool use_prefetch(const char* path) {
+	struct stat st;
+
+	finish_prefetch();
+	if (prefetch.Path.empty() || prefetch.Path != path)
+		return false;
+	if (stat(path, &st) != 0 || st.st_dev != prefetch.St.st_dev || st.st_ino != prefetch.St.st_ino ||
+		st.st_size != prefetch.St.st_size || st.st_mtime != prefetch.St.st_mtime) {
+		LOGI("'%s' changed since it was prefetched\n", path);
+		return false;
+	}
+	return true;
+}
+
+extern "C" void TWinstall_set_next_zip(const char* path) {
+	if (path == NULL) {
+		next_zip.clear();
+		drop_prefetch();
+	} else
+		next_zip = path;
+}
+
+extern "C" void TWinstall_set_zip_sha1(const char* path, const unsigned char* sha1, size_t signed_len) {
+	known_digest.Path.clear();
+	if (stat(path, &known_digest.St) != 0)
+		return;
+	known_digest.Path = path;
+	memcpy(known_digest.SHA1, sha1, SHA_DIGEST_SIZE);
+	known_digest.Signed_Len = signed_len;
+}
+
+// True if the digest from TWinstall_set_zip_sha1 is for this same file, it is only used once
+static bool use_known_digest(const char* path) {
+	struct stat st;
+	bool ret;
+
+	if (known_digest.Path.empty() || known_digest.Path != path)
+		return false;
+	known_digest.Path.clear();
+	ret = (stat(path, &st) == 0 && st.st_dev == known_digest.St.st_dev && st.st_ino == known_digest.St.st_ino &&
+		st.st_size == known_digest.St.st_size && st.st_mtime == known_digest.St.st_mtime);
+	if (!ret)
+		LOGI("'%s' changed since it was hashed\n", path);
+	return ret;
+}
+
 extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
-	int err, zip_verify, md5_return, md5_verify;
+	int err, zip_verify, md5_return, md5_verify, ret;
+	unsigned char md5_expected[16], md5_digest[16];
+	bool prefetched;
 
 	ui_print("Installing '%s'...\n", path);
 
 	if (!PartitionManager.Mount_By_Path(path, 0)) {
 		LOGE("Failed to mount '%s'\n", path);
+		drop_prefetch();
 		return -1;
 	}
+	prefetched = use_prefetch(path);
 
 	ui_print("Checking for MD5 file...\n");
-	md5_return = TWFunc::Check_MD5(path);
+	md5_return = TWFunc::Read_MD5(path, md5_expected);
 	if (md5_return == 0) {
-		// MD5 did not match.
+		// The MD5 file is not for this zip.
 		LOGE("Zip MD5 does not match.\nUnable to install zip.\n");
+		drop_prefetch();
 		return INSTALL_CORRUPT;
 	} else if (md5_return == -1) {
 		DataManager::GetValue(TW_FORCE_MD5_CHECK_VAR, md5_verify);
 		if (md5_verify == 1) {
 			// Forced MD5 checking is on and no MD5 file found.
 			LOGE("No MD5 file found for '%s'.\nDisable force MD5 check to avoid this error.\n", path);
+			drop_prefetch();
 			return INSTALL_CORRUPT;
 		} else
 			ui_print("Skipping MD5 check: no MD5 file found.\n");
-	} else if (md5_return == 1)
-		ui_print("Zip MD5 matched.\n"); // MD5 found and matched.
+	}
 
 	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
-	if (zip_verify) {
+	if (zip_verify && prefetched && prefetch.Zip_Verify && prefetch.Signature_Verified && (md5_return != 1 || prefetch.MD5_Computed)) {
+		ui_print("Zip signature was verified during the previous install.\n");
+		memcpy(md5_digest, prefetch.MD5_Digest, sizeof(md5_digest));
+	} else if (zip_verify) {
 		ui_print("Verifying zip signature...\n");
 		int numKeys;
 		RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
 		if (loadedKeys == NULL) {
 			LOGE("Failed to load keys\n");
+			drop_prefetch();
 			return -1;
 		}
 		LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -302,16 +442,38 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 		ui->SetProgressType(RecoveryUI::DETERMINATE);
 		ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION, VERIFICATION_PROGRESS_TIME);
 
-		err = verify_file(path, loadedKeys, numKeys);
+		// The MD5 is computed while the signature is checked so that the zip is only read once
+		if (md5_return != 1 && use_known_digest(path))
+			err = verify_file_sha1(path, loadedKeys, numKeys, known_digest.SHA1, known_digest.Signed_Len);
+		else
+			err = verify_file_md5(path, loadedKeys, numKeys, md5_return == 1 ? md5_digest : NULL, false);
 		free(loadedKeys);
 		LOGI("verify_file returned %d\n", err);
 		if (err != VERIFY_SUCCESS) {
 			LOGE("signature verification failed\n");
+			drop_prefetch();
 			return -1;
 		}
+	} else if (md5_return == 1) {
+		if (prefetched && prefetch.MD5_Computed)
+			memcpy(md5_digest, prefetch.MD5_Digest, sizeof(md5_digest));
+		else if (!TWFunc::Get_MD5(path, md5_digest)) {
+			LOGE("Unable to compute the MD5 of '%s'\n", path);
+			drop_prefetch();
+			return INSTALL_CORRUPT;
+		}
+	}
+	if (md5_return == 1) {
+		if (memcmp(md5_expected, md5_digest, sizeof(md5_digest)) != 0) {
+			LOGE("Zip MD5 does not match.\nUnable to install zip.\n");
+			drop_prefetch();
+			return INSTALL_CORRUPT;
+		}
+		ui_print("Zip MD5 matched.\n"); // MD5 found and matched.
 	}
 	/* Try to open the package.
      */
+    drop_prefetch();
     ZipArchive zip;
     err = mzOpenZipArchive(path, &zip);
     if (err != 0) {
@@ -319,7 +481,15 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
         return INSTALL_CORRUPT;
     }
 
-    /* Verify and install the contents of the package.
+    /* Check the next queued zip while this one installs, and wait for it
+     * before returning so nothing is left reading from storage.
      */
-    return try_update_binary(path, &zip, wipe_cache);
+    if (!next_zip.empty()) {
+        start_prefetch(next_zip, path, zip_verify != 0);
+        next_zip.clear();
+    }
+    ret = try_update_binary(path, &zip, wipe_cache);
+    finish_prefetch();
+    twrpDU::Drop_Cache();
+    return ret;
 }
@@ -25,6 +25,15 @@ extern "C" {
 
 int TWinstall_zip(const char* path, int* wipe_cache);
 
+// Zip that will be installed after the next TWinstall_zip call, it is
+// verified and opened in the background while that one installs.  NULL
+// drops anything that was prefetched.
+void TWinstall_set_next_zip(const char* path);
+
+// SHA-1 of the first signed_len bytes of path, taken while it was being
+// received, so that checking its signature does not read it again.
+void TWinstall_set_zip_sha1(const char* path, const unsigned char* sha1, size_t signed_len);
+
 #ifdef __cplusplus
 }
 #endif
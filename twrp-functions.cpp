@@ -9,6 +9,9 @@
 #include <time.h>
 #include <errno.h>
 #include <sys/reboot.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "twrp-functions.hpp"
 #include "partitions.hpp"
@@ -16,6 +19,8 @@
 #include "data.hpp"
 #include "bootloader.h"
 #include "variables.h"
+#include "digest/md5.h"
+#include "twrpDU.hpp"
 
 /*  Checks md5 for a path
     Return values:
@@ -23,49 +28,106 @@
         0 : Failed
         1 : Success */
 int TWFunc::Check_MD5(string File) {
+	unsigned char expected[16], digest[16];
 	int ret;
-	string Command, DirPath, MD5_File, Sline, Filename, MD5_File_Filename, OK;
-	char line[255];
-	size_t pos;
-
-	MD5_File = File + ".md5";
-	if (Path_Exists(MD5_File)) {
-		DirPath = Get_Path(File);
-		MD5_File = Get_Filename(MD5_File);
-		Command = "cd '" + DirPath + "' && /sbin/busybox md5sum -c '" + MD5_File + "' > /tmp/md5output";
-		system(Command.c_str());
-		FILE * cs = fopen("/tmp/md5output", "r");
-		if (cs == NULL) {
-			LOGE("Unable to open md5 output file.\n");
+
+	ret = Read_MD5(File, expected);
+	if (ret != 1)
+		return ret;
+	if (!Get_MD5(File, digest))
+		return 0;
+	if (memcmp(expected, digest, sizeof(digest)) != 0)
+		return 0;
+	return 1;
+}
+
+// Reads the digest for File from File.md5, -1 if there is no md5 file and 0 if it is not for File
+int TWFunc::Read_MD5(string File, unsigned char* Digest) {
+	string MD5_File = File + ".md5";
+	char line[PATH_MAX + 40];
+	FILE* fp;
+	int i;
+
+	fp = fopen(MD5_File.c_str(), "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), fp) == NULL) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	// md5sum format, 32 hex digits, two spaces (or space and *) and the file name
+	string Sline = line;
+	while (!Sline.empty() && (Sline[Sline.size() - 1] == '\n' || Sline[Sline.size() - 1] == '\r'))
+		Sline.resize(Sline.size() - 1);
+	if (Sline.size() < 35 || Sline.substr(34) != Get_Filename(File))
+		return 0;
+	for (i = 0; i < 16; i++) {
+		unsigned int byte;
+
+		if (sscanf(Sline.c_str() + (i * 2), "%2x", &byte) != 1)
 			return 0;
-		}
+		Digest[i] = byte;
+	}
+	return 1;
+}
 
-		fgets(line, sizeof(line), cs);
-		fclose(cs);
-
-		Sline = line;
-		pos = Sline.find(":");
-		if (pos != string::npos) {
-			Filename = Get_Filename(File);
-			MD5_File_Filename = Sline.substr(0, pos);
-			OK = Sline.substr(pos + 2, Sline.size() - pos - 2);
-			if (Filename == MD5_File_Filename && (OK == "OK" || OK == "OK\n")) {
-				//MD5 is good, return 1
-				ret = 1;
-			} else {
-				// MD5 is bad, return 0
-				ret = 0;
-			}
-		} else {
-			// MD5 is bad, return 0
-			ret = 0;
+// Hashes a whole file with large reads instead of running md5sum
+bool TWFunc::Get_MD5(string File, unsigned char* Digest) {
+	struct MD5Context md5;
+	unsigned char* buf;
+	ssize_t len;
+	int fd;
+
+	fd = open(File.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		LOGE("Unable to open '%s': %s\n", File.c_str(), strerror(errno));
+		return false;
+	}
+	buf = (unsigned char*)malloc(MD5_BUFFER_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return false;
+	}
+	MD5Init(&md5);
+	while ((len = read(fd, buf, MD5_BUFFER_SIZE)) != 0) {
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			LOGE("Error reading '%s': %s\n", File.c_str(), strerror(errno));
+			free(buf);
+			close(fd);
+			return false;
 		}
-	} else {
-		//No md5 file, return -1
-		ret = -1;
+		MD5Update(&md5, buf, len);
 	}
+	MD5Final(Digest, &md5);
+	free(buf);
+	close(fd);
+	return true;
+}
 
-    return ret;
+// Writes the .md5 file for File in the same format as md5sum so that Check_MD5 can verify it
+bool TWFunc::Write_MD5(string File, const unsigned char* Digest) {
+	char hex[33];
+	string MD5_File = File + ".md5";
+	FILE* fp;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + (i * 2), "%02x", Digest[i]);
+	fp = fopen(MD5_File.c_str(), "w");
+	if (fp == NULL) {
+		LOGE("Unable to create '%s'\n", MD5_File.c_str());
+		return false;
+	}
+	fprintf(fp, "%s  %s\n", hex, Get_Filename(File).c_str());
+	if (fclose(fp) != 0) {
+		LOGE("Error writing '%s'\n", MD5_File.c_str());
+		return false;
+	}
+	return true;
 }
 
 // Returns "file.name" from a full /path/to/file.name
@@ -183,43 +245,11 @@ int TWFunc::Recursive_Mkdir(string Path) {
 }
 
 unsigned long long TWFunc::Get_Folder_Size(string Path, bool Display_Error) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	char path2[1024], filename[1024];
-	unsigned long long dusize = 0;
-
-	// Make a copy of path in case the data in the pointer gets overwritten later
-	strcpy(path2, Path.c_str());
+	twrpDU du;
 
-	d = opendir(path2);
-	if (d == NULL)
-	{
-		LOGE("error opening '%s'\n", path2);
+	if (!du.Add_Root(Path) || !du.Walk(Display_Error))
 		return 0;
-	}
-
-	while ((de = readdir(d)) != NULL)
-	{
-		if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
-		{
-			strcpy(filename, path2);
-			strcat(filename, "/");
-			strcat(filename, de->d_name);
-			dusize += Get_Folder_Size(filename, Display_Error);
-		}
-		else if (de->d_type == DT_REG)
-		{
-			strcpy(filename, path2);
-			strcat(filename, "/");
-			strcat(filename, de->d_name);
-			stat(filename, &st);
-			dusize += (unsigned long long)(st.st_size);
-		}
-	}
-	closedir(d);
-
-	return dusize;
+	return du.Get_Size(Path);
 }
 
 bool TWFunc::Path_Exists(string Path) {
@@ -232,26 +262,90 @@ bool TWFunc::Path_Exists(string Path) {
 		return true;
 }
 
+static unsigned int Probe_Le16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int Probe_Le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+string TWFunc::Probe_FS_Type(string Block_Device) {
+	unsigned char buf[2048];
+	unsigned int sector_size;
+	int fd;
+	bool ret;
+
+	fd = open(Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return "";
+	ret = (pread(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf));
+	close(fd);
+	if (!ret)
+		return "";
+
+	// f2fs and ext2/3/4 keep their superblock 1024 bytes in
+	if (Probe_Le32(buf + 1024) == PROBE_F2FS_MAGIC)
+		return "f2fs";
+	if (Probe_Le16(buf + 1024 + 56) == PROBE_EXT_MAGIC && Probe_Le32(buf + 1024 + 24) <= 6) {
+		unsigned int compat = Probe_Le32(buf + 1024 + 92);
+		unsigned int incompat = Probe_Le32(buf + 1024 + 96);
+		unsigned int ro_compat = Probe_Le32(buf + 1024 + 100);
+
+		if (incompat & PROBE_EXT_INCOMPAT_JOURNAL_DEV)
+			return "";
+		// Same rules as blkid, anything ext3 can't handle makes it ext4
+		if ((incompat & ~PROBE_EXT3_INCOMPAT_SUPP) || (ro_compat & ~PROBE_EXT3_RO_COMPAT_SUPP))
+			return "ext4";
+		if (compat & PROBE_EXT_COMPAT_HAS_JOURNAL)
+			return "ext3";
+		return "ext2";
+	}
+
+	// The others start with a boot sector
+	if (memcmp(buf + 3, "NTFS    ", 8) == 0)
+		return "ntfs";
+	if (memcmp(buf + 3, "EXFAT   ", 8) == 0)
+		return "exfat";
+	sector_size = Probe_Le16(buf + 11);
+	if (buf[510] == 0x55 && buf[511] == 0xAA && (sector_size == 512 || sector_size == 1024 || sector_size == 2048 || sector_size == 4096) &&
+		(memcmp(buf + 54, "FAT", 3) == 0 || memcmp(buf + 82, "FAT32", 5) == 0))
+		return "vfat";
+
+	// yaffs2 has no superblock, but its first chunk is the object header of
+	// an entry in the root folder
+	if (Probe_Le32(buf) >= 1 && Probe_Le32(buf) <= 5 && Probe_Le32(buf + 4) == 1 && Probe_Le16(buf + 8) == 0xFFFF)
+		return "yaffs2";
+	return "";
+}
+
+// Partitions can be backed up by several threads at once
+static pthread_mutex_t Operation_Text_Lock = PTHREAD_MUTEX_INITIALIZER;
+
 void TWFunc::GUI_Operation_Text(string Read_Value, string Default_Text) {
 	string Display_Text;
 
+	pthread_mutex_lock(&Operation_Text_Lock);
 	DataManager::GetValue(Read_Value, Display_Text);
 	if (Display_Text.empty())
 		Display_Text = Default_Text;
 
 	DataManager::SetValue("tw_operation", Display_Text);
 	DataManager::SetValue("tw_partition", "");
+	pthread_mutex_unlock(&Operation_Text_Lock);
 }
 
 void TWFunc::GUI_Operation_Text(string Read_Value, string Partition_Name, string Default_Text) {
 	string Display_Text;
 
+	pthread_mutex_lock(&Operation_Text_Lock);
 	DataManager::GetValue(Read_Value, Display_Text);
 	if (Display_Text.empty())
 		Display_Text = Default_Text;
 
 	DataManager::SetValue("tw_operation", Display_Text);
 	DataManager::SetValue("tw_partition", Partition_Name);
+	pthread_mutex_unlock(&Operation_Text_Lock);
 }
 
 unsigned long TWFunc::Get_File_Size(string Path) {
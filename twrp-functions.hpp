@@ -5,6 +5,16 @@
 
 using namespace std;
 
+#define MD5_BUFFER_SIZE (1024 * 1024)                                            // Read size for hashing files
+
+// Superblock magic and ext feature bits used by Probe_FS_Type
+#define PROBE_F2FS_MAGIC 0xF2F52010
+#define PROBE_EXT_MAGIC 0xEF53
+#define PROBE_EXT_COMPAT_HAS_JOURNAL 0x0004
+#define PROBE_EXT_INCOMPAT_JOURNAL_DEV 0x0008
+#define PROBE_EXT3_INCOMPAT_SUPP 0x0016                                          // FILETYPE | RECOVER | META_BG
+#define PROBE_EXT3_RO_COMPAT_SUPP 0x0007                                         // SPARSE_SUPER | LARGE_FILE | BTREE_DIR
+
 typedef enum
 {
     rb_current = 0,
@@ -20,6 +30,9 @@ class TWFunc
 {
 public:
 	static int Check_MD5(string File);
+	static int Read_MD5(string File, unsigned char* Digest);                    // Reads the 16 byte digest from File.md5, -1 if there is no md5 file
+	static bool Get_MD5(string File, unsigned char* Digest);                    // Computes the MD5 of File
+	static bool Write_MD5(string File, const unsigned char* Digest);            // Writes File.md5 in md5sum format from a 16 byte MD5 digest
 	static string Get_Root_Path(string Path);                                   // Trims any trailing folders or filenames from the path, also adds a leading / if not present
 	static string Get_Path(string Path);                                        // Trims everything after the last / in the string
 	static string Get_Filename(string Path);                                    // Trims the path off of a filename
@@ -28,8 +41,9 @@ public:
 	static void htc_dumlock_restore_original_boot(void);                        // Restores the backup of boot from HTC Dumlock
 	static void htc_dumlock_reflash_recovery_to_boot(void);                     // Reflashes the current recovery to boot
 	static int Recursive_Mkdir(string Path);                                    // Recursively makes the entire path
-	static unsigned long long Get_Folder_Size(string Path, bool Display_Error); // Gets the size of a folder and all of its subfolders using dirent and stat
+	static unsigned long long Get_Folder_Size(string Path, bool Display_Error); // Gets the size of a folder and all of its subfolders with twrpDU
 	static bool Path_Exists(string Path);                                       // Returns true if the path exists
+	static string Probe_FS_Type(string Block_Device);                           // Reads the superblock of Block_Device for ext2/3/4, f2fs, vfat, exfat, ntfs or yaffs2, empty if not recognized
 	static void GUI_Operation_Text(string Read_Value, string Default_Text);     // Updates text for display in the GUI, e.g. Backing up %partition name%
 	static void GUI_Operation_Text(string Read_Value, string Partition_Name, string Default_Text); // Same as above but includes partition name
 	static unsigned long Get_File_Size(string Path);                            // Returns the size of a file
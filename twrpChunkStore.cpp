@@ -0,0 +1,534 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "twrpChunkStore.hpp"
+#include "common.h"
+#include "twrp-functions.hpp"
+#include "mincrypt/sha.h"
+
+using namespace std;
+
+// Random values for the gear rolling hash, they decide where chunks are cut
+// so they must never change or existing chunks stop matching
+static uint64_t Gear[256];
+static pthread_once_t Gear_Once = PTHREAD_ONCE_INIT;
+
+static void Init_Gear(void) {
+	uint64_t seed = 0x5457525043484e4bULL;
+	int i;
+
+	// splitmix64
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		Gear[i] = z ^ (z >> 31);
+	}
+}
+
+// Path of To_Folder relative to From_Folder, both full paths
+static string Relative_Path(string From_Folder, string To_Folder) {
+	vector<string> From, To;
+	size_t common = 0, i;
+	string Path;
+
+	for (int pass = 0; pass < 2; pass++) {
+		string Folder = pass == 0 ? From_Folder : To_Folder;
+		vector<string>& Parts = pass == 0 ? From : To;
+		size_t start = 0, end;
+
+		while (start < Folder.size()) {
+			end = Folder.find('/', start);
+			if (end == string::npos)
+				end = Folder.size();
+			if (end > start)
+				Parts.push_back(Folder.substr(start, end - start));
+			start = end + 1;
+		}
+	}
+	while (common < From.size() && common < To.size() && From[common] == To[common])
+		common++;
+	for (i = common; i < From.size(); i++)
+		Path += "../";
+	for (i = common; i < To.size(); i++)
+		Path += To[i] + "/";
+	if (Path.empty())
+		return ".";
+	Path.resize(Path.size() - 1);
+	return Path;
+}
+
+twrpChunkStore::twrpChunkStore() {
+	pthread_once(&Gear_Once, Init_Gear);
+	compress = false;
+	chunk_buf = NULL;
+	zbuffer = NULL;
+	chunk_len = 0;
+	chunk_pos = 0;
+	chunk_index = 0;
+	gear_hash = 0;
+	archive_size = 0;
+	stored_bytes = 0;
+}
+
+twrpChunkStore::~twrpChunkStore() {
+	Close();
+}
+
+string twrpChunkStore::Index_Name(string Archive_File) {
+	return Archive_File + ".idx";
+}
+
+bool twrpChunkStore::Has_Index(string Archive_File) {
+	return access(Index_Name(Archive_File).c_str(), F_OK) == 0;
+}
+
+unsigned long long twrpChunkStore::Get_Size() {
+	return archive_size;
+}
+
+unsigned long long twrpChunkStore::Get_Stored_Bytes() {
+	return stored_bytes;
+}
+
+string twrpChunkStore::Hash_Data(const unsigned char* data, size_t len) {
+	SHA_CTX ctx;
+	const uint8_t* sha1;
+	char hex[SHA_DIGEST_SIZE * 2 + 1];
+	int i;
+
+	SHA_init(&ctx);
+	SHA_update(&ctx, data, len);
+	sha1 = SHA_final(&ctx);
+	for (i = 0; i < SHA_DIGEST_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", sha1[i]);
+	return hex;
+}
+
+string twrpChunkStore::Chunk_Path(string Hash) {
+	return Store_Folder + "/" + Hash.substr(0, 2) + "/" + Hash;
+}
+
+bool twrpChunkStore::Create_Index(string Store, string Archive_File, bool Compress) {
+	Close();
+	Store_Folder = Store;
+	Index_File = Index_Name(Archive_File);
+	compress = Compress;
+	Chunks.clear();
+	chunk_len = 0;
+	gear_hash = 0;
+	archive_size = 0;
+	stored_bytes = 0;
+	if (!TWFunc::Path_Exists(Store_Folder) && !TWFunc::Recursive_Mkdir(Store_Folder)) {
+		LOGE("Unable to create chunk store '%s'\n", Store_Folder.c_str());
+		return false;
+	}
+	chunk_buf = (unsigned char*)malloc(CHUNK_MAX_SIZE);
+	zbuffer = (unsigned char*)malloc(compressBound(CHUNK_MAX_SIZE));
+	if (chunk_buf == NULL || zbuffer == NULL) {
+		LOGE("Unable to allocate chunk buffers\n");
+		return false;
+	}
+	LOGI("Writing '%s' into chunk store '%s'\n", Index_File.c_str(), Store_Folder.c_str());
+	return true;
+}
+
+bool twrpChunkStore::Write(const char* data, size_t len) {
+	const unsigned char* ptr = (const unsigned char*)data;
+
+	archive_size += len;
+	while (len > 0) {
+		// No cut point is allowed below the minimum size, copy that part straight in
+		if (chunk_len < CHUNK_MIN_SIZE) {
+			size_t copy = CHUNK_MIN_SIZE - chunk_len;
+
+			if (copy > len)
+				copy = len;
+			memcpy(chunk_buf + chunk_len, ptr, copy);
+			chunk_len += copy;
+			ptr += copy;
+			len -= copy;
+			continue;
+		}
+		while (len > 0) {
+			unsigned char c = *ptr++;
+
+			len--;
+			chunk_buf[chunk_len++] = c;
+			gear_hash = (gear_hash << 1) + Gear[c];
+			if ((gear_hash & CHUNK_HASH_MASK) == 0 || chunk_len == CHUNK_MAX_SIZE) {
+				if (!Store_Chunk(chunk_buf, chunk_len))
+					return false;
+				chunk_len = 0;
+				gear_hash = 0;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+bool twrpChunkStore::Store_Chunk(const unsigned char* data, size_t len) {
+	Chunk chunk;
+	string Path, Temp_File;
+	const unsigned char* out = data;
+	size_t out_len = len, done = 0;
+	struct stat st;
+	int fd;
+
+	chunk.Hash = Hash_Data(data, len);
+	chunk.Length = len;
+	Chunks.push_back(chunk);
+	Path = Chunk_Path(chunk.Hash);
+	if (stat(Path.c_str(), &st) == 0 || stat((Path + ".z").c_str(), &st) == 0)
+		return true; // Already stored by this or an earlier backup
+
+	mkdir(TWFunc::Get_Path(Path).c_str(), 0755);
+	if (compress) {
+		uLongf zlen = compressBound(CHUNK_MAX_SIZE);
+
+		// Chunks that do not shrink are kept as they are
+		if (compress2(zbuffer, &zlen, data, len, Z_DEFAULT_COMPRESSION) == Z_OK && zlen < len) {
+			out = zbuffer;
+			out_len = zlen;
+			Path += ".z";
+		}
+	}
+
+	// Written under a temporary name so that a chunk is never seen half written,
+	// a unique one because parallel backup jobs can store the same chunk at once
+	Temp_File = Path + ".tmpXXXXXX";
+	fd = mkstemp(&Temp_File[0]);
+	if (fd < 0) {
+		LOGE("Unable to create chunk '%s': %s\n", Temp_File.c_str(), strerror(errno));
+		return false;
+	}
+	fchmod(fd, 0644);
+	while (done < out_len) {
+		ssize_t ret = write(fd, out + done, out_len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGE("Error writing chunk '%s': %s\n", Temp_File.c_str(), strerror(errno));
+			close(fd);
+			unlink(Temp_File.c_str());
+			return false;
+		}
+		done += ret;
+	}
+	if (close(fd) != 0 || rename(Temp_File.c_str(), Path.c_str()) != 0) {
+		int err = errno;
+
+		unlink(Temp_File.c_str());
+		// Chunks are named by their hash, so one stored by another job is the same data
+		if (stat(Path.c_str(), &st) == 0)
+			return true;
+		LOGE("Unable to store chunk '%s': %s\n", Path.c_str(), strerror(err));
+		return false;
+	}
+	stored_bytes += out_len;
+	return true;
+}
+
+bool twrpChunkStore::Close_Index() {
+	string Temp_File = Index_File + ".tmp";
+	vector<Chunk>::iterator chunk;
+	FILE* fp;
+	bool ret = true;
+
+	if (chunk_len > 0 && !Store_Chunk(chunk_buf, chunk_len))
+		ret = false;
+	chunk_len = 0;
+	if (ret) {
+		fp = fopen(Temp_File.c_str(), "w");
+		if (fp == NULL) {
+			LOGE("Unable to create index '%s': %s\n", Temp_File.c_str(), strerror(errno));
+			ret = false;
+		} else {
+			fprintf(fp, "# TWRP chunk index\n");
+			// The store is recorded relative to the index so that the storage can be mounted anywhere
+			fprintf(fp, "S\t%s\n", Relative_Path(TWFunc::Get_Path(Index_File), Store_Folder).c_str());
+			for (chunk = Chunks.begin(); chunk != Chunks.end(); chunk++)
+				fprintf(fp, "C\t%s\t%u\n", chunk->Hash.c_str(), chunk->Length);
+			if (ferror(fp))
+				ret = false;
+			if (fclose(fp) != 0)
+				ret = false;
+			if (ret && rename(Temp_File.c_str(), Index_File.c_str()) != 0)
+				ret = false;
+			if (!ret) {
+				LOGE("Unable to write index '%s'\n", Index_File.c_str());
+				unlink(Temp_File.c_str());
+			}
+		}
+	}
+	if (ret)
+		LOGI("Stored %llu bytes in %i chunks, %llu bytes of new chunk data\n", archive_size, (int)Chunks.size(), stored_bytes);
+	Close();
+	return ret;
+}
+
+bool twrpChunkStore::Load_Index(string Index_File, string* Store, vector<Chunk>* Chunks) {
+	FILE* fp;
+	char line[PATH_MAX + 16];
+
+	fp = fopen(Index_File.c_str(), "r");
+	if (fp == NULL) {
+		LOGE("Unable to open index '%s'\n", Index_File.c_str());
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len < 3 || line[1] != '\t')
+			continue;
+		if (line[0] == 'S' && Store != NULL) {
+			*Store = line + 2;
+			if ((*Store)[0] != '/')
+				*Store = TWFunc::Get_Path(Index_File) + *Store;
+		} else if (line[0] == 'C' && Chunks != NULL) {
+			Chunk chunk;
+			char hash[SHA_DIGEST_SIZE * 2 + 1];
+
+			if (sscanf(line + 2, "%40s\t%u", hash, &chunk.Length) != 2 || strlen(hash) != SHA_DIGEST_SIZE * 2 || chunk.Length > CHUNK_MAX_SIZE) {
+				LOGE("Invalid entry in index '%s'\n", Index_File.c_str());
+				fclose(fp);
+				return false;
+			}
+			chunk.Hash = hash;
+			Chunks->push_back(chunk);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+bool twrpChunkStore::Open_Index(string Archive_File) {
+	vector<Chunk>::iterator chunk;
+
+	Close();
+	Index_File = Index_Name(Archive_File);
+	Chunks.clear();
+	if (!Load_Index(Index_File, &Store_Folder, &Chunks))
+		return false;
+	chunk_buf = (unsigned char*)malloc(CHUNK_MAX_SIZE);
+	zbuffer = (unsigned char*)malloc(compressBound(CHUNK_MAX_SIZE));
+	if (chunk_buf == NULL || zbuffer == NULL) {
+		LOGE("Unable to allocate chunk buffers\n");
+		return false;
+	}
+	chunk_len = chunk_pos = chunk_index = 0;
+	archive_size = 0;
+	for (chunk = Chunks.begin(); chunk != Chunks.end(); chunk++)
+		archive_size += chunk->Length;
+	LOGI("Reading '%s', %i chunks from '%s'\n", Index_File.c_str(), (int)Chunks.size(), Store_Folder.c_str());
+	return true;
+}
+
+bool twrpChunkStore::Load_Chunk(size_t Index) {
+	string Path = Chunk_Path(Chunks[Index].Hash);
+	unsigned int Length = Chunks[Index].Length;
+	unsigned char* dest = chunk_buf;
+	size_t max_len = CHUNK_MAX_SIZE, done = 0;
+	bool compressed = false;
+	int fd;
+
+	fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		Path += ".z";
+		fd = open(Path.c_str(), O_RDONLY);
+		compressed = true;
+		dest = zbuffer;
+		max_len = compressBound(CHUNK_MAX_SIZE);
+	}
+	if (fd < 0) {
+		LOGE("Chunk '%s' is missing from the chunk store\n", Chunks[Index].Hash.c_str());
+		return false;
+	}
+	while (done < max_len) {
+		ssize_t ret = read(fd, dest + done, max_len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			LOGE("Error reading chunk '%s': %s\n", Path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	close(fd);
+
+	if (compressed) {
+		uLongf len = CHUNK_MAX_SIZE;
+
+		if (uncompress(chunk_buf, &len, zbuffer, done) != Z_OK) {
+			LOGE("Unable to decompress chunk '%s'\n", Path.c_str());
+			return false;
+		}
+		done = len;
+	}
+	if (done != Length || Hash_Data(chunk_buf, done) != Chunks[Index].Hash) {
+		LOGE("Chunk '%s' is corrupt\n", Path.c_str());
+		return false;
+	}
+	chunk_len = done;
+	chunk_pos = 0;
+	return true;
+}
+
+ssize_t twrpChunkStore::Read(char* data, size_t len) {
+	size_t total = 0;
+
+	while (total < len) {
+		size_t copy;
+
+		if (chunk_pos == chunk_len) {
+			if (chunk_index >= Chunks.size())
+				break;
+			if (!Load_Chunk(chunk_index++))
+				return -1;
+		}
+		copy = chunk_len - chunk_pos;
+		if (copy > len - total)
+			copy = len - total;
+		memcpy(data + total, chunk_buf + chunk_pos, copy);
+		chunk_pos += copy;
+		total += copy;
+	}
+	return total;
+}
+
+void twrpChunkStore::Close() {
+	free(chunk_buf);
+	free(zbuffer);
+	chunk_buf = NULL;
+	zbuffer = NULL;
+	chunk_len = chunk_pos = 0;
+}
+
+bool twrpChunkStore::Verify_Index(string Archive_File) {
+	twrpChunkStore Store;
+	set<string> Checked;
+	size_t index;
+
+	if (!Store.Open_Index(Archive_File))
+		return false;
+	for (index = 0; index < Store.Chunks.size(); index++) {
+		if (Checked.find(Store.Chunks[index].Hash) != Checked.end())
+			continue;
+		if (!Store.Load_Chunk(index))
+			return false;
+		Checked.insert(Store.Chunks[index].Hash);
+	}
+	return true;
+}
+
+void twrpChunkStore::Find_Indexes(string Folder, vector<string>& Indexes, int Depth) {
+	DIR* d;
+	struct dirent* de;
+
+	d = opendir(Folder.c_str());
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		string Name = de->d_name, Path = Folder + "/" + Name;
+		struct stat st;
+
+		if (Name == "." || Name == ".." || Name == CHUNK_STORE_FOLDER || lstat(Path.c_str(), &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode) && Depth > 0)
+			Find_Indexes(Path, Indexes, Depth - 1);
+		else if (S_ISREG(st.st_mode) && Name.size() > 4 && Name.substr(Name.size() - 4) == ".idx")
+			Indexes.push_back(Path);
+	}
+	closedir(d);
+}
+
+int twrpChunkStore::Remove_Unused_Chunks(string Store_Folder, string Backups_Folder) {
+	vector<string> Indexes;
+	vector<string>::iterator index;
+	set<string> Used;
+	DIR* d;
+	struct dirent* de;
+	int removed = 0;
+
+	// Indexes live in TWRP/BACKUPS/<device>/<backup>/
+	Find_Indexes(Backups_Folder, Indexes, 2);
+	for (index = Indexes.begin(); index != Indexes.end(); index++) {
+		vector<Chunk> Chunks;
+		vector<Chunk>::iterator chunk;
+
+		// Never guess with an index that cannot be read, nothing is removed
+		if (!Load_Index(*index, NULL, &Chunks))
+			return 0;
+		for (chunk = Chunks.begin(); chunk != Chunks.end(); chunk++)
+			Used.insert(chunk->Hash);
+	}
+
+	d = opendir(Store_Folder.c_str());
+	if (d == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		string Folder = Store_Folder + "/" + de->d_name;
+		DIR* sub;
+		struct dirent* chunk;
+
+		if (de->d_name[0] == '.' || (sub = opendir(Folder.c_str())) == NULL)
+			continue;
+		while ((chunk = readdir(sub)) != NULL) {
+			string Hash = chunk->d_name;
+
+			if (Hash[0] == '.')
+				continue;
+			if (Hash.size() > SHA_DIGEST_SIZE * 2)
+				Hash.resize(SHA_DIGEST_SIZE * 2); // .z and leftover .tmp files
+			if (Used.find(Hash) != Used.end() && strstr(chunk->d_name, ".tmp") == NULL)
+				continue;
+			if (unlink((Folder + "/" + chunk->d_name).c_str()) == 0)
+				removed++;
+		}
+		closedir(sub);
+		rmdir(Folder.c_str()); // Only succeeds once the folder is empty
+	}
+	closedir(d);
+	LOGI("Removed %i unused chunks from '%s'\n", removed, Store_Folder.c_str());
+	return removed;
+}
@@ -0,0 +1,83 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPCHUNKSTORE_HPP
+#define _TWRPCHUNKSTORE_HPP
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define CHUNK_STORE_FOLDER ".chunks"                                            // Kept next to the per device backup folders in TWRP/BACKUPS
+#define CHUNK_MIN_SIZE (256 * 1024)
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+#define CHUNK_HASH_MASK 0xFFFFF00000000000ULL                                   // 20 bits, cut points are on average 1MB apart
+
+// Deduplicated backup storage, archives are cut into content defined chunks
+// that are stored once by SHA-1 and each backup keeps only an index of them
+class twrpChunkStore {
+public:
+	twrpChunkStore();
+	virtual ~twrpChunkStore();
+
+public:
+	bool Create_Index(string Store_Folder, string Archive_File, bool Compress); // Starts a new index for Archive_File, chunks are zlib compressed if Compress
+	bool Write(const char* data, size_t len);                                 // Adds archive data, storing every chunk that is completed
+	bool Close_Index();                                                       // Stores the last chunk and writes the index file
+	bool Open_Index(string Archive_File);                                     // Opens the index of Archive_File for reading
+	ssize_t Read(char* data, size_t len);                                     // Reads archive data back from the chunks, 0 at the end
+	void Close();
+	unsigned long long Get_Size();                                            // Size of the archive data
+	unsigned long long Get_Stored_Bytes();                                    // Bytes of new chunks written during Create_Index ... Close_Index
+	static string Index_Name(string Archive_File);                            // Name of the index kept in place of Archive_File
+	static bool Has_Index(string Archive_File);
+	static bool Verify_Index(string Archive_File);                            // Checks that every chunk of an index is present and matches its hash
+	static int Remove_Unused_Chunks(string Store_Folder, string Backups_Folder); // Deletes chunks that no index under Backups_Folder uses, returns the count
+
+private:
+	struct Chunk {
+		string Hash;                                                          // SHA-1 as 40 hex digits
+		unsigned int Length;
+	};
+
+	bool Store_Chunk(const unsigned char* data, size_t len);
+	bool Load_Chunk(size_t Index);                                            // Reads and checks a chunk into chunk_buf
+	string Chunk_Path(string Hash);                                           // Store_Folder/ab/abcdef..., a compressed chunk has .z appended
+	static bool Load_Index(string Index_File, string* Store, vector<Chunk>* Chunks);
+	static string Hash_Data(const unsigned char* data, size_t len);
+	static void Find_Indexes(string Folder, vector<string>& Indexes, int Depth);
+
+private:
+	string Store_Folder;
+	string Index_File;
+	bool compress;
+	vector<Chunk> Chunks;
+	unsigned char* chunk_buf;                                                 // CHUNK_MAX_SIZE buffer for the chunk being cut or read
+	unsigned char* zbuffer;
+	size_t chunk_len;
+	size_t chunk_pos;
+	size_t chunk_index;                                                       // Next chunk to read
+	uint64_t gear_hash;
+	unsigned long long archive_size;
+	unsigned long long stored_bytes;
+};
+
+#endif // _TWRPCHUNKSTORE_HPP
@@ -0,0 +1,718 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "twrpDD.hpp"
+#include "common.h"
+#include "twrp-functions.hpp"
+
+using namespace std;
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t)
+#endif
+
+#define DD_BUFFER_SIZE (1024 * 1024)
+#define SPARSE_MAX_CHUNK (64 * 1024 * 1024)                                     // Largest raw chunk written, keeps chunk sizes well inside 32 bits
+
+// ext4 on-disk layout, all values are little endian
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC 0x0200
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_FEATURE_INCOMPAT_JOURNAL_DEV 0x0008
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+// Android sparse image format (system/core/libsparse/sparse_format.h)
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+typedef struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+} sparse_header_t;
+
+typedef struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;                                                        // In blocks
+	uint32_t total_sz;                                                        // In bytes, including this header
+} chunk_header_t;
+
+static uint32_t Le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t Le16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+// Groups 0, 1 and powers of 3, 5 and 7 hold superblock backups when sparse_super is set
+static bool Group_Has_Super(unsigned long long Group, bool Sparse_Super) {
+	unsigned long long base, n;
+
+	if (!Sparse_Super || Group <= 1)
+		return true;
+	for (base = 3; base <= 7; base += 2) {
+		for (n = base; n < Group; n *= base)
+			;
+		if (n == Group)
+			return true;
+	}
+	return false;
+}
+
+// Size of a block device, or of a regular file holding a partition image
+static bool Get_Device_Size(int fd, unsigned long long* Size) {
+	struct stat st;
+
+	if (ioctl(fd, BLKGETSIZE64, Size) == 0)
+		return true;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		*Size = st.st_size;
+		return true;
+	}
+	return false;
+}
+
+bool twrpDD::Read_Full(int fd, twrpChunkStore* Store, void* data, size_t len) {
+	char* ptr = (char*)data;
+
+	if (Store != NULL)
+		return Store->Read(ptr, len) == (ssize_t)len;
+	while (len > 0) {
+		ssize_t ret = read(fd, ptr, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		ptr += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool twrpDD::Skip_Input(int fd, twrpChunkStore* Store, size_t len) {
+	char scratch[512];
+
+	while (len > 0) {
+		size_t size = len > sizeof(scratch) ? sizeof(scratch) : len;
+
+		if (!Read_Full(fd, Store, scratch, size))
+			return false;
+		len -= size;
+	}
+	return true;
+}
+
+bool twrpDD::Write_Image(int fd, twrpChunkStore* Store, const void* data, size_t len, struct MD5Context* md5) {
+	const char* ptr = (const char*)data;
+
+	if (Store != NULL)
+		return Store->Write(ptr, len);
+	if (md5 != NULL)
+		MD5Update(md5, (const unsigned char*)data, len);
+	while (len > 0) {
+		ssize_t ret = write(fd, ptr, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGE("Error writing image: %s\n", strerror(errno));
+			return false;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool twrpDD::Is_Ext4(string Block_Device) {
+	unsigned char sb[1024];
+	int fd;
+	bool ret;
+
+	fd = open(Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	ret = (pread(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) == (ssize_t)sizeof(sb));
+	close(fd);
+	if (!ret || Le16(sb + 56) != EXT4_SUPER_MAGIC)
+		return false;
+	// Layouts that put group metadata somewhere else are backed up with a full copy
+	if (Le32(sb + 96) & (EXT4_FEATURE_INCOMPAT_JOURNAL_DEV | EXT4_FEATURE_INCOMPAT_META_BG))
+		return false;
+	if (Le32(sb + 100) & EXT4_FEATURE_RO_COMPAT_BIGALLOC)
+		return false;
+	return Le32(sb + 24) <= 6; // Block size up to 64k
+}
+
+void twrpDD::Add_Blocks(vector<Block_Run>& Runs, unsigned long long Start, unsigned long long Count) {
+	Block_Run run;
+
+	if (Count == 0)
+		return;
+	if (!Runs.empty() && Runs.back().Start + Runs.back().Count == Start) {
+		Runs.back().Count += Count;
+		return;
+	}
+	run.Start = Start;
+	run.Count = Count;
+	Runs.push_back(run);
+}
+
+bool twrpDD::Get_Used_Blocks(int fd, unsigned int* Block_Size, unsigned long long* Total_Blocks, vector<Block_Run>& Runs) {
+	unsigned char sb[1024];
+	unsigned long long blocks_count, device_size, device_blocks, groups, group, gdt_blocks, itable_blocks;
+	unsigned int bs, first_data_block, blocks_per_group, inodes_per_group, inode_size, desc_size, reserved_gdt;
+	uint32_t incompat, ro_compat;
+	bool is_64bit, sparse_super, csum;
+	vector<unsigned char> gdt, bitmap;
+	vector<Block_Run> found;
+	vector<Block_Run>::iterator iter;
+
+	if (pread(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) != (ssize_t)sizeof(sb) || Le16(sb + 56) != EXT4_SUPER_MAGIC) {
+		LOGE("Unable to read ext4 superblock\n");
+		return false;
+	}
+	if (!Get_Device_Size(fd, &device_size)) {
+		LOGE("Unable to get the size of the block device\n");
+		return false;
+	}
+
+	bs = 1024 << Le32(sb + 24);
+	first_data_block = Le32(sb + 20);
+	blocks_per_group = Le32(sb + 32);
+	inodes_per_group = Le32(sb + 40);
+	inode_size = Le32(sb + 76) == 0 ? 128 : Le16(sb + 88);
+	incompat = Le32(sb + 96);
+	ro_compat = Le32(sb + 100);
+	reserved_gdt = Le16(sb + 206);
+	is_64bit = (incompat & EXT4_FEATURE_INCOMPAT_64BIT) != 0;
+	desc_size = is_64bit ? Le16(sb + 254) : 32;
+	if (desc_size < 32)
+		desc_size = 32;
+	sparse_super = (ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER) != 0;
+	// Uninitialized block groups are only valid with group descriptor checksums
+	csum = (ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+	blocks_count = Le32(sb + 4);
+	if (is_64bit)
+		blocks_count |= (unsigned long long)Le32(sb + 336) << 32;
+
+	if (blocks_per_group == 0 || blocks_per_group > bs * 8 || blocks_count <= first_data_block) {
+		LOGE("Invalid ext4 superblock\n");
+		return false;
+	}
+	if (device_size % bs != 0 || blocks_count > device_size / bs) {
+		LOGE("ext4 file system does not match the block device size\n");
+		return false;
+	}
+	device_blocks = device_size / bs;
+
+	groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	gdt_blocks = (groups * desc_size + bs - 1) / bs;
+	itable_blocks = ((unsigned long long)inodes_per_group * inode_size + bs - 1) / bs;
+	gdt.resize(gdt_blocks * bs);
+	bitmap.resize(bs);
+	if (pread64(fd, &gdt[0], gdt.size(), (off64_t)(first_data_block + 1) * bs) != (ssize_t)gdt.size()) {
+		LOGE("Unable to read ext4 group descriptors\n");
+		return false;
+	}
+
+	// The boot block and primary superblock are always kept
+	Add_Blocks(found, 0, first_data_block + 1);
+	for (group = 0; group < groups; group++) {
+		unsigned char* desc = &gdt[group * desc_size];
+		unsigned long long block_bitmap, inode_bitmap, inode_table, group_start, group_blocks, bit;
+		unsigned long long run_start = 0;
+		bool in_run = false;
+
+		block_bitmap = Le32(desc);
+		inode_bitmap = Le32(desc + 4);
+		inode_table = Le32(desc + 8);
+		if (is_64bit && desc_size >= 64) {
+			block_bitmap |= (unsigned long long)Le32(desc + 0x20) << 32;
+			inode_bitmap |= (unsigned long long)Le32(desc + 0x24) << 32;
+			inode_table |= (unsigned long long)Le32(desc + 0x28) << 32;
+		}
+		group_start = first_data_block + group * blocks_per_group;
+		group_blocks = blocks_count - group_start;
+		if (group_blocks > blocks_per_group)
+			group_blocks = blocks_per_group;
+
+		// Group metadata is kept even when the bitmap says otherwise (e.g. flex_bg groups)
+		Add_Blocks(found, block_bitmap, 1);
+		Add_Blocks(found, inode_bitmap, 1);
+		Add_Blocks(found, inode_table, itable_blocks);
+		if (Group_Has_Super(group, sparse_super))
+			Add_Blocks(found, group_start, 1 + gdt_blocks + reserved_gdt);
+
+		// The bitmap of an uninitialized group is not written, nothing else in it is in use
+		if (csum && (Le16(desc + 18) & EXT4_BG_BLOCK_UNINIT))
+			continue;
+		if (block_bitmap >= blocks_count || pread64(fd, &bitmap[0], bs, (off64_t)block_bitmap * bs) != (ssize_t)bs) {
+			LOGE("Unable to read block bitmap for group %llu\n", group);
+			return false;
+		}
+		for (bit = 0; bit < group_blocks; bit++) {
+			bool used = (bitmap[bit >> 3] >> (bit & 7)) & 1;
+
+			if (used && !in_run) {
+				run_start = bit;
+				in_run = true;
+			} else if (!used && in_run) {
+				Add_Blocks(found, group_start + run_start, bit - run_start);
+				in_run = false;
+			}
+		}
+		if (in_run)
+			Add_Blocks(found, group_start + run_start, group_blocks - run_start);
+	}
+	// Anything past the end of the file system (e.g. an encryption footer) is kept as is
+	Add_Blocks(found, blocks_count, device_blocks - blocks_count);
+
+	// Metadata runs were added out of order, sort and merge them
+	sort(found.begin(), found.end());
+	Runs.clear();
+	for (iter = found.begin(); iter != found.end(); iter++) {
+		unsigned long long end = iter->Start + iter->Count;
+
+		if (end > device_blocks)
+			end = device_blocks;
+		if (iter->Start >= end)
+			continue;
+		if (!Runs.empty() && iter->Start <= Runs.back().Start + Runs.back().Count) {
+			if (end > Runs.back().Start + Runs.back().Count)
+				Runs.back().Count = end - Runs.back().Start;
+		} else {
+			Block_Run run;
+
+			run.Start = iter->Start;
+			run.Count = end - iter->Start;
+			Runs.push_back(run);
+		}
+	}
+	*Block_Size = bs;
+	*Total_Blocks = device_blocks;
+	return true;
+}
+
+bool twrpDD::Backup_Sparse(string Block_Device, string Image_File, bool Generate_MD5, unsigned long long* Bytes_Read, twrpChunkStore* Store) {
+	int in_fd, out_fd;
+	unsigned int bs;
+	unsigned long long total_blocks, used_blocks = 0, block = 0, max_chunk_blocks;
+	vector<Block_Run> Runs;
+	vector<Block_Run>::iterator run;
+	sparse_header_t header;
+	chunk_header_t chunk;
+	struct MD5Context md5;
+	char* buffer;
+	bool ret = true;
+
+	*Bytes_Read = 0;
+	in_fd = open(Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (in_fd < 0) {
+		LOGE("Unable to open '%s': %s\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	if (!Get_Used_Blocks(in_fd, &bs, &total_blocks, Runs)) {
+		close(in_fd);
+		return false;
+	}
+	if (total_blocks > 0xFFFFFFFFULL) {
+		LOGE("'%s' is too large for a sparse image\n", Block_Device.c_str());
+		close(in_fd);
+		return false;
+	}
+	max_chunk_blocks = SPARSE_MAX_CHUNK / bs;
+
+	// The chunk count goes in the header, so count them before writing anything
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = bs;
+	header.total_blks = total_blocks;
+	for (run = Runs.begin(); run != Runs.end(); run++) {
+		if (run->Start > block)
+			header.total_chunks++;
+		header.total_chunks += (run->Count + max_chunk_blocks - 1) / max_chunk_blocks;
+		used_blocks += run->Count;
+		block = run->Start + run->Count;
+	}
+	if (block < total_blocks)
+		header.total_chunks++;
+	LOGI("Sparse backup of '%s': %llu of %llu blocks in use\n", Block_Device.c_str(), used_blocks, total_blocks);
+
+	buffer = (char*)memalign(4096, DD_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGE("Unable to allocate image buffer\n");
+		close(in_fd);
+		return false;
+	}
+	out_fd = -1;
+	if (Store == NULL)
+		out_fd = open(Image_File.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (Store == NULL && out_fd < 0) {
+		LOGE("Unable to open '%s' for writing: %s\n", Image_File.c_str(), strerror(errno));
+		free(buffer);
+		close(in_fd);
+		return false;
+	}
+	MD5Init(&md5);
+	ret = Write_Image(out_fd, Store, &header, sizeof(header), &md5);
+
+	block = 0;
+	for (run = Runs.begin(); ret && run != Runs.end(); run++) {
+		unsigned long long done = 0;
+
+		if (run->Start > block) {
+			memset(&chunk, 0, sizeof(chunk));
+			chunk.chunk_type = CHUNK_TYPE_DONT_CARE;
+			chunk.chunk_sz = run->Start - block;
+			chunk.total_sz = sizeof(chunk);
+			ret = Write_Image(out_fd, Store, &chunk, sizeof(chunk), &md5);
+		}
+		while (ret && done < run->Count) {
+			unsigned long long count = run->Count - done, remaining;
+			off64_t offset = (off64_t)(run->Start + done) * bs;
+
+			if (count > max_chunk_blocks)
+				count = max_chunk_blocks;
+			memset(&chunk, 0, sizeof(chunk));
+			chunk.chunk_type = CHUNK_TYPE_RAW;
+			chunk.chunk_sz = count;
+			chunk.total_sz = sizeof(chunk) + count * bs;
+			ret = Write_Image(out_fd, Store, &chunk, sizeof(chunk), &md5);
+			remaining = count * bs;
+			while (ret && remaining > 0) {
+				size_t len = remaining > DD_BUFFER_SIZE ? DD_BUFFER_SIZE : (size_t)remaining;
+
+				if (pread64(in_fd, buffer, len, offset) != (ssize_t)len) {
+					LOGE("Error reading '%s': %s\n", Block_Device.c_str(), strerror(errno));
+					ret = false;
+					break;
+				}
+				ret = Write_Image(out_fd, Store, buffer, len, &md5);
+				offset += len;
+				remaining -= len;
+				*Bytes_Read += len;
+			}
+			done += count;
+		}
+		block = run->Start + run->Count;
+	}
+	if (ret && block < total_blocks) {
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.chunk_type = CHUNK_TYPE_DONT_CARE;
+		chunk.chunk_sz = total_blocks - block;
+		chunk.total_sz = sizeof(chunk);
+		ret = Write_Image(out_fd, Store, &chunk, sizeof(chunk), &md5);
+	}
+
+	free(buffer);
+	close(in_fd);
+	if (Store != NULL)
+		return ret; // Chunks carry their own hashes
+	if (close(out_fd) != 0) {
+		LOGE("Error closing '%s': %s\n", Image_File.c_str(), strerror(errno));
+		ret = false;
+	}
+	if (ret && Generate_MD5) {
+		unsigned char digest[16];
+
+		MD5Final(digest, &md5);
+		ret = TWFunc::Write_MD5(Image_File, digest);
+	}
+	return ret;
+}
+
+bool twrpDD::Is_Sparse_Image(string Image_File) {
+	uint32_t magic = 0;
+	int fd;
+	bool ret;
+
+	fd = open(Image_File.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	ret = Read_Full(fd, NULL, &magic, sizeof(magic));
+	close(fd);
+	return ret && magic == SPARSE_HEADER_MAGIC;
+}
+
+bool twrpDD::Discard(int fd, unsigned long long Size) {
+	uint64_t range[2];
+
+	range[0] = 0;
+	range[1] = Size;
+	if (ioctl(fd, BLKDISCARD, &range) != 0) {
+		LOGI("Discard is not supported on this device: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool twrpDD::Backup_Raw(string Block_Device, twrpChunkStore* Store, unsigned long long* Bytes_Read) {
+	int in_fd;
+	char* buffer;
+	bool ret = true;
+
+	*Bytes_Read = 0;
+	in_fd = open(Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (in_fd < 0) {
+		LOGE("Unable to open '%s': %s\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	buffer = (char*)memalign(4096, DD_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGE("Unable to allocate image buffer\n");
+		close(in_fd);
+		return false;
+	}
+	while (ret) {
+		ssize_t len = read(in_fd, buffer, DD_BUFFER_SIZE);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			LOGE("Error reading '%s': %s\n", Block_Device.c_str(), strerror(errno));
+			ret = false;
+		} else if (len == 0) {
+			break;
+		} else {
+			ret = Store->Write(buffer, len);
+			*Bytes_Read += len;
+		}
+	}
+	free(buffer);
+	close(in_fd);
+	return ret;
+}
+
+bool twrpDD::Restore_Sparse(string Image_File, string Block_Device, unsigned long long* Bytes_Skipped) {
+	int in_fd;
+	bool ret;
+
+	in_fd = open(Image_File.c_str(), O_RDONLY | O_LARGEFILE);
+	if (in_fd < 0) {
+		LOGE("Unable to open '%s': %s\n", Image_File.c_str(), strerror(errno));
+		return false;
+	}
+	ret = Restore_Image(in_fd, NULL, Image_File, Block_Device, Bytes_Skipped);
+	close(in_fd);
+	return ret;
+}
+
+bool twrpDD::Restore_Chunks(string Archive_File, string Block_Device, unsigned long long* Bytes_Skipped) {
+	twrpChunkStore Store;
+
+	if (!Store.Open_Index(Archive_File))
+		return false;
+	return Restore_Image(-1, &Store, Archive_File, Block_Device, Bytes_Skipped);
+}
+
+bool twrpDD::Restore_Image(int in_fd, twrpChunkStore* Store, string Image_File, string Block_Device, unsigned long long* Bytes_Skipped) {
+	int out_fd;
+	unsigned long long device_size, block = 0;
+	sparse_header_t header;
+	chunk_header_t chunk;
+	unsigned int index;
+	char* buffer;
+	bool ret = true;
+
+	*Bytes_Skipped = 0;
+	if (!Read_Full(in_fd, Store, &header, sizeof(header))) {
+		LOGE("'%s' is truncated\n", Image_File.c_str());
+		return false;
+	}
+	out_fd = open(Block_Device.c_str(), O_WRONLY | O_LARGEFILE);
+	if (out_fd < 0) {
+		LOGE("Unable to open '%s': %s\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	buffer = (char*)memalign(4096, DD_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGE("Unable to allocate image buffer\n");
+		close(out_fd);
+		return false;
+	}
+
+	// A full image from the chunk store is copied as it is
+	if (header.magic != SPARSE_HEADER_MAGIC && Store != NULL) {
+		ssize_t len;
+
+		memcpy(buffer, &header, sizeof(header));
+		len = Store->Read(buffer + sizeof(header), DD_BUFFER_SIZE - sizeof(header));
+		if (len >= 0)
+			len += sizeof(header);
+		while (len > 0) {
+			if (!Write_Image(out_fd, NULL, buffer, len, NULL)) {
+				ret = false;
+				break;
+			}
+			len = Store->Read(buffer, DD_BUFFER_SIZE);
+		}
+		if (len < 0)
+			ret = false;
+		free(buffer);
+		if (fsync(out_fd) != 0) {
+			LOGE("Error syncing '%s': %s\n", Block_Device.c_str(), strerror(errno));
+			ret = false;
+		}
+		close(out_fd);
+		return ret;
+	}
+
+	if (header.magic != SPARSE_HEADER_MAGIC || header.major_version != 1 || header.file_hdr_sz < sizeof(header)
+		|| header.chunk_hdr_sz < sizeof(chunk) || header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+		LOGE("'%s' is not a valid sparse image\n", Image_File.c_str());
+		free(buffer);
+		close(out_fd);
+		return false;
+	}
+	if (!Get_Device_Size(out_fd, &device_size) || device_size < (unsigned long long)header.total_blks * header.blk_sz) {
+		LOGE("'%s' is too small for '%s'\n", Block_Device.c_str(), Image_File.c_str());
+		free(buffer);
+		close(out_fd);
+		return false;
+	}
+	if (!Skip_Input(in_fd, Store, header.file_hdr_sz - sizeof(header))) {
+		LOGE("'%s' is truncated\n", Image_File.c_str());
+		free(buffer);
+		close(out_fd);
+		return false;
+	}
+
+	// Blocks that are not in the image are left discarded instead of being written
+	Discard(out_fd, device_size);
+
+	for (index = 0; ret && index < header.total_chunks; index++) {
+		unsigned long long len;
+		off64_t offset = (off64_t)block * header.blk_sz;
+
+		if (!Read_Full(in_fd, Store, &chunk, sizeof(chunk)) || !Skip_Input(in_fd, Store, header.chunk_hdr_sz - sizeof(chunk))) {
+			LOGE("'%s' is truncated\n", Image_File.c_str());
+			ret = false;
+			break;
+		}
+		len = (unsigned long long)chunk.chunk_sz * header.blk_sz;
+		if (block + chunk.chunk_sz > header.total_blks) {
+			LOGE("Invalid chunk in '%s'\n", Image_File.c_str());
+			ret = false;
+			break;
+		}
+
+		switch (chunk.chunk_type) {
+			case CHUNK_TYPE_RAW:
+				while (len > 0) {
+					size_t size = len > DD_BUFFER_SIZE ? DD_BUFFER_SIZE : (size_t)len;
+
+					if (!Read_Full(in_fd, Store, buffer, size)) {
+						LOGE("'%s' is truncated\n", Image_File.c_str());
+						ret = false;
+						break;
+					}
+					if (pwrite64(out_fd, buffer, size, offset) != (ssize_t)size) {
+						LOGE("Error writing '%s': %s\n", Block_Device.c_str(), strerror(errno));
+						ret = false;
+						break;
+					}
+					offset += size;
+					len -= size;
+				}
+				break;
+			case CHUNK_TYPE_FILL: {
+				uint32_t fill, *ptr = (uint32_t*)buffer;
+				size_t i;
+
+				if (!Read_Full(in_fd, Store, &fill, sizeof(fill))) {
+					ret = false;
+					break;
+				}
+				for (i = 0; i < DD_BUFFER_SIZE / sizeof(fill); i++)
+					ptr[i] = fill;
+				while (len > 0) {
+					size_t size = len > DD_BUFFER_SIZE ? DD_BUFFER_SIZE : (size_t)len;
+
+					if (pwrite64(out_fd, buffer, size, offset) != (ssize_t)size) {
+						LOGE("Error writing '%s': %s\n", Block_Device.c_str(), strerror(errno));
+						ret = false;
+						break;
+					}
+					offset += size;
+					len -= size;
+				}
+				break;
+			}
+			case CHUNK_TYPE_DONT_CARE:
+				*Bytes_Skipped += len;
+				break;
+			case CHUNK_TYPE_CRC32:
+				ret = Skip_Input(in_fd, Store, 4);
+				break;
+			default:
+				LOGE("Unknown chunk type 0x%x in '%s'\n", chunk.chunk_type, Image_File.c_str());
+				ret = false;
+				break;
+		}
+		block += chunk.chunk_sz;
+	}
+
+	free(buffer);
+	if (fsync(out_fd) != 0) {
+		LOGE("Error syncing '%s': %s\n", Block_Device.c_str(), strerror(errno));
+		ret = false;
+	}
+	close(out_fd);
+	LOGI("Restored '%s', skipped %llu unused bytes\n", Image_File.c_str(), *Bytes_Skipped);
+	return ret;
+}
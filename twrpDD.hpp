@@ -0,0 +1,57 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPDD_HPP
+#define _TWRPDD_HPP
+
+#include <string>
+#include <vector>
+#include "digest/md5.h"
+#include "twrpChunkStore.hpp"
+
+using namespace std;
+
+// Image backup and restore of block devices
+class twrpDD {
+public:
+	static bool Is_Ext4(string Block_Device);                                 // Checks for an ext2/3/4 superblock that Backup_Sparse can handle
+	static bool Backup_Sparse(string Block_Device, string Image_File, bool Generate_MD5, unsigned long long* Bytes_Read, twrpChunkStore* Store); // Saves only the allocated ext4 blocks as an Android sparse image, into Store instead of Image_File if not NULL
+	static bool Backup_Raw(string Block_Device, twrpChunkStore* Store, unsigned long long* Bytes_Read); // Copies the whole device into Store
+	static bool Is_Sparse_Image(string Image_File);                           // Checks for the Android sparse image magic
+	static bool Restore_Sparse(string Image_File, string Block_Device, unsigned long long* Bytes_Skipped); // Discards the device and writes only the blocks stored in the sparse image
+	static bool Restore_Chunks(string Archive_File, string Block_Device, unsigned long long* Bytes_Skipped); // Restores a sparse or full image kept in the chunk store
+
+private:
+	struct Block_Run {
+		unsigned long long Start;                                             // First block
+		unsigned long long Count;                                             // Number of blocks
+		bool operator<(const Block_Run& other) const {
+			return Start < other.Start;
+		}
+	};
+
+	static bool Get_Used_Blocks(int fd, unsigned int* Block_Size, unsigned long long* Total_Blocks, vector<Block_Run>& Runs); // Reads the ext4 block bitmaps into a list of allocated runs
+	static void Add_Blocks(vector<Block_Run>& Runs, unsigned long long Start, unsigned long long Count);
+	static bool Restore_Image(int in_fd, twrpChunkStore* Store, string Image_File, string Block_Device, unsigned long long* Bytes_Skipped); // Reads from Store if not NULL, otherwise in_fd
+	static bool Write_Image(int fd, twrpChunkStore* Store, const void* data, size_t len, struct MD5Context* md5); // Writes all of data to Store or fd and updates the MD5
+	static bool Read_Full(int fd, twrpChunkStore* Store, void* data, size_t len);
+	static bool Skip_Input(int fd, twrpChunkStore* Store, size_t len);
+	static bool Discard(int fd, unsigned long long Size);                     // Discards the whole block device
+};
+
+#endif // _TWRPDD_HPP
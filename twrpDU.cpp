@@ -0,0 +1,498 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+#include "twrpDU.hpp"
+#include "common.h"
+
+using namespace std;
+
+twrpDU::twrpDU() {
+	memset(&Results, 0, sizeof(Results));
+	Queues = NULL;
+	Worker_Updates = NULL;
+	Walk_Start = 0;
+	Thread_Count = 0;
+	Worker_Start = 0;
+	Pending = 0;
+	Waiting = 0;
+	Failed = false;
+	Show_Errors = false;
+	pthread_mutex_init(&Lock, NULL);
+	pthread_cond_init(&Work_Ready, NULL);
+}
+
+twrpDU::~twrpDU() {
+	pthread_cond_destroy(&Work_Ready);
+	pthread_mutex_destroy(&Lock);
+}
+
+string twrpDU::Clean_Path(string Path) {
+	while (Path.size() > 1 && Path[Path.size() - 1] == '/')
+		Path.resize(Path.size() - 1);
+	return Path;
+}
+
+bool twrpDU::Add_Root(string Path) {
+	Path = Clean_Path(Path);
+	if (Root_Index.find(Path) != Root_Index.end())
+		return true;
+	if (Roots.size() >= DU_MAX_ROOTS) {
+		LOGE("Too many folders to size, unable to add '%s'\n", Path.c_str());
+		return false;
+	}
+	Root_Index[Path] = Roots.size();
+	Roots.push_back(Path);
+	return true;
+}
+
+void twrpDU::Add_Exclusion(string Path) {
+	Exclusions.insert(Clean_Path(Path));
+}
+
+int twrpDU::Find_Root(string Path) {
+	map<string, int>::iterator it = Root_Index.find(Path);
+
+	if (it == Root_Index.end())
+		return -1;
+	return it->second;
+}
+
+bool twrpDU::Walk(bool Display_Error) {
+	vector<pthread_t> Threads;
+	size_t i, j, Updated = 0;
+	long cpus;
+
+	memset(&Results, 0, sizeof(Results));
+	Failed = false;
+	Show_Errors = Display_Error;
+	Waiting = 0;
+	Pending = 0;
+	Walk_Start = time(NULL);
+	if (!Cache_File.empty())
+		Load_Cache();
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	Thread_Count = cpus > DU_MAX_THREADS ? DU_MAX_THREADS : (cpus < 1 ? 1 : (int)cpus);
+	Queues = new Walk_Queue[Thread_Count];
+	Worker_Updates = new Cache_Updates[Thread_Count];
+	for (i = 0; i < (size_t)Thread_Count; i++)
+		pthread_mutex_init(&Queues[i].Lock, NULL);
+
+	// Only roots that are not inside another root are queued, the others get
+	// their bit when the walk reaches them
+	for (i = 0; i < Roots.size(); i++) {
+		bool Nested = false;
+
+		for (j = 0; j < Roots.size() && !Nested; j++) {
+			const string& Parent = Roots[j];
+
+			if (i == j || Parent.size() >= Roots[i].size())
+				continue;
+			if (Roots[i].compare(0, Parent.size(), Parent) == 0 && (Parent == "/" || Roots[i][Parent.size()] == '/'))
+				Nested = true;
+		}
+		if (Nested || Exclusions.find(Roots[i]) != Exclusions.end())
+			continue;
+
+		Walk_Item Item;
+		Item.Path = Roots[i];
+		Item.Roots = 1U << i;
+		Pending++;
+		Queues[i % Thread_Count].Items.push_back(Item);
+	}
+
+	// The calling thread is worker 0
+	Worker_Start = 1;
+	for (i = 1; i < (size_t)Thread_Count; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, Walk_Thread, this) != 0)
+			break;
+		Threads.push_back(thread);
+	}
+	Run_Worker(0);
+	for (i = 0; i < Threads.size(); i++)
+		pthread_join(Threads[i], NULL);
+
+	for (i = 0; i < (size_t)Thread_Count; i++) {
+		pthread_mutex_destroy(&Queues[i].Lock);
+		for (j = 0; j < Worker_Updates[i].size(); j++)
+			Cache[Worker_Updates[i][j].first] = Worker_Updates[i][j].second;
+		Updated += Worker_Updates[i].size();
+	}
+	delete [] Queues;
+	Queues = NULL;
+	delete [] Worker_Updates;
+	Worker_Updates = NULL;
+	if (Updated > 0)
+		Save_Cache();
+	return !Failed;
+}
+
+void twrpDU::Set_Cache(string File) {
+	Cache_File = File;
+}
+
+void twrpDU::Drop_Cache() {
+	// A file rewritten in place changes neither time of its folder, so
+	// nothing cached from before can be trusted any more
+	if (unlink(DU_CACHE_FILE) != 0 && errno != ENOENT)
+		LOGI("Unable to remove '%s': %s\n", DU_CACHE_FILE, strerror(errno));
+}
+
+bool twrpDU::Load_Cache() {
+	unsigned int header[2];
+	FILE* fp;
+
+	Cache.clear();
+	fp = fopen(Cache_File.c_str(), "rb");
+	if (fp == NULL)
+		return false;
+	if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != DU_CACHE_MAGIC) {
+		fclose(fp);
+		return false;
+	}
+	while (Cache.size() < header[1]) {
+		unsigned long long Record[6];
+		unsigned int Count, j;
+		unsigned short Len;
+		char Name[256];
+		Cache_Entry Entry;
+
+		if (fread(Record, sizeof(Record), 1, fp) != 1 || fread(&Count, sizeof(Count), 1, fp) != 1)
+			break;
+		Entry.Mtime = (long long)Record[2];
+		Entry.Ctime = (long long)Record[3];
+		Entry.Size = Record[4];
+		Entry.Files = Record[5];
+		for (j = 0; j < Count; j++) {
+			if (fread(&Len, sizeof(Len), 1, fp) != 1 || Len >= sizeof(Name) || fread(Name, Len, 1, fp) != 1)
+				break;
+			Entry.Folders.push_back(string(Name, Len));
+		}
+		if (j < Count)
+			break;
+		Cache[Cache_Key(Record[0], Record[1])] = Entry;
+	}
+	fclose(fp);
+	if (Cache.size() < header[1]) {
+		// A damaged cache only means a full walk
+		LOGI("Ignoring damaged size cache '%s'\n", Cache_File.c_str());
+		Cache.clear();
+		return false;
+	}
+	return true;
+}
+
+bool twrpDU::Save_Cache() {
+	string Temp_File = Cache_File + ".XXXXXX";
+	map<Cache_Key, Cache_Entry>::iterator it;
+	vector<char> Temp_Name(Temp_File.begin(), Temp_File.end());
+	unsigned int header[2];
+	bool ok;
+	FILE* fp;
+	int fd;
+
+	Temp_Name.push_back('\0');
+	fd = mkstemp(&Temp_Name[0]);
+	if (fd < 0)
+		return false;
+	Temp_File = &Temp_Name[0];
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(Temp_File.c_str());
+		return false;
+	}
+	header[0] = DU_CACHE_MAGIC;
+	header[1] = Cache.size();
+	ok = fwrite(header, sizeof(header), 1, fp) == 1;
+	for (it = Cache.begin(); ok && it != Cache.end(); it++) {
+		unsigned long long Record[6];
+		unsigned int Count = it->second.Folders.size(), j;
+
+		Record[0] = it->first.first;
+		Record[1] = it->first.second;
+		Record[2] = (unsigned long long)it->second.Mtime;
+		Record[3] = (unsigned long long)it->second.Ctime;
+		Record[4] = it->second.Size;
+		Record[5] = it->second.Files;
+		ok = fwrite(Record, sizeof(Record), 1, fp) == 1 && fwrite(&Count, sizeof(Count), 1, fp) == 1;
+		for (j = 0; ok && j < Count; j++) {
+			unsigned short Len = it->second.Folders[j].size();
+
+			ok = fwrite(&Len, sizeof(Len), 1, fp) == 1 && fwrite(it->second.Folders[j].data(), Len, 1, fp) == 1;
+		}
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+	// Renamed into place so that a walk running at the same time never
+	// reads half a cache
+	if (!ok || rename(Temp_File.c_str(), Cache_File.c_str()) != 0) {
+		unlink(Temp_File.c_str());
+		return false;
+	}
+	return true;
+}
+
+void* twrpDU::Walk_Thread(void* cookie) {
+	twrpDU* du = (twrpDU*)cookie;
+
+	du->Run_Worker(__sync_fetch_and_add(&du->Worker_Start, 1));
+	return NULL;
+}
+
+void twrpDU::Run_Worker(int Index) {
+	Totals Sums;
+	Walk_Item Item;
+	int i;
+
+	memset(&Sums, 0, sizeof(Sums));
+	while (Wait_For_Work(Index, &Item)) {
+		Read_Folder(Index, Item, &Sums, &Worker_Updates[Index]);
+		// Subfolders were queued before this, so 0 means the walk is over
+		if (__sync_sub_and_fetch(&Pending, 1) == 0) {
+			pthread_mutex_lock(&Lock);
+			pthread_cond_broadcast(&Work_Ready);
+			pthread_mutex_unlock(&Lock);
+		}
+	}
+
+	pthread_mutex_lock(&Lock);
+	for (i = 0; i < DU_MAX_ROOTS; i++) {
+		Results.Size[i] += Sums.Size[i];
+		Results.Files[i] += Sums.Files[i];
+		Results.Folders[i] += Sums.Folders[i];
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+void twrpDU::Push(int Index, const Walk_Item& Item) {
+	__sync_fetch_and_add(&Pending, 1);
+	pthread_mutex_lock(&Queues[Index].Lock);
+	Queues[Index].Items.push_back(Item);
+	pthread_mutex_unlock(&Queues[Index].Lock);
+	// A worker that is about to wait re-checks the queues after raising
+	// Waiting, so it either sees this item or gets the signal
+	if (__sync_fetch_and_add(&Waiting, 0) > 0) {
+		pthread_mutex_lock(&Lock);
+		pthread_cond_signal(&Work_Ready);
+		pthread_mutex_unlock(&Lock);
+	}
+}
+
+bool twrpDU::Pop(int Index, Walk_Item* Item) {
+	int i;
+
+	// Our own newest folder first, it is likely still in the dentry cache
+	pthread_mutex_lock(&Queues[Index].Lock);
+	if (!Queues[Index].Items.empty()) {
+		*Item = Queues[Index].Items.back();
+		Queues[Index].Items.pop_back();
+		pthread_mutex_unlock(&Queues[Index].Lock);
+		return true;
+	}
+	pthread_mutex_unlock(&Queues[Index].Lock);
+
+	// Otherwise steal the oldest folder of another worker, which tends to
+	// be the biggest piece of work it has
+	for (i = 1; i < Thread_Count; i++) {
+		Walk_Queue* Queue = &Queues[(Index + i) % Thread_Count];
+
+		pthread_mutex_lock(&Queue->Lock);
+		if (!Queue->Items.empty()) {
+			*Item = Queue->Items.front();
+			Queue->Items.pop_front();
+			pthread_mutex_unlock(&Queue->Lock);
+			return true;
+		}
+		pthread_mutex_unlock(&Queue->Lock);
+	}
+	return false;
+}
+
+bool twrpDU::Wait_For_Work(int Index, Walk_Item* Item) {
+	bool ret;
+
+	if (Pop(Index, Item))
+		return true;
+
+	pthread_mutex_lock(&Lock);
+	__sync_fetch_and_add(&Waiting, 1);
+	for (;;) {
+		if (Pop(Index, Item)) {
+			ret = true;
+			break;
+		}
+		if (__sync_fetch_and_add(&Pending, 0) == 0) {
+			ret = false;
+			break;
+		}
+		pthread_cond_wait(&Work_Ready, &Lock);
+	}
+	__sync_fetch_and_sub(&Waiting, 1);
+	pthread_mutex_unlock(&Lock);
+	return ret;
+}
+
+void twrpDU::Read_Folder(int Index, const Walk_Item& Item, Totals* Sums, Cache_Updates* Updates) {
+	unsigned long long Size = 0, Files = 0, Folders = 0;
+	const vector<string>* Names;
+	map<Cache_Key, Cache_Entry>::const_iterator Cached;
+	Cache_Entry Entry;
+	struct dirent* de;
+	struct stat st, folder_st;
+	string Prefix;
+	DIR* d = NULL;
+	bool ok;
+	size_t n;
+	int fd = -1, i;
+
+	// An unchanged folder is not read at all, a stat is all it costs
+	ok = stat(Item.Path.c_str(), &folder_st) == 0;
+	Cached = ok ? Cache.find(Cache_Key(folder_st.st_dev, folder_st.st_ino)) : Cache.end();
+	if (Cached != Cache.end() && (Cached->second.Mtime != folder_st.st_mtime || Cached->second.Ctime != folder_st.st_ctime))
+		Cached = Cache.end();
+	if (ok && Cached == Cache.end()) {
+		fd = open(Item.Path.c_str(), O_RDONLY | O_DIRECTORY);
+		ok = fd >= 0 && (d = fdopendir(fd)) != NULL;
+	}
+	if (!ok) {
+		bool Is_Root = Find_Root(Item.Path) >= 0;
+
+		// A missing root is always reported, like Get_Folder_Size always did
+		if (Is_Root || Show_Errors)
+			LOGE("error opening '%s'\n", Item.Path.c_str());
+		if (fd >= 0)
+			close(fd);
+		if (Is_Root) {
+			pthread_mutex_lock(&Lock);
+			Failed = true;
+			pthread_mutex_unlock(&Lock);
+		}
+		return;
+	}
+
+	if (Cached != Cache.end()) {
+		// Nothing was added, removed or renamed here since the last walk
+		Size = Cached->second.Size;
+		Files = Cached->second.Files;
+		Names = &Cached->second.Folders;
+	} else {
+		Entry.Mtime = folder_st.st_mtime;
+		Entry.Ctime = folder_st.st_ctime;
+		while ((de = readdir(d)) != NULL) {
+			unsigned char type = de->d_type;
+			bool have_stat = false;
+
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (type == DT_UNKNOWN) {
+				// Some file systems don't fill in d_type
+				if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					continue;
+				have_stat = true;
+				if (S_ISDIR(st.st_mode))
+					type = DT_DIR;
+				else if (S_ISREG(st.st_mode))
+					type = DT_REG;
+			}
+
+			if (type == DT_DIR) {
+				Entry.Folders.push_back(de->d_name);
+				continue;
+			}
+
+			Files++;
+			if (type == DT_REG) {
+				if (!have_stat && fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					continue;
+				Size += (unsigned long long)st.st_size;
+			}
+		}
+		closedir(d);
+		Names = &Entry.Folders;
+	}
+
+	Prefix = Item.Path == "/" ? Item.Path : Item.Path + "/";
+	for (n = 0; n < Names->size(); n++) {
+		Walk_Item Child;
+
+		Child.Path = Prefix + (*Names)[n];
+		if (!Exclusions.empty() && Exclusions.find(Child.Path) != Exclusions.end())
+			continue;
+		Child.Roots = Item.Roots;
+		if (Roots.size() > 1) {
+			int Root = Find_Root(Child.Path);
+
+			if (Root >= 0)
+				Child.Roots |= 1U << Root;
+		}
+		Folders++;
+		Push(Index, Child);
+	}
+
+	// A folder changed within the last second could change again without
+	// its times changing, so it is read again next time
+	if (Cached == Cache.end() && !Cache_File.empty() && Entry.Mtime < Walk_Start - 1 && Entry.Ctime < Walk_Start - 1) {
+		Entry.Size = Size;
+		Entry.Files = Files;
+		Updates->push_back(make_pair(Cache_Key(folder_st.st_dev, folder_st.st_ino), Entry));
+	}
+
+	for (i = 0; i < DU_MAX_ROOTS; i++) {
+		if (Item.Roots & (1U << i)) {
+			Sums->Size[i] += Size;
+			Sums->Files[i] += Files;
+			Sums->Folders[i] += Folders;
+		}
+	}
+}
+
+unsigned long long twrpDU::Get_Size(string Root) {
+	int i = Find_Root(Clean_Path(Root));
+
+	return i < 0 ? 0 : Results.Size[i];
+}
+
+unsigned long long twrpDU::Get_File_Count(string Root) {
+	int i = Find_Root(Clean_Path(Root));
+
+	return i < 0 ? 0 : Results.Files[i];
+}
+
+unsigned long long twrpDU::Get_Folder_Count(string Root) {
+	int i = Find_Root(Clean_Path(Root));
+
+	return i < 0 ? 0 : Results.Folders[i];
+}
@@ -0,0 +1,115 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPDU_HPP
+#define _TWRPDU_HPP
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+using namespace std;
+
+#define DU_MAX_ROOTS 32                                                         // Roots are tracked as bits of an unsigned int
+#define DU_MAX_THREADS 8
+#define DU_CACHE_FILE "/tmp/.twrp_size_cache"                                   // Lasts until Drop_Cache, only files changed from an adb shell go unnoticed
+#define DU_CACHE_MAGIC 0x55445754                                               // "TWDU"
+
+// Disk usage of several folders in one parallel walk, a root inside another
+// root (like /data/media in /data) is counted for both without being read
+// twice and excluded folders are not counted for any root
+class twrpDU {
+public:
+	twrpDU();
+	virtual ~twrpDU();
+
+public:
+	bool Add_Root(string Path);                                               // Folder to total, at most DU_MAX_ROOTS
+	void Add_Exclusion(string Path);                                          // Folder that is skipped along with everything below it
+	void Set_Cache(string File);                                              // Reuses the totals of folders that are unchanged since the last walk that used File
+	static void Drop_Cache();                                                 // Removes DU_CACHE_FILE, call after anything that may have rewritten files
+	bool Walk(bool Display_Error);                                            // Walks all roots with up to DU_MAX_THREADS threads, false if a root could not be read
+	unsigned long long Get_Size(string Root);                                 // Bytes in regular files below Root
+	unsigned long long Get_File_Count(string Root);                           // Entries other than folders below Root, for progress estimates
+	unsigned long long Get_Folder_Count(string Root);                         // Folders below Root, not counting Root itself
+
+private:
+	struct Walk_Item {
+		string Path;
+		unsigned int Roots;                                                   // Bits of the roots this folder is inside of
+	};
+
+	struct Walk_Queue {
+		pthread_mutex_t Lock;
+		deque<Walk_Item> Items;                                               // The owner works from the back, others steal from the front
+	};
+
+	typedef pair<unsigned long long, unsigned long long> Cache_Key;          // Device and inode of a folder
+
+	struct Cache_Entry {
+		long long Mtime;                                                      // The entry is only used while both times still match
+		long long Ctime;
+		unsigned long long Size;                                              // Of the files in this folder only, not its subfolders
+		unsigned long long Files;
+		vector<string> Folders;                                               // Names of the subfolders
+	};
+
+	typedef vector<pair<Cache_Key, Cache_Entry> > Cache_Updates;
+
+	struct Totals {
+		unsigned long long Size[DU_MAX_ROOTS];
+		unsigned long long Files[DU_MAX_ROOTS];
+		unsigned long long Folders[DU_MAX_ROOTS];
+	};
+
+	static void* Walk_Thread(void* cookie);
+	void Run_Worker(int Index);
+	void Push(int Index, const Walk_Item& Item);
+	bool Pop(int Index, Walk_Item* Item);                                     // Takes from our own queue or steals from another
+	bool Wait_For_Work(int Index, Walk_Item* Item);                           // Blocks until there is work, false once the walk is done
+	void Read_Folder(int Index, const Walk_Item& Item, Totals* Sums, Cache_Updates* Updates); // Counts the entries of one folder and queues its subfolders
+	bool Load_Cache();
+	bool Save_Cache();
+	int Find_Root(string Path);                                               // Index of Path in Roots or -1
+	static string Clean_Path(string Path);                                    // Drops trailing slashes
+
+private:
+	vector<string> Roots;
+	map<string, int> Root_Index;
+	set<string> Exclusions;
+	Totals Results;
+	Walk_Queue* Queues;
+	Cache_Updates* Worker_Updates;                                            // Folders each worker read, merged into Cache after the walk
+	map<Cache_Key, Cache_Entry> Cache;
+	string Cache_File;
+	time_t Walk_Start;
+	int Thread_Count;
+	int Worker_Start;                                                         // Next worker index handed out to a starting thread
+	volatile int Pending;                                                     // Folders queued or being read
+	volatile int Waiting;                                                     // Workers blocked in Wait_For_Work
+	bool Failed;
+	bool Show_Errors;
+	pthread_mutex_t Lock;                                                     // Guards Results, Failed and the idle wait
+	pthread_cond_t Work_Ready;
+};
+
+#endif // _TWRPDU_HPP
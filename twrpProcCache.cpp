@@ -0,0 +1,202 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <set>
+
+#include "twrpProcCache.hpp"
+#include "common.h"
+
+using namespace std;
+
+pthread_mutex_t twrpProcCache::Lock = PTHREAD_MUTEX_INITIALIZER;
+bool twrpProcCache::Partitions_Loaded = false;
+time_t twrpProcCache::Partitions_Time = 0;
+map<string, unsigned long long> twrpProcCache::Partitions;
+map<string, string> twrpProcCache::MTD_Devices;
+int twrpProcCache::Mounts_fd = -1;
+bool twrpProcCache::Mounts_Loaded = false;
+set<string> twrpProcCache::Mount_Points;
+
+bool twrpProcCache::Load_Partitions() {
+	FILE* fp;
+	char line[512];
+
+	Partitions.clear();
+	MTD_Devices.clear();
+	Partitions_Time = time(NULL);
+	Partitions_Loaded = true;
+
+	fp = fopen("/proc/partitions", "rt");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			unsigned long major, minor, blocks;
+			char device[512];
+
+			if (strlen(line) < 7 || line[0] == 'm')	 continue;
+			if (sscanf(line + 1, "%lu %lu %lu %s", &major, &minor, &blocks, device) != 4)
+				continue;
+			// Adjust block size to byte size
+			Partitions[string("/dev/block/") + device] = blocks * 1024ULL;
+		}
+		fclose(fp);
+	}
+
+	fp = fopen("/proc/mtd", "rt");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			char device[32], label[32];
+			unsigned long size = 0;
+			int deviceId;
+
+			// Skip header and blank lines
+			if (strlen(line) < 8 || sscanf(line, "%31s %lx %*s %*c%31s", device, &size, label) != 3 || strcmp(device, "dev:") == 0)
+				continue;
+
+			// Strip off the trailing " from the label
+			label[strlen(label)-1] = '\0';
+			if (sscanf(device, "mtd%d", &deviceId) == 1) {
+				sprintf(device, "/dev/block/mtdblock%d", deviceId);
+				MTD_Devices[label] = device;
+			}
+		}
+		fclose(fp);
+	}
+	return true;
+}
+
+bool twrpProcCache::Get_Block_Size(string Block_Device, unsigned long long* Size) {
+	map<string, unsigned long long>::iterator it;
+	bool ret;
+
+	pthread_mutex_lock(&Lock);
+	if (!Partitions_Loaded)
+		Load_Partitions();
+	it = Partitions.find(Block_Device);
+	if (it == Partitions.end() && time(NULL) != Partitions_Time) {
+		// The device may have shown up since the last read
+		Load_Partitions();
+		it = Partitions.find(Block_Device);
+	}
+	ret = (it != Partitions.end());
+	if (ret)
+		*Size = it->second;
+	pthread_mutex_unlock(&Lock);
+	return ret;
+}
+
+string twrpProcCache::Get_MTD_Block_Device(string MTD_Name) {
+	map<string, string>::iterator it;
+	string ret;
+
+	pthread_mutex_lock(&Lock);
+	if (!Partitions_Loaded)
+		Load_Partitions();
+	it = MTD_Devices.find(MTD_Name);
+	if (it != MTD_Devices.end())
+		ret = it->second;
+	pthread_mutex_unlock(&Lock);
+	return ret;
+}
+
+void twrpProcCache::Refresh_Partitions() {
+	pthread_mutex_lock(&Lock);
+	Partitions_Loaded = false;
+	pthread_mutex_unlock(&Lock);
+}
+
+string twrpProcCache::Unescape(const char* Path) {
+	string ret;
+
+	while (*Path) {
+		if (Path[0] == '\\' && Path[1] >= '0' && Path[1] <= '7' && Path[2] >= '0' && Path[2] <= '7' && Path[3] >= '0' && Path[3] <= '7') {
+			ret += (char)(((Path[1] - '0') << 6) | ((Path[2] - '0') << 3) | (Path[3] - '0'));
+			Path += 4;
+		} else {
+			ret += *Path++;
+		}
+	}
+	return ret;
+}
+
+bool twrpProcCache::Load_Mounts() {
+	string Table;
+	char buf[4096];
+	size_t start, end;
+	ssize_t len;
+
+	if (lseek(Mounts_fd, 0, SEEK_SET) != 0)
+		return false;
+	while ((len = read(Mounts_fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		Table.append(buf, len);
+	}
+
+	Mount_Points.clear();
+	for (start = 0; start < Table.size(); start = end + 1) {
+		char mount_point[PATH_MAX];
+
+		end = Table.find('\n', start);
+		if (end == string::npos)
+			end = Table.size();
+		if (sscanf(Table.c_str() + start, "%*s %4095s", mount_point) == 1)
+			Mount_Points.insert(Unescape(mount_point));
+	}
+	Mounts_Loaded = true;
+	return true;
+}
+
+int twrpProcCache::Is_Mounted(string Mount_Point) {
+	struct pollfd pfd;
+	int ret = -1;
+
+	pthread_mutex_lock(&Lock);
+	if (Mounts_fd < 0) {
+		Mounts_fd = open("/proc/self/mounts", O_RDONLY);
+		Mounts_Loaded = false;
+	}
+	if (Mounts_fd >= 0) {
+		// The kernel flags the file with POLLERR | POLLPRI whenever anything
+		// is mounted or unmounted, so an unchanged table is not read again
+		pfd.fd = Mounts_fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLPRI)))
+			Mounts_Loaded = false;
+		if (Mounts_Loaded || Load_Mounts())
+			ret = Mount_Points.find(Mount_Point) != Mount_Points.end();
+	}
+	pthread_mutex_unlock(&Lock);
+	return ret;
+}
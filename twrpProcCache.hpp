@@ -0,0 +1,56 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPPROCCACHE_HPP
+#define _TWRPPROCCACHE_HPP
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <map>
+#include <set>
+
+using namespace std;
+
+// Parsed copies of /proc/partitions, /proc/mtd and /proc/self/mounts so that
+// every partition lookup doesn't open and parse them again, the mount table
+// is only read again after poll() reports that it changed
+class twrpProcCache {
+public:
+	static bool Get_Block_Size(string Block_Device, unsigned long long* Size); // Size in bytes of a /dev/block device from /proc/partitions
+	static string Get_MTD_Block_Device(string MTD_Name);                      // /dev/block/mtdblockN for a /proc/mtd name, empty if there is none
+	static int Is_Mounted(string Mount_Point);                                // 1 if something is mounted on Mount_Point, 0 if not, -1 if the mount table can't be read
+	static void Refresh_Partitions();                                         // Reads /proc/partitions and /proc/mtd again on the next lookup, for after repartitioning
+
+private:
+	static bool Load_Partitions();                                            // Called with Lock held
+	static bool Load_Mounts();                                                // Called with Lock held
+	static string Unescape(const char* Path);                                 // Undoes the octal escapes of spaces and such in the mount table
+
+private:
+	static pthread_mutex_t Lock;
+	static bool Partitions_Loaded;
+	static time_t Partitions_Time;                                            // A lookup that misses reads the files again, at most once a second
+	static map<string, unsigned long long> Partitions;
+	static map<string, string> MTD_Devices;
+	static int Mounts_fd;                                                     // Kept open for poll()
+	static bool Mounts_Loaded;
+	static set<string> Mount_Points;
+};
+
+#endif // _TWRPPROCCACHE_HPP
@@ -0,0 +1,1841 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "twrpTar.hpp"
+#include "common.h"
+#include "twrp-functions.hpp"
+#include "twrpWipe.hpp"
+extern "C" {
+	#include "pigz/pigz.h"
+}
+
+using namespace std;
+
+#define SELINUX_XATTR "security.selinux"
+
+// Offsets of the ustar header fields
+#define TAR_NAME      0
+#define TAR_MODE      100
+#define TAR_UID       108
+#define TAR_GID       116
+#define TAR_SIZE      124
+#define TAR_MTIME     136
+#define TAR_CHKSUM    148
+#define TAR_TYPEFLAG  156
+#define TAR_LINKNAME  157
+#define TAR_MAGIC     257
+#define TAR_VERSION   263
+#define TAR_DEVMAJOR  329
+#define TAR_DEVMINOR  337
+#define TAR_PREFIX    345
+
+// Writes value as a NUL terminated octal number, falls back to GNU base-256 for large values
+static void Tar_Number(char* field, size_t len, unsigned long long value) {
+	unsigned long long max = 1;
+	size_t i;
+
+	for (i = 0; i < len - 1; i++)
+		max *= 8;
+	if (value < max) {
+		field[len - 1] = '\0';
+		for (i = len - 1; i > 0; i--) {
+			field[i - 1] = '0' + (value & 7);
+			value >>= 3;
+		}
+	} else {
+		for (i = len; i > 1; i--) {
+			field[i - 1] = (char)(value & 0xff);
+			value >>= 8;
+		}
+		field[0] = (char)0x80;
+	}
+}
+
+// Parses an octal or GNU base-256 number from a header field
+static unsigned long long Tar_Parse_Number(const char* field, size_t len) {
+	unsigned long long value = 0;
+	size_t i = 0;
+
+	if ((unsigned char)field[0] & 0x80) {
+		value = (unsigned char)field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			value = (value << 8) | (unsigned char)field[i];
+		return value;
+	}
+	while (i < len && (field[i] == ' ' || field[i] == '\0'))
+		i++;
+	while (i < len && field[i] >= '0' && field[i] <= '7') {
+		value = (value << 3) | (field[i] - '0');
+		i++;
+	}
+	return value;
+}
+
+static unsigned int Tar_Checksum(const char* header) {
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (i >= TAR_CHKSUM && i < TAR_CHKSUM + 8)
+			sum += ' ';
+		else
+			sum += (unsigned char)header[i];
+	}
+	return sum;
+}
+
+static bool Is_Zero_Block(const char* header) {
+	int i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (header[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+static string Tar_Field(const char* field, size_t len) {
+	return string(field, strnlen(field, len));
+}
+
+// Builds a pax extended header record: "<length> <key>=<value>\n"
+static string Pax_Record(string Key, string Value) {
+	size_t len = Key.size() + Value.size() + 3, digits = 1, total;
+	char num[32];
+
+	while (true) {
+		total = len + digits;
+		sprintf(num, "%lu", (unsigned long)total);
+		if (strlen(num) == digits)
+			break;
+		digits = strlen(num);
+	}
+	return string(num) + " " + Key + "=" + Value + "\n";
+}
+
+// Creates all of the parent folders of Path
+static void Make_Parent_Dirs(string Path) {
+	size_t pos = Path.find("/", 1);
+
+	while (pos != string::npos) {
+		mkdir(Path.substr(0, pos).c_str(), 0755);
+		pos = Path.find("/", pos + 1);
+	}
+}
+
+// Buffers only ever move between the free list and the full list, so a
+// stage can never hold more than Count buffers of memory
+struct twrpTar::Block_Queue {
+	struct Block {
+		char* data;
+		size_t len;
+	};
+
+	Block_Queue(int Count) {
+		Closed = Aborted = false;
+		pthread_mutex_init(&Lock, NULL);
+		pthread_cond_init(&Changed, NULL);
+		for (int i = 0; i < Count; i++) {
+			char* data = (char*)memalign(4096, TAR_BUFFER_SIZE);
+
+			if (data == NULL)
+				break;
+			Free.push_back(data);
+		}
+	}
+
+	~Block_Queue() {
+		vector<char*>::iterator data;
+		deque<Block>::iterator block;
+
+		for (data = Free.begin(); data != Free.end(); data++)
+			free(*data);
+		for (block = Full.begin(); block != Full.end(); block++)
+			free(block->data);
+		pthread_cond_destroy(&Changed);
+		pthread_mutex_destroy(&Lock);
+	}
+
+	// Waits for an empty buffer, NULL if the consumer has gone away
+	char* Get_Free() {
+		char* data = NULL;
+
+		pthread_mutex_lock(&Lock);
+		while (Free.empty() && !Aborted)
+			pthread_cond_wait(&Changed, &Lock);
+		if (!Aborted) {
+			data = Free.back();
+			Free.pop_back();
+		}
+		pthread_mutex_unlock(&Lock);
+		return data;
+	}
+
+	void Put_Free(char* data) {
+		pthread_mutex_lock(&Lock);
+		Free.push_back(data);
+		pthread_cond_broadcast(&Changed);
+		pthread_mutex_unlock(&Lock);
+	}
+
+	void Put_Full(char* data, size_t len) {
+		Block block;
+
+		block.data = data;
+		block.len = len;
+		pthread_mutex_lock(&Lock);
+		Full.push_back(block);
+		pthread_cond_broadcast(&Changed);
+		pthread_mutex_unlock(&Lock);
+	}
+
+	// Hands *data back to the free list and replaces it with the next
+	// filled buffer, false once the producer is done and nothing is left
+	bool Swap(char** data, size_t* len) {
+		bool ret = false;
+
+		pthread_mutex_lock(&Lock);
+		while (Full.empty() && !Closed && !Aborted)
+			pthread_cond_wait(&Changed, &Lock);
+		if (!Full.empty() && !Aborted) {
+			Free.push_back(*data);
+			*data = Full.front().data;
+			*len = Full.front().len;
+			Full.pop_front();
+			pthread_cond_broadcast(&Changed);
+			ret = true;
+		}
+		pthread_mutex_unlock(&Lock);
+		return ret;
+	}
+
+	void Close() {
+		pthread_mutex_lock(&Lock);
+		Closed = true;
+		pthread_cond_broadcast(&Changed);
+		pthread_mutex_unlock(&Lock);
+	}
+
+	void Abort() {
+		pthread_mutex_lock(&Lock);
+		Aborted = true;
+		pthread_cond_broadcast(&Changed);
+		pthread_mutex_unlock(&Lock);
+	}
+
+	vector<char*> Free;
+	deque<Block> Full;
+	bool Closed;                                                              // The producer has nothing more
+	bool Aborted;                                                             // The consumer has stopped reading
+	pthread_mutex_t Lock;
+	pthread_cond_t Changed;
+};
+
+twrpTar::twrpTar() {
+	use_compression = false;
+	split_size = 0;
+	segment_data_size = 0;
+	segment_entries = 0;
+	segment_index = 0;
+	split_archive = false;
+	compression_threads = 1;
+	pigz_fd = -1;
+	pigz_read_fd = -1;
+	pigz_threads = 1;
+	pigz_active = false;
+	generate_md5 = false;
+	verify_md5 = false;
+	verify_failed = false;
+	fd = -1;
+	buffer = NULL;
+	buffer_used = 0;
+	buffer_pos = 0;
+	memset(&zstrm, 0, sizeof(zstrm));
+	zstrm_active = false;
+	zbuffer = NULL;
+	input_compressed = false;
+	input_eof = false;
+	input_error = false;
+	input_end = false;
+	raw_eof = false;
+	write_error = false;
+	read_offset = 0;
+	raw_queue = NULL;
+	data_queue = NULL;
+	reader_active = false;
+	inflate_active = false;
+	bytes_processed = 0;
+	archive_size = 0;
+	manifest_fp = NULL;
+	unchanged_count = 0;
+	chunk_store = NULL;
+	pthread_mutex_init(&output_lock, NULL);
+}
+
+twrpTar::~twrpTar() {
+	Stop_Read_Ahead();
+	if (fd >= 0)
+		close(fd);
+	if (manifest_fp != NULL)
+		fclose(manifest_fp);
+	delete chunk_store;
+	free(buffer);
+	free(zbuffer);
+	pthread_mutex_destroy(&output_lock);
+}
+
+void twrpTar::Set_Dir(string Dir) {
+	Backup_Dir = Dir;
+	while (Backup_Dir.size() > 1 && Backup_Dir[Backup_Dir.size() - 1] == '/')
+		Backup_Dir.resize(Backup_Dir.size() - 1);
+}
+
+void twrpTar::Set_Filename(string Filename) {
+	Tar_File = Filename;
+}
+
+void twrpTar::Set_Exclude(string Path) {
+	Excludes.push_back(Path);
+}
+
+void twrpTar::Set_Compression(bool Compress) {
+	use_compression = Compress;
+}
+
+void twrpTar::Set_Compression_Threads(int Threads) {
+	compression_threads = Threads;
+}
+
+void twrpTar::Set_MD5(bool Generate) {
+	generate_md5 = Generate;
+}
+
+unsigned long long twrpTar::Get_Bytes_Processed() {
+	return bytes_processed;
+}
+
+unsigned long long twrpTar::Get_Archive_Size() {
+	unsigned long long ret;
+
+	pthread_mutex_lock(&output_lock);
+	ret = archive_size;
+	pthread_mutex_unlock(&output_lock);
+	return ret;
+}
+
+void twrpTar::Set_Verify(bool Verify) {
+	verify_md5 = Verify;
+}
+
+bool twrpTar::Get_Verify_Failed() {
+	return verify_failed;
+}
+
+void twrpTar::Set_Split_Size(unsigned long long Size) {
+	split_size = Size;
+}
+
+int twrpTar::Get_Segment_Count() {
+	return segment_index + 1;
+}
+
+void twrpTar::Set_Chunk_Store(string Store_Folder) {
+	chunk_store_folder = Store_Folder;
+}
+
+void twrpTar::Set_Manifest(string Manifest_File) {
+	manifest_file = Manifest_File;
+}
+
+bool twrpTar::Set_Previous_Manifest(string Manifest_File, string Parent) {
+	Previous_Entries.clear();
+	if (!Load_Manifest(Manifest_File, &Previous_Entries, NULL, NULL))
+		return false;
+	manifest_parent = Parent;
+	return true;
+}
+
+int twrpTar::Get_Unchanged_Count() {
+	return unchanged_count;
+}
+
+string twrpTar::Segment_Name(int Index) {
+	char split_index[16];
+
+	if (!split_archive)
+		return Tar_File;
+	sprintf(split_index, "%03i", Index);
+	return Tar_File + split_index;
+}
+
+int twrpTar::Create_Tar() {
+	if (!Open_Output())
+		return -1;
+	if (!manifest_file.empty() && !Open_Manifest()) {
+		Close_Output();
+		return -1;
+	}
+	LOGI("Creating tar '%s' from '%s'\n", Tar_File.c_str(), Backup_Dir.c_str());
+	bool ret = Add_Path(Backup_Dir);
+	if (!Close_Output())
+		ret = false;
+	if (manifest_fp != NULL && !Close_Manifest())
+		ret = false;
+	if (!ret)
+		return -1;
+	LOGI("Archived %llu bytes into '%s' (%llu bytes in %i file(s))\n", bytes_processed, Tar_File.c_str(), Get_Archive_Size(), Get_Segment_Count());
+	if (!manifest_parent.empty())
+		LOGI("Incremental archive on top of '%s', %i unchanged files left out, %i deletions\n", manifest_parent.c_str(), unchanged_count, (int)Deleted.size());
+	return 0;
+}
+
+bool twrpTar::Open_Manifest() {
+	string Temp_File = manifest_file + ".tmp";
+
+	unchanged_count = 0;
+	Deleted.clear();
+	manifest_fp = fopen(Temp_File.c_str(), "w");
+	if (manifest_fp == NULL) {
+		LOGE("Unable to create manifest '%s': %s\n", Temp_File.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(manifest_fp, "# TWRP backup manifest\n");
+	if (!manifest_parent.empty())
+		fprintf(manifest_fp, "P\t%s\n", manifest_parent.c_str());
+	return true;
+}
+
+bool twrpTar::Close_Manifest() {
+	string Temp_File = manifest_file + ".tmp";
+	map<string, Manifest_Entry>::iterator entry;
+	vector<string>::iterator path;
+	bool ret = true;
+
+	// Whatever was in the previous manifest and was not found again has been deleted
+	for (entry = Previous_Entries.begin(); entry != Previous_Entries.end(); entry++)
+		Deleted.push_back(entry->first);
+	Previous_Entries.clear();
+	for (path = Deleted.begin(); path != Deleted.end(); path++)
+		fprintf(manifest_fp, "D\t%s\n", path->c_str());
+	if (ferror(manifest_fp) || Has_Write_Error())
+		ret = false;
+	if (fclose(manifest_fp) != 0)
+		ret = false;
+	manifest_fp = NULL;
+	// The manifest only replaces an older one once the archive is complete
+	if (ret && rename(Temp_File.c_str(), manifest_file.c_str()) != 0)
+		ret = false;
+	if (!ret) {
+		LOGE("Unable to write manifest '%s'\n", manifest_file.c_str());
+		unlink(Temp_File.c_str());
+	}
+	return ret;
+}
+
+bool twrpTar::Check_Unchanged(string Path, struct stat* st) {
+	map<string, Manifest_Entry>::iterator prev = Previous_Entries.find(Path);
+	Manifest_Entry entry;
+
+	if (prev == Previous_Entries.end())
+		return false;
+	entry = prev->second;
+	Previous_Entries.erase(prev);
+	if ((entry.mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+		// The old entry has to be removed before the new type can be extracted in its place
+		Deleted.push_back(Path);
+		return false;
+	}
+	// Folders are always archived, their headers are small and carry the permissions
+	if (!S_ISREG(st->st_mode) && !S_ISLNK(st->st_mode))
+		return false;
+	if (entry.mode != st->st_mode || entry.size != (unsigned long long)st->st_size || entry.mtime != st->st_mtime)
+		return false;
+	// The mtime can be set back, with touch or by a restore, but the ctime can't,
+	// so a file whose ctime moved is only left out if its data hashes the same
+	if (entry.ctime != st->st_ctime) {
+		unsigned char digest[16];
+
+		if (!S_ISREG(st->st_mode) || entry.md5 == "-" || !TWFunc::Get_MD5(Path, digest) || MD5_Hex(digest) != entry.md5)
+			return false;
+	}
+
+	if (S_ISREG(st->st_mode) && st->st_nlink > 1) {
+		Hardlink_Key key;
+
+		// New links to this file can point at the copy restored from the earlier backup
+		key.dev = st->st_dev;
+		key.ino = st->st_ino;
+		if (Hardlinks.find(key) == Hardlinks.end())
+			Hardlinks[key] = Archive_Name(Path);
+	}
+	Write_Manifest_Entry(Path, st, entry.md5);
+	return true;
+}
+
+void twrpTar::Write_Manifest_Entry(string Path, struct stat* st, string MD5) {
+	if (Path.find_first_of("\t\n") != string::npos) {
+		LOGI("Leaving '%s' out of the manifest\n", Path.c_str());
+		return;
+	}
+	fprintf(manifest_fp, "E\t%o\t%llu\t%ld\t%ld\t%s\t%s\n", (unsigned int)st->st_mode, S_ISREG(st->st_mode) || S_ISLNK(st->st_mode) ? (unsigned long long)st->st_size : 0ULL, (long)st->st_mtime, (long)st->st_ctime, MD5.c_str(), Path.c_str());
+}
+
+string twrpTar::MD5_Hex(const unsigned char* Digest) {
+	char hex[40];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + i * 2, "%02x", Digest[i]);
+	return hex;
+}
+
+bool twrpTar::Load_Manifest(string Manifest_File, map<string, Manifest_Entry>* Entries, string* Parent, vector<string>* Deleted) {
+	FILE* fp;
+	char line[PATH_MAX + 128];
+
+	fp = fopen(Manifest_File.c_str(), "r");
+	if (fp == NULL) {
+		LOGE("Unable to open manifest '%s'\n", Manifest_File.c_str());
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len < 3 || line[1] != '\t')
+			continue;
+		if (line[0] == 'E' && Entries != NULL) {
+			Manifest_Entry entry;
+			unsigned int mode;
+			long mtime, ctime;
+			char md5[40];
+			int pos = 0;
+
+			if (sscanf(line + 2, "%o\t%llu\t%ld\t%ld\t%39s\t%n", &mode, &entry.size, &mtime, &ctime, md5, &pos) < 5 || pos == 0)
+				continue;
+			entry.mode = mode;
+			entry.mtime = mtime;
+			entry.ctime = ctime;
+			entry.md5 = md5;
+			(*Entries)[line + 2 + pos] = entry;
+		} else if (line[0] == 'P' && Parent != NULL) {
+			*Parent = line + 2;
+		} else if (line[0] == 'D' && Deleted != NULL) {
+			Deleted->push_back(line + 2);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+string twrpTar::Get_Manifest_Parent(string Manifest_File) {
+	string Parent;
+
+	if (access(Manifest_File.c_str(), F_OK) != 0)
+		return "";
+	Load_Manifest(Manifest_File, NULL, &Parent, NULL);
+	return Parent;
+}
+
+bool twrpTar::Apply_Deletions(string Manifest_File) {
+	vector<string> Deleted;
+	vector<string>::iterator path;
+	twrpWipe wipe;
+	bool ret = true;
+
+	if (!Load_Manifest(Manifest_File, NULL, NULL, &Deleted))
+		return false;
+	for (path = Deleted.begin(); path != Deleted.end(); path++) {
+		// A path below a folder that was already removed is gone and not an error
+		if (!wipe.Remove(*path))
+			ret = false;
+	}
+	LOGI("Removed %i deleted paths listed in '%s'\n", (int)Deleted.size(), Manifest_File.c_str());
+	return ret;
+}
+
+bool twrpTar::Open_Output() {
+	write_error = false;
+	buffer_used = 0;
+	split_archive = (split_size > 0);
+	segment_index = 0;
+	if (buffer == NULL && (buffer = (char*)memalign(4096, TAR_BUFFER_SIZE)) == NULL) {
+		LOGE("Unable to allocate tar buffer\n");
+		return false;
+	}
+	if (!chunk_store_folder.empty()) {
+		// Chunks are compressed one by one, a compressed stream would not deduplicate
+		split_archive = false;
+		Current_File = Tar_File;
+		chunk_store = new twrpChunkStore();
+		return chunk_store->Create_Index(chunk_store_folder, Tar_File, use_compression);
+	}
+	if (!Open_Segment())
+		return false;
+	return Start_Compression();
+}
+
+bool twrpTar::Start_Compression() {
+	if (use_compression) {
+		int threads = compression_threads;
+
+		if (threads <= 0)
+			threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > 1)
+			return Start_Pigz(threads);
+
+		if (zbuffer == NULL && (zbuffer = (char*)memalign(4096, TAR_BUFFER_SIZE)) == NULL) {
+			LOGE("Unable to allocate compression buffer\n");
+			return false;
+		}
+		memset(&zstrm, 0, sizeof(zstrm));
+		// 15 + 16 selects a gzip wrapper so that the archive matches tar -z
+		if (deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			LOGE("Unable to initialize compression for '%s'\n", Tar_File.c_str());
+			return false;
+		}
+		zstrm_active = true;
+	}
+	return true;
+}
+
+bool twrpTar::Close_Output() {
+	bool ret = true;
+
+	if (fd < 0 && chunk_store == NULL)
+		return false;
+
+	Finish_Archive();
+	if (chunk_store != NULL) {
+		if (!Has_Write_Error() && !chunk_store->Close_Index())
+			ret = false;
+		delete chunk_store;
+		chunk_store = NULL;
+	} else if (!Close_Segment())
+		ret = false;
+	if (Has_Write_Error())
+		ret = false;
+	return ret;
+}
+
+bool twrpTar::Finish_Archive() {
+	char zero[TAR_BLOCK_SIZE * 2];
+
+	// Two empty blocks mark the end of the archive
+	memset(zero, 0, sizeof(zero));
+	if (!Has_Write_Error())
+		Write_Block(zero, sizeof(zero));
+	if (!Has_Write_Error())
+		Flush_Buffer();
+
+	if (pigz_active && !Stop_Pigz())
+		Set_Write_Error();
+
+	if (zstrm_active) {
+		int zret = Z_OK;
+
+		zstrm.next_in = NULL;
+		zstrm.avail_in = 0;
+		while (!Has_Write_Error() && zret != Z_STREAM_END) {
+			zstrm.next_out = (Bytef*)zbuffer;
+			zstrm.avail_out = TAR_BUFFER_SIZE;
+			zret = deflate(&zstrm, Z_FINISH);
+			if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+				LOGE("Compression error %i on '%s'\n", zret, Tar_File.c_str());
+				Set_Write_Error();
+				break;
+			}
+			Write_File(zbuffer, TAR_BUFFER_SIZE - zstrm.avail_out);
+		}
+		deflateEnd(&zstrm);
+		zstrm_active = false;
+	}
+	return !Has_Write_Error();
+}
+
+bool twrpTar::Split_Segment(struct stat* st) {
+	unsigned long long size = S_ISREG(st->st_mode) ? st->st_size : 0;
+
+	// Every file of a split archive is a complete archive of its own, as
+	// older builds restore them one at a time, so files only change between
+	// entries.  A single entry bigger than split_size gets a file to itself.
+	if (segment_entries > 0 && segment_data_size + buffer_used + size > split_size) {
+		if (!Finish_Archive() || !Close_Segment()) {
+			Set_Write_Error();
+			return false;
+		}
+		segment_index++;
+		if (segment_index >= TAR_MAX_SEGMENTS) {
+			LOGE("Too many archive files for '%s'\n", Tar_File.c_str());
+			Set_Write_Error();
+			return false;
+		}
+		if (!Open_Segment() || !Start_Compression()) {
+			Set_Write_Error();
+			return false;
+		}
+	}
+	segment_entries++;
+	return true;
+}
+
+bool twrpTar::Open_Segment() {
+	Current_File = Segment_Name(segment_index);
+	fd = open(Current_File.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0) {
+		LOGE("Unable to open '%s' for writing: %s\n", Current_File.c_str(), strerror(errno));
+		return false;
+	}
+	segment_data_size = 0;
+	segment_entries = 0;
+	if (generate_md5)
+		MD5Init(&md5_ctx);
+	return true;
+}
+
+bool twrpTar::Close_Segment() {
+	bool ret = true;
+
+	if (close(fd) != 0) {
+		LOGE("Error closing '%s': %s\n", Current_File.c_str(), strerror(errno));
+		ret = false;
+	}
+	fd = -1;
+	if (ret && !Has_Write_Error() && generate_md5)
+		ret = Write_MD5_File();
+	return ret;
+}
+
+bool twrpTar::Is_Excluded(string Path) {
+	vector<string>::iterator iter;
+
+	for (iter = Excludes.begin(); iter != Excludes.end(); iter++) {
+		if (Path == *iter)
+			return true;
+	}
+	return false;
+}
+
+string twrpTar::Archive_Name(string Path) {
+	size_t start = 0;
+
+	while (start < Path.size() && Path[start] == '/')
+		start++;
+	return Path.substr(start);
+}
+
+bool twrpTar::Add_Path(string Path) {
+	struct stat st;
+
+	if (Is_Excluded(Path)) {
+		LOGI("Excluding '%s' from the backup\n", Path.c_str());
+		return true;
+	}
+	if (lstat(Path.c_str(), &st) != 0) {
+		LOGE("Unable to stat '%s': %s\n", Path.c_str(), strerror(errno));
+		return true;
+	}
+
+	// The backup folder itself is the mount point and is not archived
+	if (Path != Backup_Dir) {
+		if (manifest_fp != NULL && Check_Unchanged(Path, &st)) {
+			unchanged_count++;
+		} else {
+			file_md5 = "-";
+			if (split_archive && !Split_Segment(&st))
+				return false;
+			if (!Add_Entry(Path, &st))
+				return false;
+			if (manifest_fp != NULL)
+				Write_Manifest_Entry(Path, &st, file_md5);
+		}
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR* d;
+		struct dirent* de;
+
+		d = opendir(Path.c_str());
+		if (d == NULL) {
+			LOGE("Unable to open folder '%s'\n", Path.c_str());
+			return true;
+		}
+		while ((de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (!Add_Path(Path == "/" ? Path + de->d_name : Path + "/" + de->d_name)) {
+				closedir(d);
+				return false;
+			}
+		}
+		closedir(d);
+	}
+	return true;
+}
+
+bool twrpTar::Add_Entry(string Path, struct stat* st) {
+	string Name = Archive_Name(Path), Context;
+	char context[256];
+	ssize_t len;
+
+	len = lgetxattr(Path.c_str(), SELINUX_XATTR, context, sizeof(context) - 1);
+	if (len > 0) {
+		context[len] = '\0';
+		Context = context;
+	}
+
+	if (S_ISREG(st->st_mode)) {
+		if (st->st_nlink > 1) {
+			Hardlink_Key key;
+			map<Hardlink_Key, string>::iterator link;
+
+			key.dev = st->st_dev;
+			key.ino = st->st_ino;
+			link = Hardlinks.find(key);
+			if (link != Hardlinks.end())
+				return Write_Header(Name, link->second, st, '1', 0, Context);
+			Hardlinks[key] = Name;
+		}
+		if (!Write_Header(Name, "", st, '0', st->st_size, Context))
+			return false;
+		return Write_File_Data(Path, st->st_size);
+	} else if (S_ISDIR(st->st_mode)) {
+		return Write_Header(Name + "/", "", st, '5', 0, Context);
+	} else if (S_ISLNK(st->st_mode)) {
+		char link[PATH_MAX];
+
+		len = readlink(Path.c_str(), link, sizeof(link) - 1);
+		if (len < 0) {
+			LOGE("Unable to read link '%s'\n", Path.c_str());
+			return true;
+		}
+		link[len] = '\0';
+		return Write_Header(Name, link, st, '2', 0, Context);
+	} else if (S_ISCHR(st->st_mode)) {
+		return Write_Header(Name, "", st, '3', 0, Context);
+	} else if (S_ISBLK(st->st_mode)) {
+		return Write_Header(Name, "", st, '4', 0, Context);
+	} else if (S_ISFIFO(st->st_mode)) {
+		return Write_Header(Name, "", st, '6', 0, Context);
+	}
+	LOGI("Skipping socket or unknown file type '%s'\n", Path.c_str());
+	return true;
+}
+
+bool twrpTar::Write_Header(string Name, string Link_Name, struct stat* st, char Type, unsigned long long Size, string SELinux_Context) {
+	char header[TAR_BLOCK_SIZE];
+	string Records;
+
+	if (Name.size() > 100)
+		Records += Pax_Record("path", Name);
+	if (Link_Name.size() > 100)
+		Records += Pax_Record("linkpath", Link_Name);
+	if (Size > 077777777777ULL) {
+		char size[32];
+
+		sprintf(size, "%llu", Size);
+		Records += Pax_Record("size", size);
+	}
+	if (!SELinux_Context.empty())
+		Records += Pax_Record("SCHILY.xattr." SELINUX_XATTR, SELinux_Context);
+	if (!Records.empty() && !Write_Pax_Header(Name, Records))
+		return false;
+
+	memset(header, 0, sizeof(header));
+	strncpy(header + TAR_NAME, Name.c_str(), 100);
+	Tar_Number(header + TAR_MODE, 8, st->st_mode & 07777);
+	Tar_Number(header + TAR_UID, 8, st->st_uid);
+	Tar_Number(header + TAR_GID, 8, st->st_gid);
+	Tar_Number(header + TAR_SIZE, 12, Size);
+	Tar_Number(header + TAR_MTIME, 12, st->st_mtime);
+	header[TAR_TYPEFLAG] = Type;
+	strncpy(header + TAR_LINKNAME, Link_Name.c_str(), 100);
+	memcpy(header + TAR_MAGIC, "ustar", 6);
+	memcpy(header + TAR_VERSION, "00", 2);
+	if (Type == '3' || Type == '4') {
+		Tar_Number(header + TAR_DEVMAJOR, 8, major(st->st_rdev));
+		Tar_Number(header + TAR_DEVMINOR, 8, minor(st->st_rdev));
+	}
+	sprintf(header + TAR_CHKSUM, "%06o", Tar_Checksum(header));
+	header[TAR_CHKSUM + 7] = ' ';
+	return Write_Block(header, sizeof(header));
+}
+
+bool twrpTar::Write_Pax_Header(string Name, string Records) {
+	struct stat st;
+	string Pax_Name = "PaxHeaders/" + Name.substr(0, 80);
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = 0644;
+	st.st_mtime = time(NULL);
+	if (!Write_Header(Pax_Name, "", &st, 'x', Records.size(), ""))
+		return false;
+	if (!Write_Block(Records.c_str(), Records.size()))
+		return false;
+	return Pad_Block();
+}
+
+bool twrpTar::Write_File_Data(string Path, unsigned long long Size) {
+	int in_fd;
+	ssize_t len;
+	unsigned long long remaining = Size;
+	struct MD5Context md5;
+
+	if (manifest_fp != NULL)
+		MD5Init(&md5);
+
+	in_fd = open(Path.c_str(), O_RDONLY | O_LARGEFILE);
+	if (in_fd < 0) {
+		LOGE("Unable to open '%s': %s\n", Path.c_str(), strerror(errno));
+	} else {
+		while (remaining > 0) {
+			size_t chunk = TAR_BUFFER_SIZE - buffer_used;
+
+			if (chunk > remaining)
+				chunk = (size_t)remaining;
+			len = read(in_fd, buffer + buffer_used, chunk);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0) {
+				LOGE("'%s' changed size while being backed up\n", Path.c_str());
+				break;
+			}
+			if (manifest_fp != NULL)
+				MD5Update(&md5, (unsigned char*)buffer + buffer_used, len);
+			buffer_used += len;
+			remaining -= len;
+			bytes_processed += len;
+			if (buffer_used == TAR_BUFFER_SIZE && !Flush_Buffer()) {
+				close(in_fd);
+				return false;
+			}
+		}
+		close(in_fd);
+		if (manifest_fp != NULL && remaining == 0) {
+			unsigned char digest[16];
+
+			MD5Final(digest, &md5);
+			file_md5 = MD5_Hex(digest);
+		}
+	}
+
+	// The header promised Size bytes, pad with zeros if the file shrank or could not be read
+	while (remaining > 0) {
+		size_t chunk = TAR_BUFFER_SIZE - buffer_used;
+
+		if (chunk > remaining)
+			chunk = (size_t)remaining;
+		memset(buffer + buffer_used, 0, chunk);
+		buffer_used += chunk;
+		remaining -= chunk;
+		if (buffer_used == TAR_BUFFER_SIZE && !Flush_Buffer())
+			return false;
+	}
+	return Pad_Block();
+}
+
+bool twrpTar::Write_Block(const char* data, size_t len) {
+	while (len > 0) {
+		size_t chunk = TAR_BUFFER_SIZE - buffer_used;
+
+		if (chunk > len)
+			chunk = len;
+		memcpy(buffer + buffer_used, data, chunk);
+		buffer_used += chunk;
+		data += chunk;
+		len -= chunk;
+		if (buffer_used == TAR_BUFFER_SIZE && !Flush_Buffer())
+			return false;
+	}
+	return true;
+}
+
+bool twrpTar::Pad_Block() {
+	char zero[TAR_BLOCK_SIZE];
+	size_t pad = (TAR_BLOCK_SIZE - (buffer_used % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+	if (pad == 0)
+		return true;
+	memset(zero, 0, pad);
+	return Write_Block(zero, pad);
+}
+
+bool twrpTar::Flush_Buffer() {
+	bool ret = true;
+
+	if (buffer_used > 0)
+		ret = Write_Output(buffer, buffer_used);
+	segment_data_size += buffer_used;
+	buffer_used = 0;
+	return ret;
+}
+
+bool twrpTar::Write_Output(const char* data, size_t len) {
+	if (pigz_active) {
+		// pigz reads the other end of the pipe and hands back compressed data through Pigz_Write
+		while (len > 0) {
+			ssize_t written = write(pigz_fd, data, len);
+
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0) {
+				LOGE("Error sending data to the compressor: %s\n", strerror(errno));
+				Set_Write_Error();
+				return false;
+			}
+			data += written;
+			len -= written;
+		}
+		return true;
+	}
+	if (!zstrm_active)
+		return Write_File(data, len);
+
+	zstrm.next_in = (Bytef*)data;
+	zstrm.avail_in = len;
+	while (zstrm.avail_in > 0) {
+		zstrm.next_out = (Bytef*)zbuffer;
+		zstrm.avail_out = TAR_BUFFER_SIZE;
+		if (deflate(&zstrm, Z_NO_FLUSH) == Z_STREAM_ERROR) {
+			LOGE("Compression error on '%s'\n", Tar_File.c_str());
+			Set_Write_Error();
+			return false;
+		}
+		if (!Write_File(zbuffer, TAR_BUFFER_SIZE - zstrm.avail_out))
+			return false;
+	}
+	return true;
+}
+
+bool twrpTar::Start_Pigz(int Threads) {
+	int pipe_fd[2];
+
+	if (pipe(pipe_fd) != 0) {
+		LOGE("Unable to create compression pipe: %s\n", strerror(errno));
+		return false;
+	}
+	pigz_read_fd = pipe_fd[0];
+	pigz_fd = pipe_fd[1];
+	pigz_threads = Threads;
+	if (pthread_create(&pigz_thread, NULL, Pigz_Thread, this) != 0) {
+		LOGE("Unable to start compression thread\n");
+		close(pigz_read_fd);
+		close(pigz_fd);
+		pigz_read_fd = pigz_fd = -1;
+		return false;
+	}
+	pigz_active = true;
+	LOGI("Compressing '%s' with %i threads\n", Tar_File.c_str(), Threads);
+	return true;
+}
+
+bool twrpTar::Stop_Pigz() {
+	// Closing the pipe is the end of input for pigz, it then writes the trailer and returns
+	close(pigz_fd);
+	pigz_fd = -1;
+	pthread_join(pigz_thread, NULL);
+	pigz_active = false;
+	return !Has_Write_Error();
+}
+
+void* twrpTar::Pigz_Thread(void* cookie) {
+	twrpTar* tar = (twrpTar*)cookie;
+
+	// pigz still reads the whole pipe after a failure, so the backup thread is never left blocked on it
+	if (pigz_compress_fd(tar->pigz_read_fd, Pigz_Write, tar, Z_DEFAULT_COMPRESSION, tar->pigz_threads) != 0) {
+		LOGE("Unable to compress '%s'\n", tar->Tar_File.c_str());
+		tar->Set_Write_Error();
+	}
+	close(tar->pigz_read_fd);
+	tar->pigz_read_fd = -1;
+	return NULL;
+}
+
+void twrpTar::Pigz_Write(void* cookie, const unsigned char* buf, size_t len) {
+	twrpTar* tar = (twrpTar*)cookie;
+
+	// pigz cannot be stopped early, so once writing fails the rest of the output is dropped
+	if (!tar->Has_Write_Error())
+		tar->Write_File((const char*)buf, len);
+}
+
+void twrpTar::Set_Write_Error() {
+	pthread_mutex_lock(&output_lock);
+	write_error = true;
+	pthread_mutex_unlock(&output_lock);
+}
+
+bool twrpTar::Has_Write_Error() {
+	bool ret;
+
+	pthread_mutex_lock(&output_lock);
+	ret = write_error;
+	pthread_mutex_unlock(&output_lock);
+	return ret;
+}
+
+bool twrpTar::Write_File(const char* data, size_t len) {
+	if (chunk_store != NULL) {
+		if (!chunk_store->Write(data, len)) {
+			Set_Write_Error();
+			return false;
+		}
+		pthread_mutex_lock(&output_lock);
+		archive_size += len;
+		pthread_mutex_unlock(&output_lock);
+		return true;
+	}
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0) {
+			LOGE("Error writing to '%s': %s\n", Current_File.c_str(), strerror(errno));
+			Set_Write_Error();
+			return false;
+		}
+		if (generate_md5)
+			MD5Update(&md5_ctx, (const unsigned char*)data, written);
+		data += written;
+		len -= written;
+		pthread_mutex_lock(&output_lock);
+		archive_size += written;
+		pthread_mutex_unlock(&output_lock);
+	}
+	return true;
+}
+
+bool twrpTar::Write_MD5_File() {
+	unsigned char digest[16];
+
+	MD5Final(digest, &md5_ctx);
+	return TWFunc::Write_MD5(Current_File, digest);
+}
+
+int twrpTar::Extract_Tar() {
+	vector<Dir_Time>::reverse_iterator dir;
+	bool ret = true;
+
+	LOGI("Extracting tar '%s'\n", Tar_File.c_str());
+	Dir_Times.clear();
+	verify_failed = false;
+
+	// Split backups are separate archives in Tar_File000, Tar_File001...
+	split_archive = false;
+	if (access(Tar_File.c_str(), F_OK) != 0 && !twrpChunkStore::Has_Index(Tar_File)) {
+		split_archive = true;
+		if (access(Segment_Name(0).c_str(), F_OK) != 0) {
+			LOGE("Unable to find '%s'\n", Tar_File.c_str());
+			return -1;
+		}
+	}
+	for (segment_index = 0; segment_index < TAR_MAX_SEGMENTS; segment_index++) {
+		if (segment_index > 0 && (!split_archive || access(Segment_Name(segment_index).c_str(), F_OK) != 0))
+			break;
+		if (split_archive)
+			ui_print("Restoring archive %i...\n", segment_index + 1);
+		if (!Extract_Archive()) {
+			ret = false;
+			break;
+		}
+	}
+
+	// Folder times are set last since extracting into a folder changes its mtime
+	for (dir = Dir_Times.rbegin(); dir != Dir_Times.rend(); dir++) {
+		struct timeval times[2];
+
+		times[0].tv_sec = times[1].tv_sec = dir->mtime;
+		times[0].tv_usec = times[1].tv_usec = 0;
+		utimes(dir->path.c_str(), times);
+	}
+	Dir_Times.clear();
+	LOGI("Extracted %llu bytes from '%s'\n", bytes_processed, Tar_File.c_str());
+	return ret ? 0 : -1;
+}
+
+bool twrpTar::Extract_Archive() {
+	char header[TAR_BLOCK_SIZE];
+	string Pax_Name, Pax_Link_Name, Pax_SELinux_Context;
+	unsigned long long Pax_Size = 0;
+	bool has_pax_size = false, ret = true;
+
+	if (!Open_Input()) {
+		Close_Input();
+		return false;
+	}
+
+	while (true) {
+		if (buffer_pos == buffer_used && !Fill_Buffer()) {
+			// Every archive file ends with the marker, without it the file was cut short
+			LOGE("Tar '%s' is truncated, no end of archive marker\n", Current_File.c_str());
+			ret = false;
+			break;
+		}
+		if (!Read_Block(header, sizeof(header))) {
+			LOGE("Tar '%s' is truncated\n", Current_File.c_str());
+			ret = false;
+			break;
+		}
+
+		// Two empty blocks end the archive, whatever follows is padding
+		if (Is_Zero_Block(header)) {
+			if (Read_Block(header, sizeof(header)) && !Is_Zero_Block(header)) {
+				LOGE("Invalid end of archive in '%s'\n", Current_File.c_str());
+				ret = false;
+			}
+			break;
+		}
+
+		if (Tar_Parse_Number(header + TAR_CHKSUM, 8) != Tar_Checksum(header)) {
+			LOGE("Invalid tar header checksum in '%s'\n", Current_File.c_str());
+			ret = false;
+			break;
+		}
+
+		char Type = header[TAR_TYPEFLAG];
+		unsigned long long Size = Tar_Parse_Number(header + TAR_SIZE, 12);
+
+		if (Type == 'x' || Type == 'L' || Type == 'K') {
+			// Extended header for the next entry, the size comes from the archive
+			// so it is checked before anything is allocated for it
+			if (Size > TAR_MAX_EXTENDED_SIZE) {
+				LOGE("Extended header of %llu bytes in '%s' is too large\n", Size, Current_File.c_str());
+				ret = false;
+				break;
+			}
+			vector<char> data(Size + 1, 0);
+
+			if (!Read_Block(&data[0], Size) || !Skip_Data((TAR_BLOCK_SIZE - (Size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE)) {
+				ret = false;
+				break;
+			}
+			if (Type == 'L')
+				Pax_Name = &data[0];
+			else if (Type == 'K')
+				Pax_Link_Name = &data[0];
+			else {
+				unsigned long long size = 0;
+
+				Parse_Pax_Records(&data[0], Size, Pax_Name, Pax_Link_Name, size, Pax_SELinux_Context);
+				if (size != 0) {
+					Pax_Size = size;
+					has_pax_size = true;
+				}
+			}
+			continue;
+		} else if (Type == 'g') {
+			// Global extended headers carry nothing we use
+			if (!Skip_Data((Size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE)) {
+				ret = false;
+				break;
+			}
+			continue;
+		}
+
+		string Name = Pax_Name, Link_Name = Pax_Link_Name;
+		if (Name.empty()) {
+			Name = Tar_Field(header + TAR_NAME, 100);
+			if (memcmp(header + TAR_MAGIC, "ustar", 5) == 0 && header[TAR_PREFIX] != '\0')
+				Name = Tar_Field(header + TAR_PREFIX, 155) + "/" + Name;
+		}
+		if (Link_Name.empty())
+			Link_Name = Tar_Field(header + TAR_LINKNAME, 100);
+		if (has_pax_size)
+			Size = Pax_Size;
+
+		if (!Extract_Entry(header, Name, Link_Name, Size, Pax_SELinux_Context)) {
+			if (input_end && buffer_pos == buffer_used) {
+				LOGE("Tar '%s' is truncated\n", Current_File.c_str());
+				ret = false;
+				break;
+			}
+			ret = false;
+		}
+		Pax_Name.clear();
+		Pax_Link_Name.clear();
+		Pax_SELinux_Context.clear();
+		has_pax_size = false;
+	}
+
+	// The MD5 covers the whole file, so the padding after the end of
+	// the archive still has to be read when it is checked
+	if (verify_md5 && !input_end) {
+		buffer_pos = buffer_used;
+		while (Fill_Buffer())
+			buffer_pos = buffer_used;
+	}
+
+	// The threads set input_error, so they have to finish before it is checked
+	Stop_Read_Ahead();
+	if (input_error || verify_failed)
+		ret = false;
+	Close_Input();
+	return ret;
+}
+
+bool twrpTar::Open_Input() {
+	ssize_t len;
+
+	buffer_used = buffer_pos = 0;
+	input_eof = false;
+	input_error = false;
+	input_end = false;
+	input_compressed = false;
+	read_offset = 0;
+	if (buffer == NULL && (buffer = (char*)memalign(4096, TAR_BUFFER_SIZE)) == NULL) {
+		LOGE("Unable to allocate tar buffer\n");
+		return false;
+	}
+	if (zbuffer == NULL && (zbuffer = (char*)memalign(4096, TAR_BUFFER_SIZE)) == NULL) {
+		LOGE("Unable to allocate decompression buffer\n");
+		return false;
+	}
+
+	if (!split_archive && access(Tar_File.c_str(), F_OK) != 0) {
+		Current_File = twrpChunkStore::Index_Name(Tar_File);
+		chunk_store = new twrpChunkStore();
+		if (!chunk_store->Open_Index(Tar_File))
+			return false;
+	} else {
+		Current_File = Segment_Name(segment_index);
+		fd = open(Current_File.c_str(), O_RDONLY | O_LARGEFILE);
+		if (fd < 0) {
+			LOGE("Unable to open '%s': %s\n", Current_File.c_str(), strerror(errno));
+			return false;
+		}
+		MD5Init(&verify_ctx);
+	}
+
+	// Sniff for the gzip magic so that compressed and plain archives both extract
+	len = Read_Raw(zbuffer, TAR_BUFFER_SIZE);
+	if (len < 0)
+		return false;
+	if (len >= 2 && (unsigned char)zbuffer[0] == 0x1f && (unsigned char)zbuffer[1] == 0x8b) {
+		memset(&zstrm, 0, sizeof(zstrm));
+		if (inflateInit2(&zstrm, 15 + 16) != Z_OK) {
+			LOGE("Unable to initialize decompression for '%s'\n", Tar_File.c_str());
+			return false;
+		}
+		zstrm_active = true;
+		input_compressed = true;
+		zstrm.next_in = (Bytef*)zbuffer;
+		zstrm.avail_in = len;
+	} else {
+		memcpy(buffer, zbuffer, len);
+		buffer_used = len;
+	}
+	raw_eof = input_eof;
+
+	// Reading the next split file and decompressing overlap with writing
+	// out the files, without the threads the archive is read as it is used
+	if (!input_eof && !Start_Read_Ahead())
+		LOGI("Unable to start read ahead for '%s', reading as needed\n", Tar_File.c_str());
+	return true;
+}
+
+void twrpTar::Close_Input() {
+	Stop_Read_Ahead();
+	if (zstrm_active) {
+		inflateEnd(&zstrm);
+		zstrm_active = false;
+	}
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+	delete chunk_store;
+	chunk_store = NULL;
+}
+
+ssize_t twrpTar::Read_Raw(char* data, size_t len) {
+	size_t total = 0;
+
+	if (chunk_store != NULL) {
+		ssize_t ret = chunk_store->Read(data, len);
+
+		if (ret < 0)
+			input_error = true;
+		else if ((size_t)ret < len)
+			input_eof = true;
+		return ret;
+	}
+
+	while (total < len && !input_eof) {
+		ssize_t ret = pread64(fd, data + total, len - total, read_offset);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			LOGE("Error reading '%s': %s\n", Current_File.c_str(), strerror(errno));
+			input_error = true;
+			return -1;
+		}
+		if (ret == 0) {
+			Check_File_MD5();
+			if (verify_failed) {
+				input_error = true;
+				return -1;
+			}
+			input_eof = true;
+		}
+		if (verify_md5)
+			MD5Update(&verify_ctx, (unsigned char*)data + total, ret);
+		total += ret;
+		read_offset += ret;
+	}
+	return total;
+}
+
+void twrpTar::Check_File_MD5() {
+	unsigned char expected[16], digest[16];
+
+	if (!verify_md5)
+		return;
+	MD5Final(digest, &verify_ctx);
+	// Archive files without an .md5 are accepted, as with Check_MD5
+	int ret = TWFunc::Read_MD5(Current_File, expected);
+	if (ret == 0 || (ret == 1 && memcmp(expected, digest, sizeof(digest)) != 0)) {
+		LOGE("MD5 failed to match on '%s'.\n", Current_File.c_str());
+		verify_failed = true;
+	}
+}
+
+ssize_t twrpTar::Read_Input(char* data, size_t len) {
+	if (!input_compressed)
+		return Read_Raw(data, len);
+
+	zstrm.next_out = (Bytef*)data;
+	zstrm.avail_out = len;
+	while (zstrm.avail_out > 0) {
+		if (zstrm.avail_in == 0 && !raw_eof) {
+			ssize_t ret = Read_Compressed();
+
+			if (ret < 0)
+				return -1;
+			zstrm.next_in = (Bytef*)zbuffer;
+			zstrm.avail_in = ret;
+		}
+		if (zstrm.avail_in == 0 && raw_eof)
+			break;
+
+		int ret = inflate(&zstrm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			// Concatenated gzip members are valid, keep going if there is more input
+			inflateReset(&zstrm);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LOGE("Decompression error %i in '%s'\n", ret, Tar_File.c_str());
+			input_error = true;
+			return -1;
+		}
+	}
+	return len - zstrm.avail_out;
+}
+
+ssize_t twrpTar::Read_Compressed() {
+	ssize_t len;
+	size_t queued;
+
+	if (raw_queue != NULL) {
+		if (!raw_queue->Swap(&zbuffer, &queued)) {
+			raw_eof = true;
+			return 0;
+		}
+		return queued;
+	}
+	len = Read_Raw(zbuffer, TAR_BUFFER_SIZE);
+	raw_eof = input_eof;
+	return len;
+}
+
+bool twrpTar::Fill_Buffer() {
+	ssize_t len;
+	size_t queued;
+
+	if (data_queue != NULL) {
+		if (!data_queue->Swap(&buffer, &queued)) {
+			input_end = true;
+			return false;
+		}
+		buffer_used = queued;
+		buffer_pos = 0;
+		return true;
+	}
+	if (input_eof && !input_compressed) {
+		input_end = true;
+		return false;
+	}
+	len = Read_Input(buffer, TAR_BUFFER_SIZE);
+	if (len <= 0) {
+		input_end = true;
+		return false;
+	}
+	buffer_used = len;
+	buffer_pos = 0;
+	return true;
+}
+
+bool twrpTar::Start_Read_Ahead() {
+	data_queue = new Block_Queue(TAR_READ_AHEAD_BUFFERS);
+	if (data_queue->Free.empty()) {
+		Stop_Read_Ahead();
+		return false;
+	}
+	if (input_compressed) {
+		raw_queue = new Block_Queue(TAR_READ_AHEAD_BUFFERS);
+		if (raw_queue->Free.empty()) {
+			Stop_Read_Ahead();
+			return false;
+		}
+	}
+	if (pthread_create(&reader_thread, NULL, Reader_Thread, this) != 0) {
+		Stop_Read_Ahead();
+		return false;
+	}
+	reader_active = true;
+	if (input_compressed) {
+		if (pthread_create(&inflate_thread, NULL, Inflate_Thread, this) != 0) {
+			Stop_Read_Ahead();
+			return false;
+		}
+		inflate_active = true;
+	}
+	return true;
+}
+
+void twrpTar::Stop_Read_Ahead() {
+	// Aborting wakes up any thread waiting on a full or empty queue
+	if (data_queue != NULL)
+		data_queue->Abort();
+	if (raw_queue != NULL)
+		raw_queue->Abort();
+	if (inflate_active)
+		pthread_join(inflate_thread, NULL);
+	if (reader_active)
+		pthread_join(reader_thread, NULL);
+	inflate_active = reader_active = false;
+	delete data_queue;
+	delete raw_queue;
+	data_queue = raw_queue = NULL;
+}
+
+void* twrpTar::Reader_Thread(void* cookie) {
+	twrpTar* tar = (twrpTar*)cookie;
+	Block_Queue* queue = tar->input_compressed ? tar->raw_queue : tar->data_queue;
+
+	while (!tar->input_eof) {
+		char* data = queue->Get_Free();
+
+		if (data == NULL)
+			break;
+		ssize_t len = tar->Read_Raw(data, TAR_BUFFER_SIZE);
+		if (len <= 0) {
+			queue->Put_Free(data);
+			break;
+		}
+		queue->Put_Full(data, len);
+	}
+	queue->Close();
+	return NULL;
+}
+
+void* twrpTar::Inflate_Thread(void* cookie) {
+	twrpTar* tar = (twrpTar*)cookie;
+
+	while (true) {
+		char* data = tar->data_queue->Get_Free();
+
+		if (data == NULL)
+			break;
+		ssize_t len = tar->Read_Input(data, TAR_BUFFER_SIZE);
+		if (len <= 0) {
+			tar->data_queue->Put_Free(data);
+			break;
+		}
+		tar->data_queue->Put_Full(data, len);
+	}
+	tar->data_queue->Close();
+	// Nothing more will be read from raw_queue, let the reader stop too
+	tar->raw_queue->Abort();
+	return NULL;
+}
+
+bool twrpTar::Read_Block(char* data, size_t len) {
+	while (len > 0) {
+		if (buffer_pos == buffer_used && !Fill_Buffer())
+			return false;
+
+		size_t chunk = buffer_used - buffer_pos;
+		if (chunk > len)
+			chunk = len;
+		memcpy(data, buffer + buffer_pos, chunk);
+		buffer_pos += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+bool twrpTar::Skip_Data(unsigned long long Size) {
+	while (Size > 0) {
+		if (buffer_pos == buffer_used && !Fill_Buffer())
+			return false;
+
+		size_t chunk = buffer_used - buffer_pos;
+		if (chunk > Size)
+			chunk = (size_t)Size;
+		buffer_pos += chunk;
+		Size -= chunk;
+	}
+	return true;
+}
+
+bool twrpTar::Parse_Pax_Records(const char* data, size_t len, string& Name, string& Link_Name, unsigned long long& Size, string& SELinux_Context) {
+	size_t pos = 0;
+
+	while (pos < len) {
+		size_t record_len = 0, start = pos;
+
+		while (pos < len && data[pos] >= '0' && data[pos] <= '9') {
+			record_len = record_len * 10 + (data[pos] - '0');
+			pos++;
+		}
+		if (record_len == 0 || start + record_len > len || pos >= len || data[pos] != ' ') {
+			LOGE("Invalid pax header in '%s'\n", Tar_File.c_str());
+			return false;
+		}
+		string Record(data + pos + 1, start + record_len - pos - 2);
+		size_t equal = Record.find("=");
+		if (equal != string::npos) {
+			string Key = Record.substr(0, equal), Value = Record.substr(equal + 1);
+
+			// Contexts may be stored with their terminating NUL
+			if (!Value.empty() && Value[Value.size() - 1] == '\0')
+				Value.resize(Value.size() - 1);
+			if (Key == "path")
+				Name = Value;
+			else if (Key == "linkpath")
+				Link_Name = Value;
+			else if (Key == "size")
+				Size = strtoull(Value.c_str(), NULL, 10);
+			else if (Key == "SCHILY.xattr." SELINUX_XATTR || Key == "RHT." SELINUX_XATTR)
+				SELinux_Context = Value;
+		}
+		pos = start + record_len;
+	}
+	return true;
+}
+
+string twrpTar::Extract_Path(string Name) {
+	string Base = "/";
+	size_t pos;
+
+	// Older backups were made with "cd <path> && tar ./*", newer ones store the full path
+	if (Name.substr(0, 2) == "./")
+		Base = Backup_Dir + "/";
+	while (Name.substr(0, 2) == "./")
+		Name.erase(0, 2);
+	while (!Name.empty() && Name[0] == '/')
+		Name.erase(0, 1);
+	while (!Name.empty() && Name[Name.size() - 1] == '/')
+		Name.resize(Name.size() - 1);
+	if (Name.empty() || Name == ".")
+		return "";
+
+	// Never write outside of the restore location
+	pos = 0;
+	while (pos != string::npos) {
+		size_t next = Name.find("/", pos);
+		string component = Name.substr(pos, next == string::npos ? string::npos : next - pos);
+
+		if (component == "..") {
+			LOGE("Skipping unsafe tar entry '%s'\n", Name.c_str());
+			return "";
+		}
+		pos = (next == string::npos) ? string::npos : next + 1;
+	}
+	return Base + Name;
+}
+
+bool twrpTar::Extract_Entry(char* header, string Name, string Link_Name, unsigned long long Size, string SELinux_Context) {
+	string Path = Extract_Path(Name);
+	char Type = header[TAR_TYPEFLAG];
+	mode_t mode = Tar_Parse_Number(header + TAR_MODE, 8) & 07777;
+	uid_t uid = Tar_Parse_Number(header + TAR_UID, 8);
+	gid_t gid = Tar_Parse_Number(header + TAR_GID, 8);
+	time_t mtime = Tar_Parse_Number(header + TAR_MTIME, 12);
+	bool ret = true;
+
+	if (Path.empty()) {
+		if (Type == '0' || Type == '\0' || Type == '7')
+			return Skip_Data((Size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+		return true;
+	}
+
+	Make_Parent_Dirs(Path);
+	switch (Type) {
+		case '0':
+		case '\0':
+		case '7':
+			ret = Extract_File_Data(Path, Size, mode);
+			break;
+		case '1': {
+			string Target = Extract_Path(Link_Name);
+
+			unlink(Path.c_str());
+			if (Target.empty() || link(Target.c_str(), Path.c_str()) != 0) {
+				LOGE("Unable to create hard link '%s' -> '%s': %s\n", Path.c_str(), Target.c_str(), strerror(errno));
+				return false;
+			}
+			// Ownership, mode and context are shared with the link target
+			return true;
+		}
+		case '2':
+			unlink(Path.c_str());
+			if (symlink(Link_Name.c_str(), Path.c_str()) != 0) {
+				LOGE("Unable to create symlink '%s': %s\n", Path.c_str(), strerror(errno));
+				return false;
+			}
+			break;
+		case '3':
+		case '4': {
+			dev_t dev = makedev(Tar_Parse_Number(header + TAR_DEVMAJOR, 8), Tar_Parse_Number(header + TAR_DEVMINOR, 8));
+
+			unlink(Path.c_str());
+			if (mknod(Path.c_str(), mode | (Type == '3' ? S_IFCHR : S_IFBLK), dev) != 0) {
+				LOGE("Unable to create device node '%s': %s\n", Path.c_str(), strerror(errno));
+				return false;
+			}
+			break;
+		}
+		case '5': {
+			Dir_Time dir;
+
+			if (mkdir(Path.c_str(), mode) != 0 && errno != EEXIST) {
+				LOGE("Unable to create folder '%s': %s\n", Path.c_str(), strerror(errno));
+				return false;
+			}
+			dir.path = Path;
+			dir.mtime = mtime;
+			Dir_Times.push_back(dir);
+			break;
+		}
+		case '6':
+			unlink(Path.c_str());
+			if (mkfifo(Path.c_str(), mode) != 0) {
+				LOGE("Unable to create fifo '%s': %s\n", Path.c_str(), strerror(errno));
+				return false;
+			}
+			break;
+		default:
+			LOGI("Skipping unsupported tar entry type '%c' for '%s'\n", Type, Path.c_str());
+			return Skip_Data((Size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+	}
+
+	// chown before chmod since chown clears the setuid and setgid bits
+	if (lchown(Path.c_str(), uid, gid) != 0)
+		LOGI("Unable to set owner of '%s': %s\n", Path.c_str(), strerror(errno));
+	if (Type != '2') {
+		if (chmod(Path.c_str(), mode) != 0)
+			LOGI("Unable to set mode of '%s': %s\n", Path.c_str(), strerror(errno));
+	}
+	if (!SELinux_Context.empty() && lsetxattr(Path.c_str(), SELINUX_XATTR, SELinux_Context.c_str(), SELinux_Context.size() + 1, 0) != 0)
+		LOGI("Unable to set context of '%s': %s\n", Path.c_str(), strerror(errno));
+	if (Type != '2' && Type != '5') {
+		struct timeval times[2];
+
+		times[0].tv_sec = times[1].tv_sec = mtime;
+		times[0].tv_usec = times[1].tv_usec = 0;
+		utimes(Path.c_str(), times);
+	}
+	return ret;
+}
+
+bool twrpTar::Extract_File_Data(string Path, unsigned long long Size, mode_t mode) {
+	int out_fd;
+	bool ret = true;
+	unsigned long long remaining = Size;
+
+	unlink(Path.c_str());
+	out_fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, mode);
+	if (out_fd < 0) {
+		LOGE("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		ret = false;
+	}
+
+	// Write straight out of the read buffer to avoid another copy
+	while (remaining > 0) {
+		if (buffer_pos == buffer_used && !Fill_Buffer()) {
+			if (out_fd >= 0)
+				close(out_fd);
+			return false;
+		}
+
+		size_t chunk = buffer_used - buffer_pos;
+		if (chunk > remaining)
+			chunk = (size_t)remaining;
+		if (out_fd >= 0) {
+			size_t done = 0;
+
+			while (done < chunk) {
+				ssize_t written = write(out_fd, buffer + buffer_pos + done, chunk - done);
+
+				if (written < 0 && errno == EINTR)
+					continue;
+				if (written <= 0) {
+					LOGE("Error writing '%s': %s\n", Path.c_str(), strerror(errno));
+					close(out_fd);
+					out_fd = -1;
+					ret = false;
+					break;
+				}
+				done += written;
+			}
+		}
+		buffer_pos += chunk;
+		remaining -= chunk;
+		bytes_processed += chunk;
+	}
+	if (out_fd >= 0 && close(out_fd) != 0) {
+		LOGE("Error closing '%s': %s\n", Path.c_str(), strerror(errno));
+		ret = false;
+	}
+	if (!Skip_Data((TAR_BLOCK_SIZE - (Size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE))
+		return false;
+	return ret;
+}
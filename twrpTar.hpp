@@ -0,0 +1,205 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPTAR_HPP
+#define _TWRPTAR_HPP
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <zlib.h>
+#include "digest/md5.h"
+#include "twrpChunkStore.hpp"
+
+using namespace std;
+
+// Size of the aligned buffers used for reading and writing archives
+#define TAR_BUFFER_SIZE (1024 * 1024)
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_SEGMENTS 10000                                                  // Limit on .win000 style files for one archive
+#define TAR_READ_AHEAD_BUFFERS 4                                                // Buffers between each restore stage, bounds read ahead memory to 8MB
+#define TAR_MAX_EXTENDED_SIZE (256 * 1024)                                      // Largest pax or GNU long name header accepted when extracting
+
+// In-process tar writer and reader used for file system backups
+class twrpTar {
+public:
+	twrpTar();
+	virtual ~twrpTar();
+
+public:
+	int Create_Tar();                                                         // Archives Backup_Dir into Tar_File, returns 0 on success
+	int Extract_Tar();                                                        // Extracts Tar_File, or the separate archives Tar_File000, Tar_File001..., returns 0 on success
+	void Set_Dir(string Dir);                                                 // Folder to back up, also the base folder for "./" entries on restore
+	void Set_Filename(string Filename);                                       // Archive file to write or read
+	void Set_Exclude(string Path);                                            // Adds a full path that will not be archived (e.g. /data/media)
+	void Set_Compression(bool Compress);                                      // Write a gzip compressed archive
+	void Set_Compression_Threads(int Threads);                                // Threads used for compression, 0 for one per CPU, 1 for in-process zlib
+	void Set_MD5(bool Generate);                                              // Hash the archive as it is written and create Tar_File.md5 when it is closed
+	void Set_Split_Size(unsigned long long Size);                             // Write separate archives Tar_File000, Tar_File001... of about Size bytes of tar data each, 0 for one file
+	void Set_Chunk_Store(string Store_Folder);                                // Store the archive as chunks in Store_Folder with an index in place of Tar_File, compression is done per chunk
+	void Set_Verify(bool Verify);                                             // Check each archive file against its .md5 as it is extracted
+	bool Get_Verify_Failed();                                                 // True if an archive file did not match its .md5
+	int Get_Segment_Count();                                                  // Number of files written for a split archive
+	unsigned long long Get_Bytes_Processed();                                 // Bytes of file data archived or extracted so far
+	unsigned long long Get_Archive_Size();                                    // Bytes written to the archive file(s)
+	void Set_Manifest(string Manifest_File);                                  // Writes the path, size, mtime, ctime, mode and MD5 of every entry to Manifest_File
+	bool Set_Previous_Manifest(string Manifest_File, string Parent);          // Only archive what changed since Manifest_File, Parent is recorded as the backup this one builds on
+	int Get_Unchanged_Count();                                                // Number of files left out of an incremental archive
+	static string Get_Manifest_Parent(string Manifest_File);                  // Backup an incremental manifest builds on, empty for a full backup
+	static bool Apply_Deletions(string Manifest_File);                        // Removes the paths an incremental backup recorded as deleted
+
+private:
+	struct Hardlink_Key {
+		dev_t dev;
+		ino_t ino;
+		bool operator<(const Hardlink_Key& other) const {
+			if (dev != other.dev)
+				return dev < other.dev;
+			return ino < other.ino;
+		}
+	};
+	struct Dir_Time {
+		string path;
+		time_t mtime;
+	};
+	struct Manifest_Entry {
+		mode_t mode;
+		unsigned long long size;
+		time_t mtime;
+		time_t ctime;                                                         // A changed ctime with the same mtime has the data hashed again
+		string md5;                                                           // Hex digest of the file data, "-" for anything else
+	};
+
+	// Writing
+	bool Open_Output();
+	bool Close_Output();
+	bool Start_Compression();                                                 // Starts compressing the current file if compression is on
+	bool Finish_Archive();                                                    // Writes the end of archive blocks and flushes the compressor
+	bool Split_Segment(struct stat* st);                                      // Moves on to the next split file if the entry does not fit in this one
+	bool Add_Path(string Path);                                               // Adds a path and, for folders, everything below it
+	bool Add_Entry(string Path, struct stat* st);                             // Writes the header and data for one entry
+	bool Write_Header(string Name, string Link_Name, struct stat* st, char Type, unsigned long long Size, string SELinux_Context);
+	bool Write_Pax_Header(string Name, string Records);
+	bool Write_File_Data(string Path, unsigned long long Size);
+	bool Write_Block(const char* data, size_t len);                           // Copies data into the output buffer
+	bool Pad_Block();                                                         // Pads the output buffer to the next 512 byte boundary
+	bool Flush_Buffer();
+	bool Write_Output(const char* data, size_t len);                          // Writes buffered archive data to the file, compressing if needed
+	bool Write_File(const char* data, size_t len);                            // Writes to the archive file and updates the MD5
+	bool Write_MD5_File();                                                    // Creates the md5sum compatible .md5 file for Current_File
+	bool Open_Segment();                                                      // Opens the output file for segment_index and restarts the MD5
+	bool Close_Segment();
+	string Segment_Name(int Index);                                           // Name of a split archive file, or Tar_File if not split
+	bool Is_Excluded(string Path);
+	string Archive_Name(string Path);                                         // Converts a full path into the name stored in the archive
+	bool Start_Pigz(int Threads);                                             // Starts the parallel compressor reading from pigz_fd
+	bool Stop_Pigz();
+	static void* Pigz_Thread(void* cookie);
+	static void Pigz_Write(void* cookie, const unsigned char* buf, size_t len); // Receives compressed data from pigz
+	void Set_Write_Error();                                                   // write_error is also set from the pigz thread
+	bool Has_Write_Error();
+	bool Open_Manifest();
+	bool Close_Manifest();                                                    // Writes the deletion list and closes the manifest
+	bool Check_Unchanged(string Path, struct stat* st);                       // True if Path is in the previous manifest as is and can be left out
+	void Write_Manifest_Entry(string Path, struct stat* st, string MD5);
+	static string MD5_Hex(const unsigned char* Digest);
+	static bool Load_Manifest(string Manifest_File, map<string, Manifest_Entry>* Entries, string* Parent, vector<string>* Deleted);
+
+	// Reading
+	bool Extract_Archive();                                                   // Extracts the file for segment_index up to its end of archive marker
+	bool Open_Input();
+	void Close_Input();
+	bool Fill_Buffer();                                                       // Refills the read buffer, false at the end of the archive
+	bool Read_Block(char* data, size_t len);                                  // Reads exactly len bytes of archive data
+	bool Skip_Data(unsigned long long Size);
+	ssize_t Read_Raw(char* data, size_t len);                                 // Reads archive file data
+	ssize_t Read_Input(char* data, size_t len);                               // Reads decompressed archive data
+	void Check_File_MD5();                                                    // Compares the MD5 of the archive file just read with its .md5
+	ssize_t Read_Compressed();                                                // Gets the next compressed archive data into zbuffer, 0 at the end
+	bool Start_Read_Ahead();                                                  // Starts the threads that read and decompress ahead of extraction
+	void Stop_Read_Ahead();
+	static void* Reader_Thread(void* cookie);                                 // Reads the archive files into raw_queue, or data_queue if not compressed
+	static void* Inflate_Thread(void* cookie);                                // Decompresses raw_queue into data_queue
+	bool Extract_Entry(char* header, string Name, string Link_Name, unsigned long long Size, string SELinux_Context);
+	bool Extract_File_Data(string Path, unsigned long long Size, mode_t mode);
+	bool Parse_Pax_Records(const char* data, size_t len, string& Name, string& Link_Name, unsigned long long& Size, string& SELinux_Context);
+	string Extract_Path(string Name);                                         // Converts an archive name into the full path on the device
+
+private:
+	string Backup_Dir;
+	string Tar_File;
+	string Current_File;                                                      // File currently being written or read
+	vector<string> Excludes;
+	bool use_compression;
+	unsigned long long split_size;
+	unsigned long long segment_data_size;                                     // Uncompressed tar bytes in the current file
+	int segment_entries;
+	int segment_index;
+	bool split_archive;
+	int compression_threads;
+	int pigz_fd;                                                              // Write end of the pipe feeding pigz
+	int pigz_read_fd;
+	int pigz_threads;
+	pthread_t pigz_thread;
+	bool pigz_active;
+	bool generate_md5;
+	struct MD5Context md5_ctx;
+	bool verify_md5;
+	bool verify_failed;
+	struct MD5Context verify_ctx;                                             // MD5 of the archive file being read
+	int fd;
+	char* buffer;                                                             // Aligned TAR_BUFFER_SIZE buffer for archive blocks
+	size_t buffer_used;
+	size_t buffer_pos;
+	z_stream zstrm;
+	bool zstrm_active;
+	char* zbuffer;                                                            // Compressed data waiting to be written or inflated
+	bool input_compressed;
+	bool input_eof;
+	bool input_error;
+	bool input_end;                                                           // Extraction has used all of the archive data
+	bool raw_eof;                                                             // No compressed data is left for inflate
+	bool write_error;                                                         // Guarded by output_lock, see Set_Write_Error
+	unsigned long long read_offset;                                           // Position in Current_File
+	struct Block_Queue;                                                       // Filled TAR_BUFFER_SIZE buffers passed from one restore stage to the next
+	Block_Queue* raw_queue;                                                   // Compressed archive data waiting for inflate
+	Block_Queue* data_queue;                                                  // Tar data waiting for extraction
+	pthread_t reader_thread;
+	pthread_t inflate_thread;
+	bool reader_active;
+	bool inflate_active;
+	string chunk_store_folder;
+	twrpChunkStore* chunk_store;                                              // Set while writing to or reading from a chunk store
+	unsigned long long bytes_processed;
+	unsigned long long archive_size;                                          // Guarded by output_lock, Write_File runs on the pigz thread
+	pthread_mutex_t output_lock;
+	map<Hardlink_Key, string> Hardlinks;
+	vector<Dir_Time> Dir_Times;
+	string manifest_file;
+	string manifest_parent;
+	FILE* manifest_fp;
+	map<string, Manifest_Entry> Previous_Entries;                             // Entries of the previous manifest not seen yet in this backup
+	vector<string> Deleted;                                                   // Paths to remove before extracting this archive on top of its parent
+	string file_md5;                                                          // MD5 of the last file archived, for the manifest
+	int unchanged_count;
+};
+
+#endif // _TWRPTAR_HPP
@@ -0,0 +1,275 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "twrpWipe.hpp"
+#include "common.h"
+#include "ui.h"
+
+extern RecoveryUI* ui;
+
+using namespace std;
+
+twrpWipe::twrpWipe() {
+	Show_Progress = false;
+	Next_Job = 0;
+	Jobs_Done = 0;
+	Removed_Count = 0;
+	Errors = 0;
+	pthread_mutex_init(&Lock, NULL);
+}
+
+twrpWipe::~twrpWipe() {
+	pthread_mutex_destroy(&Lock);
+}
+
+void twrpWipe::Add_Exclusion(string Name) {
+	Exclusions.insert(Name);
+}
+
+void twrpWipe::Set_Progress(bool Show) {
+	Show_Progress = Show;
+}
+
+unsigned long long twrpWipe::Get_Removed_Count() {
+	return Removed_Count;
+}
+
+void twrpWipe::Report_Error(const char* Name, int Error) {
+	pthread_mutex_lock(&Lock);
+	// One error is enough to show, a read only folder can fail thousands of times
+	if (Errors == 0)
+		LOGE("Unable to remove '%s' (%s)\n", Name, strerror(Error));
+	else
+		LOGI("Unable to remove '%s' (%s)\n", Name, strerror(Error));
+	Errors++;
+	pthread_mutex_unlock(&Lock);
+}
+
+bool twrpWipe::Remove_Entry(int Parent_fd, const char* Name, bool Is_Folder, unsigned long long* Removed) {
+	struct dirent* de;
+	bool ret = true;
+	DIR* d;
+	int fd;
+
+	if (!Is_Folder) {
+		if (unlinkat(Parent_fd, Name, 0) == 0) {
+			(*Removed)++;
+			return true;
+		}
+		if (errno == ENOENT)
+			return true;
+		// Folders fail with EISDIR, or EPERM on older kernels
+		if (errno != EISDIR && errno != EPERM) {
+			Report_Error(Name, errno);
+			return false;
+		}
+	}
+
+	fd = openat(Parent_fd, Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return true;
+		if (errno == ENOTDIR && Is_Folder)
+			return Remove_Entry(Parent_fd, Name, false, Removed);
+		Report_Error(Name, errno);
+		return false;
+	}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		Report_Error(Name, errno);
+		close(fd);
+		return false;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (!Remove_Entry(fd, de->d_name, de->d_type == DT_DIR, Removed))
+			ret = false;
+	}
+	closedir(d);
+
+	if (unlinkat(Parent_fd, Name, AT_REMOVEDIR) != 0) {
+		if (ret)
+			Report_Error(Name, errno);
+		return false;
+	}
+	(*Removed)++;
+	return ret;
+}
+
+void* twrpWipe::Wipe_Thread(void* cookie) {
+	twrpWipe* wipe = (twrpWipe*)cookie;
+
+	pthread_mutex_lock(&wipe->Lock);
+	while (wipe->Next_Job < wipe->Jobs.size()) {
+		Wipe_Job* Job = &wipe->Jobs[wipe->Next_Job++];
+		unsigned long long Removed = 0;
+
+		pthread_mutex_unlock(&wipe->Lock);
+		wipe->Remove_Entry(Job->Parent_fd, Job->Name.c_str(), false, &Removed);
+		pthread_mutex_lock(&wipe->Lock);
+		wipe->Removed_Count += Removed;
+		wipe->Jobs_Done++;
+		if (wipe->Show_Progress)
+			ui->SetProgress(wipe->Jobs_Done / (float)wipe->Jobs.size());
+	}
+	pthread_mutex_unlock(&wipe->Lock);
+	return NULL;
+}
+
+void twrpWipe::Run_Jobs() {
+	vector<pthread_t> Threads;
+	size_t i, Thread_Count;
+	long cpus;
+
+	Next_Job = 0;
+	Jobs_Done = 0;
+	if (Show_Progress)
+		ui->SetProgress(0.0);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	Thread_Count = cpus < 1 ? 1 : (cpus > WIPE_MAX_THREADS ? WIPE_MAX_THREADS : cpus);
+	if (Thread_Count > Jobs.size())
+		Thread_Count = Jobs.size();
+	// The calling thread takes jobs as well
+	for (i = 1; i < Thread_Count; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, Wipe_Thread, this) != 0)
+			break;
+		Threads.push_back(thread);
+	}
+	Wipe_Thread(this);
+	for (i = 0; i < Threads.size(); i++)
+		pthread_join(Threads[i], NULL);
+	Jobs.clear();
+}
+
+bool twrpWipe::Remove_Contents(string Folder) {
+	vector<pair<string, DIR*> > Top_Folders;
+	vector<string> Names;
+	struct dirent* de;
+	struct stat st;
+	size_t i;
+	DIR* d;
+	int fd;
+
+	Removed_Count = 0;
+	Errors = 0;
+	fd = open(Folder.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		LOGE("Unable to open '%s' (%s)\n", Folder.c_str(), strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (Exclusions.find(de->d_name) != Exclusions.end())
+			continue;
+		Names.push_back(de->d_name);
+	}
+
+	// Everything one level down becomes a job, so that a single big folder
+	// like /data/data is still split between the threads
+	for (i = 0; i < Names.size(); i++) {
+		const char* Name = Names[i].c_str();
+		int sub_fd;
+		DIR* sub;
+
+		if (fstatat(fd, Name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) {
+			Remove_Entry(fd, Name, false, &Removed_Count);
+			continue;
+		}
+		sub_fd = openat(fd, Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub_fd < 0 || (sub = fdopendir(sub_fd)) == NULL) {
+			Report_Error(Name, errno);
+			if (sub_fd >= 0)
+				close(sub_fd);
+			continue;
+		}
+		while ((de = readdir(sub)) != NULL) {
+			Wipe_Job Job;
+
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			Job.Parent_fd = sub_fd;
+			Job.Name = de->d_name;
+			Jobs.push_back(Job);
+		}
+		// The DIR keeps sub_fd open for the jobs and is closed below
+		Top_Folders.push_back(make_pair(Names[i], sub));
+	}
+	Run_Jobs();
+
+	for (i = 0; i < Top_Folders.size(); i++) {
+		closedir(Top_Folders[i].second);
+		if (unlinkat(fd, Top_Folders[i].first.c_str(), AT_REMOVEDIR) == 0)
+			Removed_Count++;
+		else
+			Report_Error(Top_Folders[i].first.c_str(), errno);
+	}
+	closedir(d);
+	LOGI("Removed %llu files and folders from '%s'\n", Removed_Count, Folder.c_str());
+	return Errors == 0;
+}
+
+bool twrpWipe::Remove(string Path) {
+	set<string> Saved_Exclusions;
+	struct stat st;
+	bool ret;
+
+	if (lstat(Path.c_str(), &st) != 0)
+		return errno == ENOENT;
+	if (!S_ISDIR(st.st_mode)) {
+		Removed_Count = 0;
+		Errors = 0;
+		if (unlink(Path.c_str()) != 0) {
+			Report_Error(Path.c_str(), errno);
+			return false;
+		}
+		Removed_Count = 1;
+		return true;
+	}
+
+	// Exclusions only apply to Remove_Contents
+	Saved_Exclusions.swap(Exclusions);
+	ret = Remove_Contents(Path);
+	Exclusions.swap(Saved_Exclusions);
+	if (rmdir(Path.c_str()) != 0) {
+		if (ret)
+			Report_Error(Path.c_str(), errno);
+		return false;
+	}
+	Removed_Count++;
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+	Copyright 2013 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TWRPWIPE_HPP
+#define _TWRPWIPE_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <set>
+
+using namespace std;
+
+#define WIPE_MAX_THREADS 8
+
+// In process rm -rf, the folders one level below the folder being wiped are
+// deleted in parallel with unlinkat() relative to open folder fds
+class twrpWipe {
+public:
+	twrpWipe();
+	virtual ~twrpWipe();
+
+public:
+	void Add_Exclusion(string Name);                                          // Entry directly inside the wiped folder that is kept, e.g. media
+	void Set_Progress(bool Show);                                             // Moves the progress bar as subtrees are deleted
+	bool Remove_Contents(string Folder);                                      // Deletes everything inside Folder except the exclusions, Folder itself stays
+	bool Remove(string Path);                                                 // Deletes Path and everything below it, a missing Path is not an error
+	unsigned long long Get_Removed_Count();                                   // Files and folders deleted by the last call
+
+private:
+	struct Wipe_Job {
+		int Parent_fd;                                                        // Open folder the entry is in, owned by the caller
+		string Name;
+	};
+
+	static void* Wipe_Thread(void* cookie);
+	bool Remove_Entry(int Parent_fd, const char* Name, bool Is_Folder, unsigned long long* Removed); // Deletes one entry, recursing into folders
+	void Run_Jobs();                                                          // Deletes Jobs with up to WIPE_MAX_THREADS threads
+	void Report_Error(const char* Name, int Error);
+
+private:
+	set<string> Exclusions;
+	bool Show_Progress;
+	vector<Wipe_Job> Jobs;
+	size_t Next_Job;
+	size_t Jobs_Done;
+	unsigned long long Removed_Count;
+	int Errors;
+	pthread_mutex_t Lock;                                                     // Guards Next_Job, Jobs_Done, Removed_Count and Errors
+};
+
+#endif // _TWRPWIPE_HPP
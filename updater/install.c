@@ -742,6 +742,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup("");
         goto done;
     }
+    mtd_write_set_delta(ctx, 1);
 
     bool success;
 
@@ -778,6 +779,8 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
     }
+    printf("%s: skipped %d unchanged blocks of %s\n",
+           name, mtd_write_skipped(ctx), partition);
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "%s: error closing write of %s\n", name, partition);
     }
@@ -20,7 +20,14 @@
 #define TW_VERSION_STR              "2.3.2.3"
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_COMPRESSION_THREADS_VAR  "tw_compression_threads"
+#define TW_SPARSE_IMAGE_BACKUP_VAR  "tw_sparse_image_backup"
+#define TW_INCREMENTAL_BACKUP_VAR   "tw_incremental_backup"
+#define TW_DEDUP_BACKUP_VAR         "tw_dedup_backup"
+#define TW_BACKUP_THREADS_VAR       "tw_backup_threads"
+#define TW_DELTA_FLASH_VAR          "tw_delta_flash"
 #define TW_IGNORE_IMAGE_SIZE        "tw_ignore_image_size"
+#define TW_SECURE_DISCARD_VAR       "tw_secure_discard"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT			"tw_zip_queue_count"
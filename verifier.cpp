@@ -20,9 +20,11 @@
 
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
+#include "digest/md5.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 
 extern RecoveryUI* ui;
@@ -35,11 +37,50 @@ extern RecoveryUI* ui;
 // or no key matches the signature).
 
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
-    ui->SetProgress(0.0);
+    return verify_file_md5(path, pKeys, numKeys, NULL, false);
+}
+
+// Same as verify_file, but when md5 is not NULL the MD5 of the whole
+// file is computed from the same reads as the signature's SHA-1, so a
+// package with an .md5 file is only read once.  A quiet verification
+// leaves the progress bar alone and only logs its errors, for checking
+// a package in the background.
+
+#define VERIFY_ERROR(...) do { if (quiet) LOGI(__VA_ARGS__); else LOGE(__VA_ARGS__); } while (0)
+
+// Checks the RSA signature at the end of the EOCD record against the
+// SHA-1 of the signed data, and frees eocd.
+
+static int check_signature(const RSAPublicKey *pKeys, unsigned int numKeys,
+                           unsigned char* eocd, size_t eocd_size,
+                           const uint8_t* sha1, bool quiet) {
+    size_t i;
+    for (i = 0; i < numKeys; ++i) {
+        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
+        // the signing tool appends after the signature itself.
+        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
+                       RSANUMBYTES, sha1)) {
+            LOGI("whole-file signature verified against key %d\n", i);
+            free(eocd);
+            return VERIFY_SUCCESS;
+        }
+    }
+    free(eocd);
+    VERIFY_ERROR("failed to verify whole-file signature\n");
+    return VERIFY_FAILURE;
+}
+
+// When known_sha1 is not NULL it is the SHA-1 of the first known_len
+// bytes of the file, and the file is only read for its signature.
+
+static int verify_file_internal(const char* path, const RSAPublicKey *pKeys,
+                                unsigned int numKeys, unsigned char* md5, bool quiet,
+                                const uint8_t* known_sha1, size_t known_len) {
+    if (!quiet) ui->SetProgress(0.0);
 
     FILE* f = fopen(path, "rb");
     if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        VERIFY_ERROR("failed to open %s (%s)\n", path, strerror(errno));
         return VERIFY_FAILURE;
     }
 
@@ -55,14 +96,14 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 #define FOOTER_SIZE 6
 
     if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
+        VERIFY_ERROR("failed to seek in %s (%s)\n", path, strerror(errno));
         fclose(f);
         return VERIFY_FAILURE;
     }
 
     unsigned char footer[FOOTER_SIZE];
     if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
+        VERIFY_ERROR("failed to read footer from %s (%s)\n", path, strerror(errno));
         fclose(f);
         return VERIFY_FAILURE;
     }
@@ -79,7 +120,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
-        LOGE("signature is too short\n");
+        VERIFY_ERROR("signature is too short\n");
         fclose(f);
         return VERIFY_FAILURE;
     }
@@ -91,7 +132,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
     if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
+        VERIFY_ERROR("failed to seek in %s (%s)\n", path, strerror(errno));
         fclose(f);
         return VERIFY_FAILURE;
     }
@@ -104,12 +145,13 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
     unsigned char* eocd = (unsigned char*)malloc(eocd_size);
     if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
+        VERIFY_ERROR("malloc for EOCD record failed\n");
         fclose(f);
         return VERIFY_FAILURE;
     }
     if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
+        VERIFY_ERROR("failed to read eocd from %s (%s)\n", path, strerror(errno));
+        free(eocd);
         fclose(f);
         return VERIFY_FAILURE;
     }
@@ -118,7 +160,8 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
-        LOGE("signature length doesn't match EOCD marker\n");
+        VERIFY_ERROR("signature length doesn't match EOCD marker\n");
+        free(eocd);
         fclose(f);
         return VERIFY_FAILURE;
     }
@@ -131,57 +174,88 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // the real one, minzip will find the later (wrong) one,
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
-            LOGE("EOCD marker occurs after start of EOCD\n");
+            VERIFY_ERROR("EOCD marker occurs after start of EOCD\n");
+            free(eocd);
             fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
+    if (known_sha1 != NULL) {
+        fclose(f);
+        if (known_len != signed_len) {
+            VERIFY_ERROR("digest covers %zu bytes but %zu are signed\n",
+                         known_len, signed_len);
+            free(eocd);
+            return VERIFY_FAILURE;
+        }
+        return check_signature(pKeys, numKeys, eocd, eocd_size, known_sha1, quiet);
+    }
+
+    // Large reads keep slow SD cards streaming instead of paying for a
+    // request every 4 KB.
+#define BUFFER_SIZE (1024 * 1024)
 
     SHA_CTX ctx;
     SHA_init(&ctx);
+    struct MD5Context md5_ctx;
+    MD5Init(&md5_ctx);
     unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
     if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
+        VERIFY_ERROR("failed to alloc memory for sha1 buffer\n");
+        free(eocd);
         fclose(f);
         return VERIFY_FAILURE;
     }
 
+    // The MD5 covers the whole file, the signature stops before the
+    // comment, so when both are wanted the read goes to the end.
+    size_t total_len = md5 != NULL ? signed_len + eocd_size - EOCD_HEADER_SIZE + 2 : signed_len;
     double frac = -1.0;
     size_t so_far = 0;
     fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
+    while (so_far < total_len) {
         size_t size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
+        if (total_len - so_far < size) size = total_len - so_far;
         if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
+            VERIFY_ERROR("failed to read data from %s (%s)\n", path, strerror(errno));
+            free(buffer);
+            free(eocd);
             fclose(f);
             return VERIFY_FAILURE;
         }
-        SHA_update(&ctx, buffer, size);
+        if (so_far < signed_len) {
+            SHA_update(&ctx, buffer, signed_len - so_far < size ? signed_len - so_far : size);
+        }
+        if (md5 != NULL) {
+            MD5Update(&md5_ctx, buffer, size);
+        }
         so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
+        double f = so_far / (double)total_len;
+        if (!quiet && (f > frac + 0.02 || size == so_far)) {
             ui->SetProgress(f);
             frac = f;
         }
     }
     fclose(f);
     free(buffer);
-
-    const uint8_t* sha1 = SHA_final(&ctx);
-    for (i = 0; i < numKeys; ++i) {
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
-                       RSANUMBYTES, sha1)) {
-            LOGI("whole-file signature verified against key %d\n", i);
-            free(eocd);
-            return VERIFY_SUCCESS;
-        }
+    if (md5 != NULL) {
+        MD5Final(md5, &md5_ctx);
     }
-    free(eocd);
-    LOGE("failed to verify whole-file signature\n");
-    return VERIFY_FAILURE;
+
+    return check_signature(pKeys, numKeys, eocd, eocd_size, SHA_final(&ctx), quiet);
+}
+
+int verify_file_md5(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys,
+                    unsigned char* md5, bool quiet) {
+    return verify_file_internal(path, pKeys, numKeys, md5, quiet, NULL, 0);
+}
+
+// Checks the signature of a file whose signed data was already hashed,
+// for example while it was being received.  Only the end of the file is
+// read.
+
+int verify_file_sha1(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys,
+                     const uint8_t* sha1, size_t signed_len) {
+    return verify_file_internal(path, pKeys, numKeys, NULL, false, sha1, signed_len);
 }
@@ -24,6 +24,21 @@
  */
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys);
 
+/* Same as verify_file, and if md5 is not NULL it is filled with the MD5
+ * of the whole file, computed in the same pass over the file.  md5 is
+ * only valid when VERIFY_SUCCESS is returned.  With quiet set the
+ * progress bar is not touched and errors are only logged.
+ */
+int verify_file_md5(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys,
+                    unsigned char* md5, bool quiet);
+
+/* Same as verify_file for a file whose first signed_len bytes are known
+ * to hash to sha1, only the signature at the end of the file is read.
+ * Fails if signed_len is not the length the signature covers.
+ */
+int verify_file_sha1(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys,
+                     const uint8_t* sha1, size_t signed_len);
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 